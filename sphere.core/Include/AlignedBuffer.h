@@ -0,0 +1,141 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#define CACHE_LINE_SIZE 64
+
+// Fixed size, zero-initialized array whose storage starts on a cache line boundary. Used for
+// the large contiguous matrices in Memory so rows can be streamed with aligned vector loads.
+// Only meant for trivially copyable types. A buffer can also be a view of storage it doesn't own,
+// such as a mapped file; copies of a view own their storage.
+
+template <class T>
+class AlignedBuffer
+{
+public:
+	AlignedBuffer()
+		: data(nullptr)
+		, count(0)
+	{
+	}
+
+	AlignedBuffer(size_t count)
+		: data(nullptr)
+		, count(0)
+	{
+		Allocate(count);
+	}
+
+	AlignedBuffer(const AlignedBuffer& other)
+		: data(nullptr)
+		, count(0)
+	{
+		CopyFrom(other);
+	}
+
+	AlignedBuffer(AlignedBuffer&& other)
+		: data(other.data)
+		, count(other.count)
+		, owner(std::move(other.owner))
+	{
+		other.data = nullptr;
+		other.count = 0;
+	}
+
+	AlignedBuffer& operator=(const AlignedBuffer& other)
+	{
+		if (this != &other)
+			CopyFrom(other);
+
+		return *this;
+	}
+
+	AlignedBuffer& operator=(AlignedBuffer&& other)
+	{
+		if (this != &other)
+		{
+			Free();
+			data = other.data;
+			count = other.count;
+			owner = std::move(other.owner);
+			other.data = nullptr;
+			other.count = 0;
+		}
+
+		return *this;
+	}
+
+	~AlignedBuffer()
+	{
+		Free();
+	}
+
+	// Discards the current contents and allocates Count zeroed elements
+	void Allocate(size_t Count)
+	{
+		Free();
+
+		if (Count == 0)
+			return;
+
+		data = static_cast<T*>(::operator new[](Count * sizeof(T), std::align_val_t(CACHE_LINE_SIZE)));
+		count = Count;
+		memset(data, 0, count * sizeof(T));
+	}
+
+	// Discards the current contents and makes the buffer a view of Count elements at Data, which
+	// has to start on a cache line. Owner keeps the storage alive for as long as the view exists.
+	void Adopt(T* Data, size_t Count, std::shared_ptr<void> Owner)
+	{
+		Free();
+
+		data = Data;
+		count = Count;
+		owner = std::move(Owner);
+	}
+
+	bool IsView() const { return owner != nullptr; }
+
+	T& operator[](size_t index) { return data[index]; }
+	const T& operator[](size_t index) const { return data[index]; }
+
+	const size_t Count() const { return count; }
+	const size_t Size() const { return count * sizeof(T); }
+	const T* Ptr() const { return data; }
+	T* Ptr() { return data; }
+
+	// Rounds a row length up so consecutive rows each start on a cache line
+	static size_t PaddedRowLength(size_t Length)
+	{
+		const size_t per_line = CACHE_LINE_SIZE / sizeof(T);
+		return ((Length + per_line - 1) / per_line) * per_line;
+	}
+
+private:
+	T* data;
+	size_t count;
+	std::shared_ptr<void> owner;
+
+	void CopyFrom(const AlignedBuffer& other)
+	{
+		Allocate(other.count);
+
+		if (count > 0)
+			memcpy(data, other.data, count * sizeof(T));
+	}
+
+	void Free()
+	{
+		if (owner)
+			owner.reset();
+		else if (data != nullptr)
+			::operator delete[](data, std::align_val_t(CACHE_LINE_SIZE));
+
+		data = nullptr;
+		count = 0;
+	}
+};
@@ -0,0 +1,66 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "AlignedBuffer.h"
+#include "Word.h"
+
+// Number of hard locations whose bits share a plane
+#define BITSLICE_GROUP_SIZE 64
+
+namespace sphere
+{
+	class ThreadPool;
+
+	// Transposed copy of an address matrix. Hard locations are grouped by BITSLICE_GROUP_SIZE and
+	// for every bit of every address integer a group holds one 64-bit plane, whose bit i is that bit
+	// of the group's hard location i. The distance from a query to a whole group is then computed
+	// with bitwise adders: the squared distance is split into |x|^2 + |q|^2 - 2 x.q, the norms of
+	// the hard locations are kept per row and x.q is summed from the planes the query's set bits
+	// select with carry-save adders. Under the Manhattan metric the cross term is the sum of min(x, q)
+	// instead, counted as the number of thresholds up to q that x reaches. Results are exactly
+	// those of Word::SquaredDistanceTo, padding integers included. The circular metrics aren't
+	// supported since folded differences don't split into per-bit terms.
+	class BitSlicedAddresses
+	{
+	public:
+		// The integers of a query grouped into the passes GroupDistances makes over the planes: one per
+		// bit of the values, or one per threshold under the Manhattan metric. Zeros take part in none.
+		struct Query
+		{
+			std::vector<std::vector<uint32_t>> Passes;	// Offsets of the planes of each integer in the pass
+			uint32_t Norm;
+		};
+
+		BitSlicedAddresses();
+
+		void Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric, ThreadPool* Pool);
+		void Set(int Row, const SUBWORD* Addr);
+
+		Query Prepare(const Word& Addr) const;
+
+		// Writes the squared distance from Q to each of the BITSLICE_GROUP_SIZE hard locations in
+		// Group to Out. Entries past the last hard location are meaningless.
+		void GroupDistances(const Query& Q, int Group, uint32_t* Out) const;
+
+		int NumGroups() const { return numGroups; }
+
+	private:
+		uint32_t Term(uint32_t Value) const;
+		uint32_t ValueAt(const SUBWORD* Addr, int Slice) const;
+		uint64_t* GroupPlanes(int Group) { return planes.Ptr() + size_t(Group) * numSlices * rangeBits; }
+		const uint64_t* GroupPlanes(int Group) const { return planes.Ptr() + size_t(Group) * numSlices * rangeBits; }
+
+		AlignedBuffer<uint64_t> planes;		// [group][slice][bit], bit 0 being the least significant
+		std::vector<uint32_t> norms;		// Sum of Term over the integers of each hard location
+		std::vector<uint16_t> sliceSubword;	// Subword holding each integer the distance counts
+		std::vector<uint8_t> sliceShift;	// and its shift within the subword
+		int count;
+		int numGroups;
+		int numSlices;
+		int rangeBits;
+		bool linearTerms;
+	};
+}
@@ -0,0 +1,180 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+namespace sphere
+{
+	// Fixed capacity multi-producer, multi-consumer queue without locks (Vyukov's bounded queue).
+	// Every slot carries a sequence number that tells producers and consumers whose turn it is, so
+	// a push or pop is one compare-exchange on the shared position plus a store to the slot. The
+	// blocking Push and Pop spin with yields and count the operations that had to wait, and Close
+	// lets consumers drain the queue and stop.
+	template <class T>
+	class BoundedQueue
+	{
+	public:
+		// Capacity is rounded up to a power of two
+		BoundedQueue(size_t Capacity)
+			: mask(RoundUp(Capacity) - 1)
+			, cells(new Cell[mask + 1])
+			, pushPos(0)
+			, popPos(0)
+			, pushStalls(0)
+			, popStalls(0)
+			, closed(false)
+		{
+			for (size_t i = 0; i <= mask; i++)
+				cells[i].Sequence.store(i, std::memory_order_relaxed);
+		}
+
+		BoundedQueue(const BoundedQueue&) = delete;
+		BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+		bool TryPush(T&& Item)
+		{
+			size_t pos = pushPos.load(std::memory_order_relaxed);
+
+			while (true)
+			{
+				Cell& cell = cells[pos & mask];
+				size_t seq = cell.Sequence.load(std::memory_order_acquire);
+				intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+				if (diff == 0)
+				{
+					if (pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						cell.Item = std::move(Item);
+						cell.Sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = pushPos.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		bool TryPop(T& Item)
+		{
+			size_t pos = popPos.load(std::memory_order_relaxed);
+
+			while (true)
+			{
+				Cell& cell = cells[pos & mask];
+				size_t seq = cell.Sequence.load(std::memory_order_acquire);
+				intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+
+				if (diff == 0)
+				{
+					if (popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						Item = std::move(cell.Item);
+						cell.Sequence.store(pos + mask + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = popPos.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Waits for a free slot; returns false if the queue was closed meanwhile
+		bool Push(T&& Item)
+		{
+			if (TryPush(std::move(Item)))
+				return true;
+
+			pushStalls.fetch_add(1, std::memory_order_relaxed);
+
+			while (!TryPush(std::move(Item)))
+			{
+				if (closed.load(std::memory_order_acquire))
+					return false;
+
+				std::this_thread::yield();
+			}
+
+			return true;
+		}
+
+		// Waits for an item; returns false once the queue is closed and empty
+		bool Pop(T& Item)
+		{
+			if (TryPop(Item))
+				return true;
+
+			popStalls.fetch_add(1, std::memory_order_relaxed);
+
+			while (!TryPop(Item))
+			{
+				// Items pushed before Close are still popped
+				if (closed.load(std::memory_order_acquire))
+					return TryPop(Item);
+
+				std::this_thread::yield();
+			}
+
+			return true;
+		}
+
+		// Called by the producers once they're done
+		void Close() { closed.store(true, std::memory_order_release); }
+		bool IsClosed() const { return closed.load(std::memory_order_acquire); }
+
+		// Approximate number of items queued; exact when nothing is pushing or popping
+		size_t Depth() const
+		{
+			size_t pushed = pushPos.load(std::memory_order_relaxed);
+			size_t popped = popPos.load(std::memory_order_relaxed);
+			return pushed > popped ? pushed - popped : 0;
+		}
+
+		size_t Capacity() const { return mask + 1; }
+
+		// Number of Push calls that found the queue full and Pop calls that found it empty
+		uint64_t PushStalls() const { return pushStalls.load(std::memory_order_relaxed); }
+		uint64_t PopStalls() const { return popStalls.load(std::memory_order_relaxed); }
+
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> Sequence;
+			T Item;
+		};
+
+		static size_t RoundUp(size_t Capacity)
+		{
+			size_t size = 2;
+			while (size < Capacity)
+				size <<= 1;
+
+			return size;
+		}
+
+		const size_t mask;
+		std::unique_ptr<Cell[]> cells;
+
+		// The positions are on their own cache lines so producers and consumers don't contend
+		alignas(64) std::atomic<size_t> pushPos;
+		alignas(64) std::atomic<size_t> popPos;
+		alignas(64) std::atomic<uint64_t> pushStalls;
+		std::atomic<uint64_t> popStalls;
+		std::atomic<bool> closed;
+	};
+}
@@ -0,0 +1,89 @@
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+// Block size of buffered memory file reads and writes
+#define STREAM_BUFFER_SIZE (4 * 1024 * 1024)
+
+namespace sphere
+{
+	// Collects the many small writes of a serializer and hands them to the stream in blocks of
+	// Capacity bytes. A Capacity of 0 keeps everything until Flush, which has to be called at the end.
+	class BufferedStreamWriter
+	{
+	public:
+		BufferedStreamWriter(std::ostream& Stream, size_t Capacity = STREAM_BUFFER_SIZE);
+
+		// Room for the next Size bytes, which the caller fills in right away
+		uint8_t* Reserve(size_t Size)
+		{
+			if (used + Size > buffer.size())
+				Grow(Size);
+
+			uint8_t* out = buffer.data() + used;
+			used += Size;
+			return out;
+		}
+
+		void Write(const void* Data, size_t Size) { memcpy(Reserve(Size), Data, Size); }
+
+		template <class T>
+		void Put(T Value) { memcpy(Reserve(sizeof(T)), &Value, sizeof(T)); }
+
+		void Flush();
+
+	private:
+		void Grow(size_t Size);
+
+		std::ostream& stream;
+		std::vector<uint8_t> buffer;
+		size_t used;
+		size_t capacity;
+	};
+
+	// Reads a stream in blocks of Capacity bytes and hands out the small pieces a deserializer
+	// asks for. A Capacity of 0 reads exactly what every Take needs, so nothing is read ahead.
+	class BufferedStreamReader
+	{
+	public:
+		BufferedStreamReader(std::istream& Stream, size_t Capacity = STREAM_BUFFER_SIZE);
+
+		// The next Size bytes, valid until the next call. Throws if the stream ends first.
+		const uint8_t* Take(size_t Size)
+		{
+			if (end - pos < Size)
+				Refill(Size);
+
+			const uint8_t* in = buffer.data() + pos;
+			pos += Size;
+			return in;
+		}
+
+		void Read(void* Out, size_t Size) { memcpy(Out, Take(Size), Size); }
+
+		template <class T>
+		T Get()
+		{
+			T value;
+			memcpy(&value, Take(sizeof(T)), sizeof(T));
+			return value;
+		}
+
+		// Gives back what was read ahead, leaving the stream right after the last piece taken
+		void Finish();
+
+	private:
+		void Refill(size_t Size);
+
+		std::istream& stream;
+		std::vector<uint8_t> buffer;
+		size_t pos;
+		size_t end;
+		size_t capacity;
+	};
+}
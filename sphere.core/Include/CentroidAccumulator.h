@@ -0,0 +1,33 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Word.h"
+
+namespace sphere
+{
+	// Sums packed address rows integer by integer so that their rounded mean can be used as a
+	// centroid. Padding integers in the last subword are averaged like the rest so the centroid
+	// lives in the same space the distance kernels measure.
+	class CentroidAccumulator
+	{
+	public:
+		CentroidAccumulator(int NumSubwords, int RangeBits);
+
+		void Add(const SUBWORD* Row);
+		void Clear();
+		uint64_t Count() const { return count; }
+
+		// Writes the rounded mean of the added rows to Out, which must hold NumSubwords subwords
+		void Mean(SUBWORD* Out) const;
+
+	private:
+		std::vector<uint64_t> sums;
+		uint64_t count;
+		int numSubwords;
+		int rangeBits;
+		int intsPerSubword;
+	};
+}
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <string>
 
 #define LOG_INFO(FMT,...) sphere::EchoLogMessage("[INFO] " FMT,__VA_ARGS__)
@@ -14,4 +15,13 @@ namespace sphere
 {
 	void EchoLogMessage(const char* fmt...);
 	void SetLogFile(void* handle);
+
+	// Views an element of a plain array as an atomic so it can be updated from several threads at
+	// once; there's no std::atomic_ref before C++20
+	template <class T>
+	inline std::atomic<T>& AsAtomic(T& Value)
+	{
+		static_assert(sizeof(std::atomic<T>) == sizeof(T) && std::atomic<T>::is_always_lock_free, "Type has no lock-free atomic of the same size");
+		return reinterpret_cast<std::atomic<T>&>(Value);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,30 @@
+
+#pragma once
+
+// Marks a function as being compiled for a specific instruction set so it can live next to
+// generic code in the same translation unit. MSVC allows intrinsics without any annotation.
+#if defined(_MSC_VER)
+#define SPHERE_TARGET(isa)
+#else
+#define SPHERE_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace sphere
+{
+	struct CpuFeatures
+	{
+		bool SSSE3;
+		bool SSE41;
+		bool POPCNT;
+		bool AVX2;
+		bool AVX512F;
+		bool AVX512BW;
+		bool AVX512VPOPCNTDQ;
+		bool AVX512VNNI;
+
+		CpuFeatures();
+	};
+
+	// Queried once with CPUID/XGETBV on first use
+	const CpuFeatures& GetCpuFeatures();
+}
@@ -0,0 +1,72 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "Word.h"
+
+namespace sphere
+{
+	enum class KernelISA
+	{
+		Scalar,
+		BytePair,	// Table lookups only, for CPUs without SSE4
+		SSE4,
+		AVX2,
+		AVX512
+	};
+
+	// Sums the per-dimension distances of two packed 4-bit words: squared differences for the
+	// Euclidean metrics, absolute ones for Manhattan, folded first under the circular metrics.
+	// Both arrays must hold NumSubwords subwords.
+	typedef uint32_t (*NibbleDistanceFunc)(const SUBWORD* A, const SUBWORD* B, int NumSubwords);
+
+	// Same as NibbleDistanceFunc but may stop early and return a partial sum once it exceeds Bound
+	typedef uint32_t (*NibbleBoundedDistanceFunc)(const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound);
+
+	// Sum of the products of the integers of two packed 4-bit words. With the squared norms of
+	// both words it gives their linear Euclidean distance as |a|^2 + |b|^2 - 2 a.b.
+	typedef uint32_t (*NibbleDotFunc)(const SUBWORD* A, const SUBWORD* B, int NumSubwords);
+
+	// Hamming distance between two packed 1-bit words. Only the bits set in LastMask count in the
+	// last subword, see Word::LastSubwordMask.
+	typedef uint32_t (*HammingDistanceFunc)(const SUBWORD* A, const SUBWORD* B, int NumSubwords, SUBWORD LastMask);
+
+	// Writes the hamming distance from Query to each of NumRows rows that start Stride subwords
+	// apart to Out, for scanning a whole matrix of addresses with one query
+	typedef void (*HammingBlockFunc)(const SUBWORD* Query, const SUBWORD* Rows, size_t Stride, int NumRows, int NumSubwords, SUBWORD LastMask, uint32_t* Out);
+
+	// Adds a row of Len 16-bit counters to Sums, saturating at UINT16_MAX. Reads sum the counter
+	// rows of the activated hard locations with it.
+	typedef void (*CounterAddFunc)(const uint16_t* Row, uint16_t* Sums, int Len);
+
+	// Same as CounterAddFunc for a row of 8-bit counters
+	typedef void (*NarrowCounterAddFunc)(const uint8_t* Row, uint16_t* Sums, int Len);
+
+	struct DistanceKernels
+	{
+		KernelISA ISA;
+		const char* Name;
+		NibbleDistanceFunc NibbleDistance[NUM_DISTANCE_METRICS];	// Indexed by DistanceMetric
+		NibbleBoundedDistanceFunc NibbleBoundedDistance[NUM_DISTANCE_METRICS];
+		NibbleDotFunc NibbleDot;
+		HammingDistanceFunc HammingDistance;
+		HammingBlockFunc HammingBlock;
+		CounterAddFunc AddCounters;
+		NarrowCounterAddFunc AddNarrowCounters;
+	};
+
+	// The kernels in use; the fastest ones supported by the CPU unless overridden
+	const DistanceKernels& GetDistanceKernels();
+	const DistanceKernels& GetDistanceKernels(KernelISA ISA);
+	void SelectDistanceKernels(KernelISA ISA);
+
+	bool IsKernelSupported(KernelISA ISA);
+
+	// Sums the per-dimension distances of two words of 1-, 2- or 4-bit integers one byte at a time
+	// from a table of every pair of bytes. Every integer of every subword counts, padding included.
+	// Like the bounded kernels it may return a partial sum once it exceeds Bound.
+	uint32_t BytePairDistance(const SUBWORD* A, const SUBWORD* B, int NumSubwords, int RangeBits, DistanceMetric Metric, uint32_t Bound = UINT32_MAX);
+	bool ParseKernelISA(const std::string& Name, KernelISA& ISA);
+}
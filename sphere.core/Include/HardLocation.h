@@ -9,31 +9,76 @@
 
 namespace sphere
 {
+	class BufferedStreamReader;
+	class BufferedStreamWriter;
+	class Memory;
+
+	// Lightweight view of one row in the hard location matrices owned by a Memory. Views are
+	// cheap to create and copy, and stay valid for as long as the memory they refer to.
 	class HardLocation : ISerializable
 	{
 	public:
-		HardLocation(int AddrWordDims, int DataWordDims, int RangeBitLen);
-		HardLocation(std::istream& stream);
+		HardLocation(Memory& Owner, uint32_t Index);
 
 		void Write(const Word& Data);
-		void Read(std::vector<COUNTER>& OutCounters);
+		void Read(int32_t* Sums) const;
+
+		uint32_t Index() const { return index; }
+		int WriteCount() const;
 
-		int WriteCount() const { return writeCount; }
-		const std::vector<uint8_t>& WriteHistory() const { return dataWritten; }
+		// What the memory's write history recorded about the data written here, see
+		// WriteHistoryMode. WriteHistory returns the values kept by a ring, oldest first, and is
+		// empty under the other modes. WriteHistogram fills WRITE_HISTORY_VALUES counts, only
+		// covering what's in the ring under WriteHistoryMode::Ring, and returns false when the
+		// history is off.
+		std::vector<uint8_t> WriteHistory() const;
+		bool WriteHistogram(uint32_t* Counts) const;
 
-		Word& Address() { return addr; }
+		Word Address() const;
+		void SetAddress(const Word& Addr);
+		const SUBWORD* AddressData() const;
 
 		virtual void Serialize(std::ostream& stream) override;
+		void Deserialize(std::istream& stream);
 
 	private:
-		static uint32_t NumInstances;
+		friend class Memory;
+
+		// Write and friends forward to these through the memory's PolicyOps; instantiated for
+		// every counter policy in HardLocation.cpp
+		template <class Counters>
+		void WriteWith(const Word& Data);
+		template <class Counters>
+		void ReadWith(int32_t* Sums) const;
+		template <class Counters>
+		void SerializeCounters(BufferedStreamWriter& Writer);
+		template <class Counters>
+		void DeserializeCounters(BufferedStreamReader& Reader);
+		template <class Counters>
+		void PromoteCounters();
+
+		// The counters as plain values, for the compressed memory files. Importing allocates a row
+		// unless they're all zero and picks its width like DeserializeCounters.
+		template <class Counters>
+		void ExportCounters(int32_t* Values) const;
+		template <class Counters>
+		void ImportCounters(const int32_t* Values);
+		template <class Counters, class ValueFunc>
+		void StoreCounters(const ValueFunc& Value);
+
+		// Hogwild writes, see Memory::BeginConcurrentWrites
+		template <class Counters>
+		void PrepareConcurrentWritesWith();
+		template <class Counters>
+		void WriteConcurrentWith(const Word& Data);
+		template <class Counters>
+		void CompactCountersWith();
 
-		uint32_t id;
-		uint32_t writeCount;
-		uint16_t dataDims;
-		Word addr;
-		std::vector<COUNTER> counters;
+		// Records of the dense memory files, or of the sparse ones, see SPARSE_FILE_PREFIX
+		void SerializeRecord(BufferedStreamWriter& Writer, bool Sparse);
+		void DeserializeRecord(BufferedStreamReader& Reader, bool Sparse);
 
-		std::vector<uint8_t> dataWritten;
+		Memory* mem;
+		uint32_t index;
 	};
-}
\ No newline at end of file
+}
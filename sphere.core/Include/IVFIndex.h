@@ -0,0 +1,49 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "AlignedBuffer.h"
+#include "Word.h"
+
+// Number of k-means passes when clustering the addresses
+#define IVF_KMEANS_ITERATIONS 10
+
+// k-means is trained on a random sample of this many addresses per list
+#define IVF_SAMPLES_PER_LIST 64
+
+namespace sphere
+{
+	class ThreadPool;
+
+	// Inverted file over a matrix of address rows: the rows are clustered into lists with k-means
+	// and a search only tests the rows in the lists whose centroids are nearest the query. This
+	// trades activation recall for speed; hard locations in lists that aren't probed are missed
+	// even when they're within the radius. Like VPTree it keeps its own copy of the addresses,
+	// grouped by list.
+	class IVFIndex
+	{
+	public:
+		IVFIndex();
+
+		void Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric, int NumLists, int Iterations, ThreadPool* Pool);
+
+		// Appends the index of every row within Radius of Query in the NProbe nearest lists to Out
+		// and returns the number of distance evaluations it took, centroids included
+		int Search(const Word& Query, int Radius, int NProbe, std::vector<uint32_t>& Out) const;
+
+		int NumLists() const { return int(centroids.size()); }
+
+	private:
+		int NearestCentroid(const SUBWORD* Row) const;
+
+		std::vector<Word> centroids;
+		std::vector<uint32_t> listStart;	// Position of the first row of each list, plus the end
+		std::vector<uint32_t> order;		// Row index at each position
+		AlignedBuffer<SUBWORD> rows;		// Address at each position
+		size_t stride;
+		int rangeBits;
+		DistanceMetric metric;
+	};
+}
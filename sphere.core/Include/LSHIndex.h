@@ -0,0 +1,84 @@
+
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "ISerializable.h"
+#include "Word.h"
+
+#define LSH_FILE_PREFIX "?!SPHLSH!?"
+#define LSH_FILE_PREFIX_LEN (sizeof(LSH_FILE_PREFIX)/sizeof(char))
+
+// Number of projections concatenated into the bucket key of each table
+#define LSH_DEFAULT_HASHES 4
+
+// Bucket width as a multiple of the access radius when none is given
+#define LSH_DEFAULT_WIDTH_SCALE 1.0f
+
+namespace sphere
+{
+	class ThreadPool;
+
+	// Locality-sensitive hash tables over a matrix of address rows. Each table projects the
+	// unpacked integers of a row onto a few random p-stable directions (Gaussian for the Euclidean
+	// metric, Cauchy for Manhattan), cuts every projection into slots of BucketWidth and
+	// uses the slots as the bucket key. Rows that are close together are likely to share a bucket
+	// in at least one table, so a search only checks the rows in the query's buckets plus up to
+	// NumProbes neighbouring buckets per table. Every candidate is checked exactly but rows within
+	// the radius can be missed. Unlike VPTree and IVFIndex the tables don't copy the addresses, so
+	// they stay small and a single row can be re-hashed when its address changes.
+	class LSHIndex : public ISerializable
+	{
+	public:
+		LSHIndex();
+		LSHIndex(std::istream& stream);
+
+		void Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric, int NumTables, int HashesPerTable, float BucketWidth, ThreadPool* Pool);
+
+		// Moves Row from the buckets of its old address to the buckets of its new one. Moved rows are
+		// kept in hash tables on the side and merged into the sorted tables in batches.
+		void Update(int Row, const SUBWORD* OldAddr, const SUBWORD* NewAddr);
+
+		// Whether the tables were built over exactly these addresses, e.g. after loading them
+		bool Matches(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits) const;
+
+		// Appends the index of every candidate row within Radius of Query to Out and returns the
+		// number of distinct candidates that were checked. Addrs is the matrix the tables were
+		// built over. The metric isn't saved with the tables, so it's given with every search.
+		int Search(const Word& Query, int Radius, DistanceMetric Metric, int NumProbes, const SUBWORD* Addrs, size_t Stride, std::vector<uint32_t>& Out) const;
+
+		int NumTables() const { return numTables; }
+		int HashesPerTable() const { return hashesPerTable; }
+		float BucketWidth() const { return bucketWidth; }
+		int Size() const { return count; }
+		int Dims() const { return dims; }
+		int RangeBits() const { return rangeBits; }
+
+		virtual void Serialize(std::ostream& stream) override;
+
+	private:
+		void Project(const SUBWORD* Row, float* Out) const;
+		uint32_t BucketKey(const int32_t* Slots) const;
+		void RowKeys(const SUBWORD* Row, uint32_t* Keys) const;
+		uint32_t RowChecksum(int Row, const SUBWORD* Addr) const;
+		void MergeMoved();
+
+		std::vector<float> directions;				// Projection weights laid out [dim][table * hashesPerTable + hash]
+		std::vector<float> offsets;					// Random shift of each projection, in slots
+		std::vector<std::vector<uint64_t>> entries;	// Per table, (bucket key << 32 | row) in ascending order
+		std::vector<std::unordered_multimap<uint32_t, uint32_t>> moved;	// Per table, bucket key to row for the moved rows
+		std::vector<uint8_t> movedRows;				// Rows whose entries in entries are stale
+		int numMoved;
+		uint32_t checksum;							// XOR of the checksums of every row's address
+		int count;
+		int dims;
+		int rangeBits;
+		int numTables;
+		int hashesPerTable;
+		float bucketWidth;
+	};
+}
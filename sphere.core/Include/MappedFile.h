@@ -0,0 +1,31 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sphere
+{
+	// Whole file mapped into memory copy-on-write. Pages are read in from the file the first time
+	// they're touched, and writes to them stay private to the process; the file never changes.
+	class MappedFile
+	{
+	public:
+		MappedFile(const std::string& FilePath);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		uint8_t* Data() const { return data; }
+		size_t Size() const { return size; }
+		const std::string& Path() const { return path; }
+
+	private:
+		std::string path;
+		uint8_t* data;
+		size_t size;
+		void* mapping;	// Handle of the file mapping object on Windows
+	};
+}
@@ -1,55 +1,397 @@
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "ISerializable.h"
 
+#include "AlignedBuffer.h"
+#include "BitSlicedAddresses.h"
 #include "HardLocation.h"
+#include "IVFIndex.h"
+#include "LSHIndex.h"
+#include "Policies.h"
+#include "VPTree.h"
 #include "Word.h"
 
 #define FILE_PREFIX "?!SPHERE!?"
 #define FILE_PREFIX_LEN (sizeof(FILE_PREFIX)/sizeof(char))
 
+// Prefix of memory files that only hold the counters of hard locations that have been written.
+// Same length as FILE_PREFIX; files with either prefix can be loaded.
+#define SPARSE_FILE_PREFIX "?!SPHSPR!?"
+
+// Prefix of the sparse files that are saved now, which also record the policy after the prefix.
+// Same length as FILE_PREFIX.
+#define SPARSE_POLICY_FILE_PREFIX "?!SPHSP2!?"
+
+// Prefix of memory files with a fixed layout that are loaded by mapping them, see SaveToFile. Same
+// length as FILE_PREFIX.
+#define MAPPED_FILE_PREFIX "?!SPHMAP!?"
+#define MAPPED_FILE_VERSION 2
+
+// Sections of mapped memory files start on a page boundary so they can be used where they're mapped
+#define MAPPED_FILE_ALIGNMENT 4096
+
+// Prefix of compressed memory files, see SerializeCompressed. Same length as FILE_PREFIX.
+#define COMPRESSED_FILE_PREFIX "?!SPHCMP!?"
+#define COMPRESSED_FILE_VERSION 1
+
+// Memory files with this extension are always saved compressed
+#define COMPRESSED_FILE_EXTENSION ".sphz"
+
+// Number of hard locations per chunk of a compressed memory file. Chunks are coded independently
+// so they can be compressed and decompressed in parallel.
+#define COMPRESSED_CHUNK_SIZE 16384
+
+// Number of counter rows allocated at a time as hard locations are written for the first time
+#define COUNTER_SLAB_ROWS 1024
+
+// Counter row of a hard location that has never been written
+#define NO_COUNTER_ROW UINT32_MAX
+
+// Flag set on the counter rows that have been promoted to the full counter type
+#define WIDE_COUNTER_ROW 0x80000000u
+
+// The write history records the low 4 bits of the first subword of every data word written to a
+// hard location, e.g. a label
+#define WRITE_HISTORY_VALUES 16
+
+// Number of history values kept per hard location under WriteHistoryMode::Ring
+#define WRITE_HISTORY_RING_LEN 16
+
+// Number of hard locations per unit of work when scanning
+#define SCAN_BLOCK_SIZE 1024
+
+// Number of batched queries compared against a block of hard locations at a time
+#define QUERY_TILE_SIZE 8
+
+// Segment pruning compares float distances; the slack keeps rounding from ever skipping a segment
+// that could still contain an activated hard location
+#define SEGMENT_PRUNE_SLACK 1e-3f
+
 namespace sphere
 {
+	class MappedFile;
+	class ThreadPool;
+
 	struct RWStats
 	{
 		int Activations;
-		float AverageDistance;
-		float MinimumDistance;
+		float AverageDistance;	// NAN unless exact stats are enabled on the memory
+		float MinimumDistance;	// NAN unless exact stats are enabled on the memory
+		int DistanceEvaluations;	// Number of hard location addresses the query was compared against
+	};
+
+	enum class AddressLayout
+	{
+		RowMajor,	// One padded row of packed subwords per hard location
+		BitSliced	// Rows plus a transposed copy in bit planes of 64 hard locations, see BitSlicedAddresses
+	};
+
+	struct ReadResult
+	{
+		Word Data;
+		bool Conclusive;
+		RWStats Stats;
 	};
 
 	class Memory : public ISerializable
 	{
 	public:
 		Memory();
-		Memory(std::istream& stream);
+		explicit Memory(const MemoryPolicy& Policy);
+
+		// Reads the sparse and the older dense files. Sparse files saved with SPARSE_POLICY_FILE_PREFIX
+		// record the policy, which takes over from the one given; the older ones don't, so it has to be
+		// the one the memory was trained with.
+		Memory(std::istream& stream, const MemoryPolicy& Policy = MemoryPolicy());
 
 		void Initialize(int AddrWordDims, int DataWordDims, int RangeBitLen, int NumHardLocations, int Radius);
 		void InitializeFixedHardLocations(int AddrWordDims, int DataWordDims, int RangeBitLen, int NumHardLocations, int Radius, const std::vector<Word>& Addrs);
 
-		bool Write(const Word& Addr, const Word& Data);
-		Word Read(const Word& Addr, bool& Conclusive);
+		// NProbe > 0 makes the operation approximate: only the hard locations in the NProbe IVF lists
+		// nearest the address are considered. See BuildIVF.
+		bool Write(const Word& Addr, const Word& Data, int NProbe = 0);
+		Word Read(const Word& Addr, bool& Conclusive, int NProbe = 0);
+
+		// Batched versions of Write and Read. Queries are applied in order with the same results as
+		// issuing them one at a time, but each block of hard locations is loaded once per batch
+		// instead of once per query. LastOPStats is set to the stats of the last query.
+		std::vector<RWStats> WriteBatch(const std::vector<Word>& Addrs, const std::vector<Word>& Data, int NProbe = 0);
+		std::vector<ReadResult> ReadBatch(const std::vector<Word>& Addrs, int NProbe = 0);
+
+		// Hogwild writes. Between BeginConcurrentWrites and EndConcurrentWrites any number of threads
+		// may call WriteConcurrent at once, and nothing else may be called. Each call scans on its own
+		// thread and steps the counters with atomics. Every hard location gets a full width counter
+		// row up front so no write allocates or promotes one; EndConcurrentWrites narrows them back
+		// down. When WritesCommute the counters end up the same as writing the words one at a time,
+		// in any order.
+		void BeginConcurrentWrites();
+		RWStats WriteConcurrent(const Word& Addr, const Word& Data, int NProbe = 0);
+		void EndConcurrentWrites();
+
+		// Pipelined writes, split into a scan and a write so they can run on different threads. Any
+		// number of threads may call ScanActivated at once, each scanning on its own thread, along
+		// with one thread calling WriteActivated with the hard locations they found; nothing else
+		// may be called meanwhile. Scans only read the addresses and writes only touch the counters,
+		// so writing every address's activations in order is the same as writing them one at a time.
+		std::vector<uint32_t> ScanActivated(const Word& Addr, RWStats& Stats, int NProbe = 0);
+		void WriteActivated(const std::vector<uint32_t>& Activated, const Word& Data);
+
+		// Saturating counters of multi-bit words are only ever incremented; every other combination
+		// clamps in both directions, so the counters depend on the order of the writes
+		bool WritesCommute() const { return policy.Counters == CounterMode::Saturating && rangeLen > 1; }
+
+		// Indices of the hard locations an access at Addr activates, in ascending order
+		std::vector<uint32_t> FindActivated(const Word& Addr, int NProbe = 0);
 
 		int RangeBitLength() const { return rangeLen; }
-		std::vector<HardLocation>& HardLocations() { return storage; }
+		const MemoryPolicy& Policy() const { return policy; }
+		int NumHardLocations() const { return numHardLocations; }
+		HardLocation HardLocationAt(int Index) { return HardLocation(*this, Index); }
+
+		// Counters are only allocated for hard locations that have been written; the others read
+		// as all zeros. Rows start out narrow (see the counter policies) and are promoted to wide
+		// ones before a counter outgrows them.
+		bool HasCounters(int Index) const { return counterRows[Index] != NO_COUNTER_ROW; }
+		bool HasWideCounters(int Index) const { return HasCounters(Index) && (counterRows[Index] & WIDE_COUNTER_ROW) != 0; }
+		int NumCounterRows() const;
+		int NumWideCounterRows() const;
+		size_t CounterMemoryUsage() const;
+
+		// Exact stats need the full distance to every hard location; without them scans stop
+		// measuring a hard location as soon as it's known to be outside the access sphere
+		void SetExactStats(bool Enabled) { exactStats = Enabled; }
+		bool ExactStats() const { return exactStats; }
 
-		void SaveToFile(const std::string& FilePath);
-		static Memory LoadFromFile(const std::string& FilePath);
+		// Number of threads each read and write is spread across; 0 picks one per hardware thread.
+		// Results don't depend on the thread count. PinThreads binds the workers to their own CPUs.
+		void SetNumThreads(int NumThreads, bool PinThreads = false);
+		int NumThreads() const { return numThreads; }
+		bool PinsThreads() const { return pinThreads; }
+
+		// Layout the full scan reads addresses from. Bit-sliced scans measure the distances of 64 hard
+		// locations at a time with bitwise adders instead of one at a time with the distance kernels;
+		// the transposed copy is built when the layout is selected and kept up to date when an address
+		// changes. Results are the same with either layout. The circular metrics can only use the
+		// row-major layout.
+		void SetAddressLayout(AddressLayout Layout);
+		AddressLayout Layout() const { return sliced ? AddressLayout::BitSliced : AddressLayout::RowMajor; }
+
+		// Builds a VP-tree over the hard location addresses so reads and writes only visit the parts
+		// of the address space that can be within the radius. The activated hard locations are
+		// exactly the same as with a full scan. Changing an address drops the index, and it isn't
+		// used while exact stats are enabled since those need the distance to every hard location.
+		void BuildIndex();
+		void ClearIndex() { index = nullptr; }
+		bool HasIndex() const { return index != nullptr; }
+
+		// Registers a contiguous range of hard locations whose addresses are clustered, e.g. the
+		// ones imprinted with the same label average. Scans skip the whole segment for queries that
+		// are too far from its bounding ball to activate any of them; results are unchanged.
+		// Segments are dropped when an address changes and aren't saved with the memory.
+		void AddSegment(int Begin, int End);
+		void ClearSegments() { segments.clear(); }
+		int NumSegments() const { return int(segments.size()); }
+
+		// Clusters the hard location addresses into NumLists lists with k-means for approximate
+		// reads and writes. Probing more lists raises the share of truly activated hard locations
+		// that are found at the cost of speed. Changing an address drops the lists.
+		void BuildIVF(int NumLists, int Iterations = IVF_KMEANS_ITERATIONS);
+		void ClearIVF() { ivf = nullptr; }
+		int NumIVFLists() const { return ivf ? ivf->NumLists() : 0; }
+
+		// Builds locality-sensitive hash tables over the hard location addresses. A BucketWidth of 0
+		// picks one from the radius. Changing an address re-hashes just that hard location.
+		void BuildLSH(int NumTables, int HashesPerTable = LSH_DEFAULT_HASHES, float BucketWidth = 0);
+		void ClearLSH() { lsh = nullptr; }
+		int NumLSHTables() const { return lsh ? lsh->NumTables() : 0; }
+
+		// Approximate access through the LSH tables has to be asked for. While enabled, reads and
+		// writes without NProbe only check the hard locations that share a bucket with the address
+		// in some table, so activated hard locations can be missed. Like the VP-tree, the tables
+		// aren't used while exact stats are enabled.
+		void EnableLSH(bool Enabled) { lshEnabled = Enabled; }
+		bool LSHEnabled() const { return lshEnabled; }
+
+		// Number of neighbouring buckets checked per table on top of the address's own bucket
+		void SetLSHProbes(int Probes) { lshProbes = Probes; }
+		int LSHProbes() const { return lshProbes; }
+
+		// The tables are kept in their own file next to the memory file. Loading fails if they
+		// weren't built over the current addresses.
+		void SaveLSH(const std::string& FilePath);
+		void LoadLSH(const std::string& FilePath);
+
+		// Mapped files hold a header followed by whole sections: the address rows, the counter slabs
+		// and the per hard location arrays, as they are in memory. Loading one maps the file and uses
+		// the addresses and counters in place, so pages are only read once they're touched; the
+		// smaller arrays are copied. They also record the policy, which loading takes over from the
+		// one given, as do compressed and sparse files. Paths ending in COMPRESSED_FILE_EXTENSION are
+		// saved compressed whatever the format given. Sparse and dense files are read through
+		// Memory(istream&).
+		void SaveToFile(const std::string& FilePath, MemoryFileFormat Format = MemoryFileFormat::Mapped);
+		static Memory LoadFromFile(const std::string& FilePath, const MemoryPolicy& Policy = MemoryPolicy());
 
 		RWStats LastOPStats;
 
+		// Writes the sparse format
 		virtual void Serialize(std::ostream& stream) override;
 	private:
-		Memory(int WordSize, int NumHardLocations, int Radius, std::vector<HardLocation> Storage);
-			
-		std::vector<HardLocation> storage;
+		friend class HardLocation;
+
+		typedef std::function<void(int Query, int HLIndex, int Thread)> ActivatedFunc;
+
+		// Entry points instantiated for one combination of metric and counter policies, see SelectOps
+		struct PolicyOps
+		{
+			size_t CounterSize;
+			size_t NarrowCounterSize;
+			int32_t PromotePeak;	// Peak at which narrow rows are promoted; INT32_MAX if they never are
+			void (Memory::*Scan)(const Word* Addrs, int NumQueries, int NProbe, const ActivatedFunc& OnActivated, RWStats* Stats, ThreadPool* Pool);
+			void (Memory::*ReadQueries)(const Word* Addrs, int NumQueries, int NProbe, ReadResult* Results);
+			void (HardLocation::*Write)(const Word& Data);
+			void (HardLocation::*Read)(int32_t* Sums) const;
+			void (HardLocation::*SerializeCounters)(BufferedStreamWriter& Writer);
+			void (HardLocation::*DeserializeCounters)(BufferedStreamReader& Reader);
+			void (HardLocation::*ExportCounters)(int32_t* Values) const;
+			void (HardLocation::*ImportCounters)(const int32_t* Values);
+			void (HardLocation::*PrepareConcurrentWrites)();
+			void (HardLocation::*WriteConcurrent)(const Word& Data);
+			void (HardLocation::*CompactCounters)();
+		};
+
+		struct Segment
+		{
+			int Begin;
+			int End;
+			Word Centroid;
+			float Radius;
+		};
+
+		void SetAddressRow(int Index, const SUBWORD* Addr);
+		void AddressRowChanged(int Index);
+		void AddressesChanged();
+
+		void AllocateHardLocations(int NumHardLocations);
+
+		void SerializeMapped(std::ostream& stream);
+		static Memory MapFile(const std::string& FilePath, const MemoryPolicy& Policy);
+
+		// Copies the parts used in place from a mapped file into memory of their own
+		void DetachFromFile();
+
+		void SerializeCompressed(std::ostream& stream);
+		static Memory LoadCompressed(std::istream& stream, const std::string& FilePath, const MemoryPolicy& Policy);
+
+		// One chunk of a compressed file, covering the hard locations from Begin to End. Decoding
+		// fills in everything but the counters, which are returned as rows of plain values since
+		// allocating counter rows isn't thread safe.
+		void EncodeChunk(int Begin, int End, std::vector<uint8_t>& Out);
+		void DecodeChunk(int Begin, int End, const uint8_t* Data, size_t Size, std::vector<uint32_t>& CounterIndices, std::vector<int32_t>& CounterValues);
+
+		// Counts a write to a hard location and adds it to the write history. Concurrent records can
+		// be made from several threads at once; the order of a ring is then the order they land in.
+		void RecordWrite(int Index, const Word& Data, bool Concurrent = false);
+		SUBWORD* AddressRow(int Index) { return addrs.Ptr() + size_t(Index) * addrStride; }
+		const SUBWORD* AddressRow(int Index) const { return addrs.Ptr() + size_t(Index) * addrStride; }
+
+		// Rows of counters handed out from slabs of COUNTER_SLAB_ROWS rows. Rows freed by a
+		// promotion are zeroed and reused.
+		struct CounterPool
+		{
+			std::vector<AlignedBuffer<uint8_t>> Slabs;
+			std::vector<uint32_t> FreeRows;
+			uint32_t NumRows;
+			size_t RowSize;
+		};
+
+		// Counter rows of a hard location that has counters, as the narrow or the full counter type
+		// of the memory's counter policy depending on HasWideCounters
+		template <class T>
+		T* CounterRow(int Index) { return const_cast<T*>(static_cast<const Memory*>(this)->CounterRow<T>(Index)); }
+		template <class T>
+		const T* CounterRow(int Index) const
+		{
+			uint32_t row = counterRows[Index] & ~WIDE_COUNTER_ROW;
+			const CounterPool& pool = counterPools[HasWideCounters(Index) ? 1 : 0];
+			return reinterpret_cast<const T*>(pool.Slabs[row / COUNTER_SLAB_ROWS].Ptr() + size_t(row % COUNTER_SLAB_ROWS) * pool.RowSize);
+		}
+
+		// Gives a hard location a zeroed counter row, replacing the one it has. Not thread safe;
+		// scans defer writes that allocate until they're back on a single thread.
+		void AllocateCounterRow(int Index, bool Wide);
+		void FreeCounterRow(uint32_t Row);
+
+		// Whether a write to the hard location can be applied from any thread, i.e. it won't
+		// allocate or promote its counter row
+		bool CanWriteConcurrently(int Index) const { return HasWideCounters(Index) || (HasCounters(Index) && counterPeaks[Index] < ops->PromotePeak); }
+
+		static const PolicyOps* SelectOps(const MemoryPolicy& Policy);
+
+		void WriteQueries(const Word* Addrs, const Word* Data, int NumQueries, int NProbe, RWStats* Stats);
+		void ApplyDeferredWrites(std::vector<std::vector<std::pair<int, int>>>& Writes, const Word* Data);
+		void ReadQueries(const Word* Addrs, int NumQueries, int NProbe, ReadResult* Results);
+		template <class Metric, class Counters>
+		void ReadQueriesWith(const Word* Addrs, int NumQueries, int NProbe, ReadResult* Results);
+		void Scan(const Word* Addrs, int NumQueries, int NProbe, const ActivatedFunc& OnActivated, RWStats* Stats);
+
+		// The activation callback is a template parameter so that fused callers like ReadQueriesWith
+		// get it inlined into the scan loops. The scan is spread over Pool, or runs on the calling
+		// thread when it's null.
+		template <class Metric, class Callback>
+		void ScanWith(const Word* Addrs, int NumQueries, int NProbe, const Callback& OnActivated, RWStats* Stats, ThreadPool* Pool);
+		template <class Callback>
+		void ListScan(const Word* Addrs, int NumQueries, const std::function<int(const Word& Query, std::vector<uint32_t>& Out)>& Search, const Callback& OnActivated, RWStats* Stats, ThreadPool* Pool);
+		template <class Metric>
+		bool IsActivated(const Word& Addr, const SUBWORD* HLAddr, uint32_t RadiusSquared, double& DistSum, float& DistMin) const;
+		template <class Metric>
+		bool IsActivated(uint32_t DistSquared, uint32_t RadiusSquared, double& DistSum, float& DistMin) const;
+		RWStats MakeStats(int Activations, double DistSum, float DistMin, int Evaluations) const;
+
+		// Hard locations are stored as structure-of-arrays: one row per hard location in each
+		// matrix. Address rows are padded so every row starts on a cache line. Counter rows are
+		// handed out from pools of narrow and wide rows as hard locations are written, and are
+		// stored untyped since their type depends on the counter policy.
+		AlignedBuffer<SUBWORD> addrs;
+		CounterPool counterPools[2];		// Narrow and wide rows
+		std::vector<uint32_t> counterRows;	// Row in the pools of each hard location, or NO_COUNTER_ROW
+		std::vector<uint8_t> counterPeaks;	// Upper bound on the counters of each narrow row
+		std::vector<uint32_t> writeCounts;
+		std::vector<uint32_t> addrNorms;	// Squared norm of each address, only for linear Euclidean 4-bit memories
+		std::vector<uint16_t> historyCounts;	// [hard location][value] under WriteHistoryMode::Histogram; saturating
+		std::vector<uint8_t> historyRing;		// [hard location][slot] under WriteHistoryMode::Ring
+		std::vector<uint32_t> historyWrites;	// Number of values ever written to each ring
+		int numHardLocations;
+		int addrSubwords;
+		int addrStride;
+		int counterStride;
+
+		MemoryPolicy policy;
+		const PolicyOps* ops;
+
 		int radius;
 		int addrDims;
 		int dataDims;
 		int rangeLen;
 		int writeCount;
 		bool initialized;
+		bool exactStats;
+		bool concurrentWrites;
+		int numThreads;
+		bool pinThreads;
+		std::shared_ptr<ThreadPool> pool;
+		std::shared_ptr<BitSlicedAddresses> sliced;
+		std::shared_ptr<const VPTree> index;
+		std::shared_ptr<const IVFIndex> ivf;
+		std::shared_ptr<LSHIndex> lsh;
+		bool lshEnabled;
+		int lshProbes;
+		std::vector<Segment> segments;
+		std::shared_ptr<MappedFile> mappedFile;	// File the addresses and counters are mapped from, if any
 
 	};
 }
\ No newline at end of file
@@ -0,0 +1,163 @@
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+#define NUM_DISTANCE_METRICS 4
+#define NUM_COUNTER_MODES 2
+#define NUM_WRITE_HISTORY_MODES 3
+#define NUM_MEMORY_FILE_FORMATS 3
+
+namespace sphere
+{
+	// Differences are linear by default: 0 and 15 are as far apart as two 4-bit values can be. The
+	// circular metrics treat every dimension as a ring instead, so the difference between a and b
+	// is the shorter of |a - b| and rangeSize - |a - b| and 0 is next to 15.
+	enum class DistanceMetric
+	{
+		Euclidean,			// Square root of the summed squared differences
+		Manhattan,			// Sum of the absolute differences
+		CircularEuclidean,
+		CircularManhattan
+	};
+
+	enum class CounterMode
+	{
+		Saturating,			// 16-bit unsigned counters; a write increments the counter of each written value, up to UINT16_MAX
+		DecrementUnmatched	// 8-bit signed counters; a write also decrements the counters of the other values
+	};
+
+	// What a memory remembers about the data written to each hard location besides the counters.
+	// Only used to analyze trained memories, and only saved in mapped and compressed memory files.
+	enum class WriteHistoryMode
+	{
+		Off,
+		Histogram,	// How many times each history value was written, up to UINT16_MAX
+		Ring		// The last WRITE_HISTORY_RING_LEN history values written
+	};
+
+	// How Memory::SaveToFile lays out a memory file. Files of every format can be loaded.
+	enum class MemoryFileFormat
+	{
+		Sparse,		// Stream of hard location records, see SPARSE_FILE_PREFIX
+		Mapped,		// Fixed layout of whole sections that loads by mapping the file, see MAPPED_FILE_PREFIX
+		Compressed	// Entropy coded chunks of hard locations for keeping snapshots, see COMPRESSED_FILE_PREFIX
+	};
+
+	// Selects the metric and counter policies of a Memory and its write history. The defaults are
+	// the ones the memory files saved so far were trained with.
+	struct MemoryPolicy
+	{
+		DistanceMetric Metric;
+		CounterMode Counters;
+		WriteHistoryMode History;
+
+		MemoryPolicy(DistanceMetric Metric = DistanceMetric::Euclidean, CounterMode Counters = CounterMode::Saturating, WriteHistoryMode History = WriteHistoryMode::Off)
+			: Metric(Metric)
+			, Counters(Counters)
+			, History(History)
+		{
+		}
+	};
+
+	// Circular metrics measure the same way as their linear counterpart once the differences are folded
+	inline bool IsCircular(DistanceMetric Metric) { return Metric == DistanceMetric::CircularEuclidean || Metric == DistanceMetric::CircularManhattan; }
+	inline DistanceMetric LinearMetric(DistanceMetric Metric) { return Metric == DistanceMetric::CircularEuclidean ? DistanceMetric::Euclidean : Metric == DistanceMetric::CircularManhattan ? DistanceMetric::Manhattan : Metric; }
+
+	// Metric policies. Distances are summed as integers and only converted at the end: the squared
+	// distance under EuclideanMetric, the distance itself under ManhattanMetric. Each dimension adds
+	// Term(Fold(|a - b|)). Hamming distances of 1-bit words are the same under every metric.
+
+	struct EuclideanMetric
+	{
+		static constexpr DistanceMetric Kind = DistanceMetric::Euclidean;
+		static constexpr bool Circular = false;
+
+		static constexpr uint32_t Fold(uint32_t Diff, uint32_t RangeSize) { return Diff; }
+		static constexpr uint32_t Term(uint32_t Diff) { return Diff * Diff; }
+		static uint32_t SquaredRadius(int Radius, int RangeBits) { return RangeBits == 1 ? Radius : Radius * Radius; }
+
+		// Sums stay well below 2^24 so the conversion to float is exact
+		static float FromSquared(uint32_t SquaredDistance, int RangeBits) { return RangeBits == 1 ? float(SquaredDistance) : sqrtf(float(SquaredDistance)); }
+	};
+
+	struct ManhattanMetric
+	{
+		static constexpr DistanceMetric Kind = DistanceMetric::Manhattan;
+		static constexpr bool Circular = false;
+
+		static constexpr uint32_t Fold(uint32_t Diff, uint32_t RangeSize) { return Diff; }
+		static constexpr uint32_t Term(uint32_t Diff) { return Diff; }
+		static uint32_t SquaredRadius(int Radius, int RangeBits) { return Radius; }
+		static float FromSquared(uint32_t SquaredDistance, int RangeBits) { return float(SquaredDistance); }
+	};
+
+	struct CircularEuclideanMetric : EuclideanMetric
+	{
+		static constexpr DistanceMetric Kind = DistanceMetric::CircularEuclidean;
+		static constexpr bool Circular = true;
+
+		static constexpr uint32_t Fold(uint32_t Diff, uint32_t RangeSize) { return Diff <= RangeSize - Diff ? Diff : RangeSize - Diff; }
+	};
+
+	struct CircularManhattanMetric : ManhattanMetric
+	{
+		static constexpr DistanceMetric Kind = DistanceMetric::CircularManhattan;
+		static constexpr bool Circular = true;
+
+		static constexpr uint32_t Fold(uint32_t Diff, uint32_t RangeSize) { return Diff <= RangeSize - Diff ? Diff : RangeSize - Diff; }
+	};
+
+	// Runs the statement with MetricPolicy naming the policy class of the runtime metric M
+	#define DISPATCH_METRIC(M, ...) \
+		switch (M) \
+		{ \
+			case sphere::DistanceMetric::Manhattan: { typedef sphere::ManhattanMetric MetricPolicy; __VA_ARGS__; } \
+			case sphere::DistanceMetric::CircularEuclidean: { typedef sphere::CircularEuclideanMetric MetricPolicy; __VA_ARGS__; } \
+			case sphere::DistanceMetric::CircularManhattan: { typedef sphere::CircularManhattanMetric MetricPolicy; __VA_ARGS__; } \
+			default: { typedef sphere::EuclideanMetric MetricPolicy; __VA_ARGS__; } \
+		}
+
+	// Counter policies: the type of the counters of a hard location and what a write does to them.
+	// 1-bit words always count up for set bits and down for clear ones, within [Min, Max].
+	// Counter rows are stored as NarrowType until one of their counters reaches NarrowMax, then
+	// promoted to Type, which keeps most rows small without changing any counter's value.
+
+	struct SaturatingCounters
+	{
+		typedef uint16_t Type;
+		typedef uint8_t NarrowType;
+		static constexpr CounterMode Mode = CounterMode::Saturating;
+		static constexpr int32_t Min = 0;
+		static constexpr int32_t Max = UINT16_MAX;
+		static constexpr int32_t NarrowMax = UINT8_MAX;
+		static constexpr bool Adaptive = true;
+		static constexpr bool DecrementUnmatched = false;
+	};
+
+	struct DecrementUnmatchedCounters
+	{
+		typedef int8_t Type;
+		typedef int8_t NarrowType;
+		static constexpr CounterMode Mode = CounterMode::DecrementUnmatched;
+		static constexpr int32_t Min = INT8_MIN;
+		static constexpr int32_t Max = INT8_MAX;
+		static constexpr int32_t NarrowMax = INT8_MAX;
+		static constexpr bool Adaptive = false;	// Already as narrow as it gets
+		static constexpr bool DecrementUnmatched = true;
+	};
+
+	const char* DistanceMetricName(DistanceMetric Metric);
+	const char* CounterModeName(CounterMode Mode);
+	const char* WriteHistoryModeName(WriteHistoryMode Mode);
+	bool ParseDistanceMetric(const std::string& Name, DistanceMetric& Metric);
+	bool ParseCounterMode(const std::string& Name, CounterMode& Mode);
+	bool ParseWriteHistoryMode(const std::string& Name, WriteHistoryMode& Mode);
+	const char* MemoryFileFormatName(MemoryFileFormat Format);
+	bool ParseMemoryFileFormat(const std::string& Name, MemoryFileFormat& Format);
+
+	// Case-insensitive comparison the Parse functions match names with
+	bool NamesMatch(const std::string& Name, const char* Expected);
+}
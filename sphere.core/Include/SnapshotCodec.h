@@ -0,0 +1,30 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Word.h"
+
+// Probabilities of the address coder are fractions of 2^ADDRESS_CODER_SCALE_BITS
+#define ADDRESS_CODER_SCALE_BITS 12
+
+namespace sphere
+{
+	// Variable length integers: 7 bits per byte, low bits first, high bit set on all but the last
+	// byte. ZigZag maps small signed values to small unsigned ones.
+	void PutVarint(std::vector<uint8_t>& Out, uint32_t Value);
+	uint32_t GetVarint(const uint8_t*& Pos, const uint8_t* End);
+
+	inline uint32_t ZigZag(int32_t Value) { return (uint32_t(Value) << 1) ^ uint32_t(Value >> 31); }
+	inline int32_t UnZigZag(uint32_t Value) { return int32_t(Value >> 1) ^ -int32_t(Value & 1); }
+
+	// Codes Count rows of NumSubwords subwords, Stride apart, as a stream of nibbles with a rANS
+	// entropy coder. Each nibble position in a row has its own frequency table, built from the rows
+	// being coded and stored ahead of them, so dimensions that imprinting has skewed towards some
+	// values take fewer bits. Rows that wouldn't get smaller are stored as they are. Every bit of
+	// the subwords is kept, padding of partial subwords included; the padding after NumSubwords
+	// decodes as zeros.
+	void EncodeAddressRows(const SUBWORD* Rows, size_t Stride, int Count, int NumSubwords, std::vector<uint8_t>& Out);
+	void DecodeAddressRows(const uint8_t*& Pos, const uint8_t* End, SUBWORD* Rows, size_t Stride, int Count, int NumSubwords);
+}
@@ -2,4 +2,5 @@
 #pragma once
 
 #include "Common.h"
+#include "DistanceKernels.h"
 #include "Memory.h"
\ No newline at end of file
@@ -0,0 +1,82 @@
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sphere
+{
+	// Task callback; receives the task index and the index of the thread running it
+	typedef std::function<void(int Task, int Thread)> PoolTaskFunc;
+
+	// Range callback; receives a chunk [Begin, End) of the indexes and the thread running it
+	typedef std::function<void(int Begin, int End, int Thread)> PoolRangeFunc;
+
+	// Fixed set of worker threads that are kept alive between jobs so that scanning the
+	// hard locations doesn't pay for thread creation on every read and write. A job's indexes are
+	// dealt out as one contiguous range per thread; every thread takes chunks off the front of its
+	// own range and, once that's empty, steals the back half of the largest range it finds.
+	class ThreadPool
+	{
+	public:
+		// With PinThreads every worker is bound to its own logical CPU, starting from the second one;
+		// the calling thread is left alone
+		ThreadPool(int NumThreads, bool PinThreads = false);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		int NumThreads() const { return int(workers.size()) + 1; }
+		bool PinsThreads() const { return pinThreads; }
+
+		// Runs Func for every task in [0, NumTasks) and blocks until all of them have finished.
+		// The calling thread takes part as thread 0. The first exception thrown by a task is
+		// rethrown here once the job is done.
+		void Run(int NumTasks, const PoolTaskFunc& Func);
+
+		// Same as Run but hands Func chunks of up to Grain consecutive indexes in [Begin, End)
+		void ParallelFor(int Begin, int End, int Grain, const PoolRangeFunc& Func);
+
+		static int HardwareThreads();
+
+	private:
+		// Remaining range of a thread, packed as (end << 32 | begin) so it can be split with one
+		// compare-exchange. Padded to a cache line so owners don't contend with each other.
+		struct alignas(64) WorkRange
+		{
+			std::atomic<uint64_t> Range;
+		};
+
+		void WorkerLoop(int Thread);
+		void RunChunks(int Thread);
+		bool TakeChunk(int Thread, int& Begin, int& End);
+		bool Steal(int Thread);
+
+		std::vector<std::thread> workers;
+		std::unique_ptr<WorkRange[]> ranges;
+		std::mutex runLock;
+
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable finished;
+		const PoolRangeFunc* job;
+		int jobBegin;
+		int grain;
+		int busyWorkers;
+		uint64_t generation;
+		bool stopping;
+		bool pinThreads;
+		std::exception_ptr error;
+	};
+
+	// Run and ParallelFor on Pool, or on the calling thread when there's no pool
+	void RunTasks(ThreadPool* Pool, int NumTasks, const PoolTaskFunc& Func);
+	void ParallelFor(ThreadPool* Pool, int Begin, int End, int Grain, const PoolRangeFunc& Func);
+}
@@ -0,0 +1,41 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "AlignedBuffer.h"
+#include "Word.h"
+
+// Ranges with this many addresses or fewer are scanned linearly instead of being split further
+#define VPTREE_LEAF_SIZE 16
+
+namespace sphere
+{
+	// Vantage-point tree over a matrix of address rows (one row per hard location). Searches are
+	// exact; the tree only skips subtrees that the triangle inequality proves are out of range.
+	// The tree keeps its own copy of the addresses, laid out in tree order so that the nodes of a
+	// subtree are next to each other in memory, and has to be rebuilt when the addresses change.
+	class VPTree
+	{
+	public:
+		VPTree();
+
+		void Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric);
+
+		// Appends the index of every row within Radius of Query to Out and returns the number of
+		// distance evaluations it took
+		int Search(const Word& Query, int Radius, std::vector<uint32_t>& Out) const;
+
+		int Size() const { return int(order.size()); }
+
+	private:
+		std::vector<uint32_t> order;		// Row index at each position in the tree
+		std::vector<float> thresholds;		// Median distance to the vantage point stored at a position
+		std::vector<uint32_t> insideEnd;	// End of the inside subtree of the vantage point at a position
+		AlignedBuffer<SUBWORD> rows;		// Address at each position
+		size_t stride;
+		int rangeBits;
+		DistanceMetric metric;
+	};
+}
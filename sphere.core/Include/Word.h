@@ -8,24 +8,16 @@
 
 #include "DArray.h"
 #include "ISerializable.h"
+#include "Policies.h"
 
 typedef uint32_t SUBWORD;
 #define SUBWORD_NUM_BITS (8*sizeof(SUBWORD))
-#define DECREMENT_UNMATCHED 0
-#define MANHATTAN_DISTANCE 0
-
-#if DECREMENT_UNMATCHED
-typedef int8_t COUNTER;
-#define COUNTER_MIN INT8_MIN
-#define COUNTER_MAX INT8_MAX
-#else
-typedef uint16_t COUNTER;
-#define COUNTER_MIN 0
-#define COUNTER_MAX UINT16_MAX
-#endif
 
 namespace sphere
 {
+	class BufferedStreamReader;
+	class BufferedStreamWriter;
+
 	class Word : public ISerializable
 	{
 	public:
@@ -38,9 +30,32 @@ namespace sphere
 
 		Word(std::istream& stream);
 
-		static Word FromCounters(const std::vector<COUNTER>& counters, int RangeLen, bool& Conclusive);
+		// Counters are the clamped sums of the activated hard locations' counters
+		static Word FromCounters(const std::vector<int32_t>& counters, int RangeLen, bool& Conclusive);
+		static Word FromSubwords(int N, int RangeBits, const SUBWORD* Subwords);
+		static int SubwordsForLength(int N, int RangeBits);
+
+		const float DistanceTo(const Word& Other, DistanceMetric Metric = DistanceMetric::Euclidean) const;
+
+		// Integer distance before the square root is taken. For hamming (1-bit) words and the
+		// Manhattan metric there is no square root and this is the distance itself.
+		const uint32_t SquaredDistanceTo(const Word& Other, DistanceMetric Metric = DistanceMetric::Euclidean) const;
+		const bool WithinRadius(const Word& Other, uint32_t RadiusSquared, DistanceMetric Metric = DistanceMetric::Euclidean) const;
+
+		// Same as above for a raw row of subwords laid out like this word; the caller is
+		// responsible for making sure it has NumSubwords() elements
+		const uint32_t SquaredDistanceTo(const SUBWORD* Other, DistanceMetric Metric = DistanceMetric::Euclidean) const;
+		const bool WithinRadius(const SUBWORD* Other, uint32_t RadiusSquared, DistanceMetric Metric = DistanceMetric::Euclidean) const;
 
-		const float DistanceTo(const Word& Other) const;
+		// The metric fixed at compile time, for inner loops; instantiated for EuclideanMetric,
+		// ManhattanMetric and their circular versions
+		template <class Metric>
+		const uint32_t SquaredDistanceTo(const SUBWORD* Other) const;
+		template <class Metric>
+		const bool WithinRadius(const SUBWORD* Other, uint32_t RadiusSquared) const;
+
+		static uint32_t SquaredRadius(int Radius, int RangeBits, DistanceMetric Metric = DistanceMetric::Euclidean);
+		static float DistanceFromSquared(uint32_t SquaredDistance, int RangeBits, DistanceMetric Metric = DistanceMetric::Euclidean);
 
 		const int NumDimensions() const { return numDims; }
 		const int RangeBits() const { return rangeBitLen; }
@@ -48,17 +63,30 @@ namespace sphere
 		const int SubwordBits() const { return sizeof(SUBWORD) * 8; }
 		const int NumSubwords() const { return numSubWords; }
 		const SUBWORD SubwordAt(int index) const { return subwords[index]; }
+		const SUBWORD* Data() const { return subwords.data(); }
+
+		// Bits of the last subword that hamming distances count
+		const SUBWORD LastSubwordMask() const { return lastSubwordLen > 0 ? (SUBWORD(1) << lastSubwordLen) - 1 : ~SUBWORD(0); }
 		const uint8_t IntAt(int index) const;
 		void EnumerateInts(std::function<void(int, uint8_t)> func) const;
 		void Imprint(const Word& other, float scale, int iterations);
 
 		static bool RandomBit();
+		static void RandomizeSubwords(SUBWORD* subwords, int len);
 
 		virtual void Serialize(std::ostream& stream) override;
 
+		// The record Serialize writes for FromSubwords(N, RangeBits, Subwords), straight from and
+		// to a row of subwords. Reading throws if the record isn't an N by RangeBits word.
+		static void SerializeSubwords(BufferedStreamWriter& Writer, int N, int RangeBits, const SUBWORD* Subwords);
+		static void DeserializeSubwords(BufferedStreamReader& Reader, int N, int RangeBits, SUBWORD* Out);
+
 	private:
 		Word(int N, int RangeBits, std::vector<SUBWORD>& subwords);
 
+		template <class Metric>
+		const uint32_t BoundedSquaredDistanceTo(const SUBWORD* Other, uint32_t Bound) const;
+
 		uint16_t numDims;
 		uint8_t rangeBitLen;
 		uint8_t rangeSize;
@@ -69,7 +97,6 @@ namespace sphere
 		std::vector<SUBWORD> subwords;
 
 		static std::mt19937 CreateRng();
-		static void RandomizeSubwords(std::vector<SUBWORD>& subwords);
 
 		static void PadVector(std::vector<SUBWORD>& arr, int len);
 	};
@@ -0,0 +1,297 @@
+
+#include <cstring>
+
+#include "BitSlicedAddresses.h"
+#include "Common.h"
+#include "ThreadPool.h"
+
+using namespace std;
+using namespace sphere;
+
+// Levels in the bit-sliced cross term accumulator; enough for any sum that fits a uint32_t
+#define ACCUMULATOR_BITS 32
+
+/**
+ Bit-sliced counter that is fed 64 one-bit numbers at a time at some weight 2^Level. Every level
+ keeps a sum plane and at most one pending input; the next input at that level goes through a
+ full adder with both and carries into the level above. Whether a level has a pending input only
+ depends on how many inputs it has seen, so the branches don't depend on the data.
+*/
+struct CarrySaveAccumulator
+{
+	uint64_t Sums[ACCUMULATOR_BITS];
+	uint64_t Pending[ACCUMULATOR_BITS];
+	uint32_t HasPending;
+	int NumLevels;
+
+	CarrySaveAccumulator()
+		: HasPending(0)
+		, NumLevels(0)
+	{
+		memset(Sums, 0, sizeof(Sums));
+		memset(Pending, 0, sizeof(Pending));
+	}
+
+	void Add(uint64_t Bits, int Level)
+	{
+		for (; Level < ACCUMULATOR_BITS; Level++)
+		{
+			uint32_t flag = uint32_t(1) << Level;
+
+			if ((HasPending & flag) == 0)
+			{
+				Pending[Level] = Bits;
+				HasPending |= flag;
+				NumLevels = MAX(NumLevels, Level + 1);
+				return;
+			}
+
+			HasPending &= ~flag;
+
+			uint64_t half = Sums[Level] ^ Pending[Level];
+			uint64_t carry = (Sums[Level] & Pending[Level]) | (half & Bits);
+			Sums[Level] = half ^ Bits;
+			Pending[Level] = 0;
+			Bits = carry;
+		}
+	}
+
+	// Adds the pending inputs into the sums with one ripple-carry pass so lanes can be read
+	void Flush()
+	{
+		uint64_t carry = 0;
+
+		for (int level = 0; level < NumLevels; level++)
+		{
+			uint64_t half = Sums[level] ^ Pending[level];
+			uint64_t next = (Sums[level] & Pending[level]) | (half & carry);
+			Sums[level] = half ^ carry;
+			Pending[level] = 0;
+			carry = next;
+		}
+
+		if (carry != 0 && NumLevels < ACCUMULATOR_BITS)
+			Sums[NumLevels++] = carry;
+
+		HasPending = 0;
+	}
+
+	uint32_t Lane(int Lane) const
+	{
+		uint32_t value = 0;
+
+		for (int level = 0; level < NumLevels; level++)
+			value |= uint32_t((Sums[level] >> Lane) & 1) << level;
+
+		return value;
+	}
+};
+
+// Carry-save adder: adds three planes into a sum plane and a carry plane
+#define CSA(high, low, a, b, c) { uint64_t u = (a) ^ (b); high = ((a) & (b)) | (u & (c)); low = u ^ (c); }
+
+/**
+ Adds the vertical population count of Count planes to Accumulator at weight 2^Level. Planes are
+ counted 16 at a time with a Harley-Seal tree of carry-save adders kept in registers, so only one
+ plane per 16 reaches the accumulator.
+*/
+template <class PlaneFunc>
+static inline void AddPlaneCount(CarrySaveAccumulator& Accumulator, int Count, int Level, PlaneFunc Plane)
+{
+	uint64_t ones = 0, twos = 0, fours = 0, eights = 0;
+	uint64_t twos_a, twos_b, fours_a, fours_b, eights_a, eights_b, sixteens;
+	int i = 0;
+
+	for (; i + 16 <= Count; i += 16)
+	{
+		CSA(twos_a, ones, ones, Plane(i), Plane(i + 1));
+		CSA(twos_b, ones, ones, Plane(i + 2), Plane(i + 3));
+		CSA(fours_a, twos, twos, twos_a, twos_b);
+		CSA(twos_a, ones, ones, Plane(i + 4), Plane(i + 5));
+		CSA(twos_b, ones, ones, Plane(i + 6), Plane(i + 7));
+		CSA(fours_b, twos, twos, twos_a, twos_b);
+		CSA(eights_a, fours, fours, fours_a, fours_b);
+		CSA(twos_a, ones, ones, Plane(i + 8), Plane(i + 9));
+		CSA(twos_b, ones, ones, Plane(i + 10), Plane(i + 11));
+		CSA(fours_a, twos, twos, twos_a, twos_b);
+		CSA(twos_a, ones, ones, Plane(i + 12), Plane(i + 13));
+		CSA(twos_b, ones, ones, Plane(i + 14), Plane(i + 15));
+		CSA(fours_b, twos, twos, twos_a, twos_b);
+		CSA(eights_b, fours, fours, fours_a, fours_b);
+		CSA(sixteens, eights, eights, eights_a, eights_b);
+
+		Accumulator.Add(sixteens, Level + 4);
+	}
+
+	for (; i < Count; i++)
+		Accumulator.Add(Plane(i), Level);
+
+	Accumulator.Add(ones, Level);
+	Accumulator.Add(twos, Level + 1);
+	Accumulator.Add(fours, Level + 2);
+	Accumulator.Add(eights, Level + 3);
+}
+
+BitSlicedAddresses::BitSlicedAddresses()
+	: count(0)
+	, numGroups(0)
+	, numSlices(0)
+	, rangeBits(0)
+	, linearTerms(false)
+{
+}
+
+void BitSlicedAddresses::Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric, ThreadPool* Pool)
+{
+	if (IsCircular(Metric) && RangeBits > 1)
+		throw exception("Bit-sliced addresses only support the linear metrics");
+
+	count = Count;
+	rangeBits = RangeBits;
+	numGroups = (Count + BITSLICE_GROUP_SIZE - 1) / BITSLICE_GROUP_SIZE;
+	linearTerms = Metric == DistanceMetric::Manhattan && RangeBits > 1;
+
+	// The vectorized kernels count every integer of every subword. Hamming distance only counts
+	// the low bits of a partial last subword, see Word::BoundedSquaredDistanceTo.
+	int num_subwords = Word::SubwordsForLength(Dims, RangeBits);
+	int ints_per_sw = SUBWORD_NUM_BITS / RangeBits;
+	int last_len = (Dims * RangeBits) % SUBWORD_NUM_BITS;
+
+	sliceSubword.clear();
+	sliceShift.clear();
+
+	for (int sw = 0; sw < num_subwords; sw++)
+	{
+		for (int j = 0; j < ints_per_sw; j++)
+		{
+			int shift = SUBWORD_NUM_BITS - RangeBits * (j + 1);
+
+			if (RangeBits == 1 && last_len > 0 && sw == num_subwords - 1 && shift >= last_len)
+				continue;
+
+			sliceSubword.push_back(uint16_t(sw));
+			sliceShift.push_back(uint8_t(shift));
+		}
+	}
+
+	numSlices = int(sliceSubword.size());
+	planes.Allocate(size_t(numGroups) * numSlices * rangeBits);
+	norms.assign(size_t(numGroups) * BITSLICE_GROUP_SIZE, 0);
+
+	RunTasks(Pool, numGroups, [&](int Group, int Thread)
+	{
+		int end = MIN(Count, (Group + 1) * BITSLICE_GROUP_SIZE);
+
+		for (int row = Group * BITSLICE_GROUP_SIZE; row < end; row++)
+			Set(row, Addrs + row * Stride);
+	});
+}
+
+void BitSlicedAddresses::Set(int Row, const SUBWORD* Addr)
+{
+	uint64_t* group_planes = GroupPlanes(Row / BITSLICE_GROUP_SIZE);
+	uint64_t lane = uint64_t(1) << (Row % BITSLICE_GROUP_SIZE);
+	uint32_t norm = 0;
+
+	for (int slice = 0; slice < numSlices; slice++)
+	{
+		uint32_t value = ValueAt(Addr, slice);
+		uint64_t* slice_planes = group_planes + slice * rangeBits;
+
+		for (int bit = 0; bit < rangeBits; bit++)
+		{
+			if ((value >> bit) & 1)
+				slice_planes[bit] |= lane;
+			else
+				slice_planes[bit] &= ~lane;
+		}
+
+		norm += Term(value);
+	}
+
+	norms[Row] = norm;
+}
+
+BitSlicedAddresses::Query BitSlicedAddresses::Prepare(const Word& Addr) const
+{
+	Query query;
+	query.Norm = 0;
+	query.Passes.resize(linearTerms ? (1 << rangeBits) - 1 : rangeBits);
+
+	for (int slice = 0; slice < numSlices; slice++)
+	{
+		uint32_t value = ValueAt(Addr.Data(), slice);
+		query.Norm += Term(value);
+
+		for (uint32_t pass = 0; pass < query.Passes.size(); pass++)
+		{
+			bool selected = linearTerms ? value > pass : ((value >> pass) & 1) != 0;
+
+			if (selected)
+				query.Passes[pass].push_back(slice * rangeBits);
+		}
+	}
+
+	return query;
+}
+
+void BitSlicedAddresses::GroupDistances(const Query& Q, int Group, uint32_t* Out) const
+{
+	CarrySaveAccumulator accumulator;
+	const uint64_t* group_planes = GroupPlanes(Group);
+
+	if (linearTerms)
+	{
+		// min(x, q) is the number of thresholds t in [1, q] with x >= t. The comparison runs from the
+		// least significant bit up: x >= t on the low bits unless a higher bit decides.
+		for (uint32_t pass = 0; pass < Q.Passes.size(); pass++)
+		{
+			const uint32_t* offsets = Q.Passes[pass].data();
+			uint32_t t = pass + 1;
+
+			AddPlaneCount(accumulator, int(Q.Passes[pass].size()), 0, [&](int i)
+			{
+				const uint64_t* x = group_planes + offsets[i];
+				uint64_t ge = ~uint64_t(0);
+
+				for (int bit = 0; bit < rangeBits; bit++)
+					ge = ((t >> bit) & 1) ? (x[bit] & ge) : (x[bit] | ge);
+
+				return ge;
+			});
+		}
+	}
+	else
+	{
+		// x.q is the sum of 2^(b + c) over the set bits b of x and c of q
+		for (int c = 0; c < rangeBits; c++)
+		{
+			const uint32_t* offsets = Q.Passes[c].data();
+
+			for (int bit = 0; bit < rangeBits; bit++)
+			{
+				AddPlaneCount(accumulator, int(Q.Passes[c].size()), bit + c, [&](int i)
+				{
+					return group_planes[offsets[i] + bit];
+				});
+			}
+		}
+	}
+
+	const uint32_t* group_norms = norms.data() + size_t(Group) * BITSLICE_GROUP_SIZE;
+
+	accumulator.Flush();
+
+	for (int lane = 0; lane < BITSLICE_GROUP_SIZE; lane++)
+		Out[lane] = group_norms[lane] + Q.Norm - 2 * accumulator.Lane(lane);
+}
+
+uint32_t BitSlicedAddresses::Term(uint32_t Value) const
+{
+	return linearTerms ? Value : Value * Value;
+}
+
+uint32_t BitSlicedAddresses::ValueAt(const SUBWORD* Addr, int Slice) const
+{
+	return (Addr[sliceSubword[Slice]] >> sliceShift[Slice]) & ((1 << rangeBits) - 1);
+}
@@ -0,0 +1,75 @@
+
+#include "BufferedStream.h"
+#include "Common.h"
+
+using namespace std;
+using namespace sphere;
+
+BufferedStreamWriter::BufferedStreamWriter(ostream& Stream, size_t Capacity)
+	: stream(Stream)
+	, buffer(Capacity)
+	, used(0)
+	, capacity(Capacity)
+{
+}
+
+void BufferedStreamWriter::Flush()
+{
+	if (used > 0)
+		stream.write(reinterpret_cast<const char*>(buffer.data()), used);
+
+	used = 0;
+}
+
+void BufferedStreamWriter::Grow(size_t Size)
+{
+	if (capacity > 0)
+	{
+		Flush();
+
+		if (Size > buffer.size())
+			buffer.resize(Size);
+	}
+	else
+	{
+		buffer.resize(MAX(used + Size, 2 * buffer.size()));
+	}
+}
+
+BufferedStreamReader::BufferedStreamReader(istream& Stream, size_t Capacity)
+	: stream(Stream)
+	, buffer(Capacity)
+	, pos(0)
+	, end(0)
+	, capacity(Capacity)
+{
+}
+
+void BufferedStreamReader::Refill(size_t Size)
+{
+	size_t remaining = end - pos;
+	memmove(buffer.data(), buffer.data() + pos, remaining);
+
+	size_t wanted = MAX(Size, capacity);
+	if (buffer.size() < wanted)
+		buffer.resize(wanted);
+
+	stream.read(reinterpret_cast<char*>(buffer.data() + remaining), wanted - remaining);
+
+	pos = 0;
+	end = remaining + size_t(stream.gcount());
+
+	if (end < Size)
+		throw exception("Input stream ended too early");
+}
+
+void BufferedStreamReader::Finish()
+{
+	if (end > pos)
+	{
+		stream.clear();
+		stream.seekg(-streamoff(end - pos), ios_base::cur);
+	}
+
+	pos = end;
+}
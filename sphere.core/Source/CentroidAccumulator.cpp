@@ -0,0 +1,58 @@
+
+#include <algorithm>
+
+#include "CentroidAccumulator.h"
+#include "Common.h"
+
+using namespace std;
+using namespace sphere;
+
+CentroidAccumulator::CentroidAccumulator(int NumSubwords, int RangeBits)
+	: count(0)
+	, numSubwords(NumSubwords)
+	, rangeBits(RangeBits)
+	, intsPerSubword(SUBWORD_NUM_BITS / RangeBits)
+{
+	sums = vector<uint64_t>(size_t(NumSubwords) * intsPerSubword, 0);
+}
+
+void CentroidAccumulator::Add(const SUBWORD* Row)
+{
+	SUBWORD mask = (1 << rangeBits) - 1;
+	uint64_t* sum = sums.data();
+
+	for (int sw = 0; sw < numSubwords; sw++)
+	{
+		for (int j = 0; j < intsPerSubword; j++)
+		{
+			int shift = SUBWORD_NUM_BITS - rangeBits * (j + 1);
+			*sum++ += (Row[sw] >> shift) & mask;
+		}
+	}
+
+	count++;
+}
+
+void CentroidAccumulator::Clear()
+{
+	fill(sums.begin(), sums.end(), 0);
+	count = 0;
+}
+
+void CentroidAccumulator::Mean(SUBWORD* Out) const
+{
+	const uint64_t* sum = sums.data();
+	uint64_t divisor = MAX(count, 1);
+
+	for (int sw = 0; sw < numSubwords; sw++)
+	{
+		Out[sw] = 0;
+
+		for (int j = 0; j < intsPerSubword; j++)
+		{
+			int shift = SUBWORD_NUM_BITS - rangeBits * (j + 1);
+			SUBWORD mean = SUBWORD((*sum++ + divisor / 2) / divisor);
+			Out[sw] |= mean << shift;
+		}
+	}
+}
@@ -5,12 +5,17 @@
 #include <filesystem>
 #include <cstdarg>
 #include <cstdio>
+#include <mutex>
 #include <windows.h>
 
 HANDLE log_file = nullptr;
+std::mutex log_lock;
 
 void VEchoLogMessage(const char* fmt, va_list args)
 {
+	// The buffers are shared, and trainer threads log while they work
+	std::lock_guard<std::mutex> guard(log_lock);
+
 	static char message[256];
 	static char formatted[256];
 	static SYSTEMTIME time = {0};
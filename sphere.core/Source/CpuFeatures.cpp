@@ -0,0 +1,81 @@
+
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#include "CpuFeatures.h"
+
+using namespace sphere;
+
+static void Cpuid(int leaf, int subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex(info, leaf, subleaf);
+	for (int i = 0; i < 4; i++)
+		regs[i] = uint32_t(info[i]);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t Xgetbv(uint32_t index)
+{
+#if defined(_MSC_VER)
+	return _xgetbv(index);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return (uint64_t(edx) << 32) | eax;
+#endif
+}
+
+CpuFeatures::CpuFeatures()
+	: SSSE3(false)
+	, SSE41(false)
+	, POPCNT(false)
+	, AVX2(false)
+	, AVX512F(false)
+	, AVX512BW(false)
+	, AVX512VPOPCNTDQ(false)
+	, AVX512VNNI(false)
+{
+	uint32_t regs[4];
+
+	Cpuid(0, 0, regs);
+	uint32_t max_leaf = regs[0];
+
+	if (max_leaf < 1)
+		return;
+
+	Cpuid(1, 0, regs);
+	SSSE3 = (regs[2] & (1 << 9)) != 0;
+	SSE41 = (regs[2] & (1 << 19)) != 0;
+	POPCNT = (regs[2] & (1 << 23)) != 0;
+
+	// The OS has to save the wider registers on context switches or the AVX instructions are unusable
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	uint64_t xcr0 = osxsave ? Xgetbv(0) : 0;
+	bool os_avx = (xcr0 & 0x6) == 0x6;
+	bool os_avx512 = (xcr0 & 0xE6) == 0xE6;
+
+	if (max_leaf < 7)
+		return;
+
+	Cpuid(7, 0, regs);
+	AVX2 = os_avx && (regs[1] & (1 << 5)) != 0;
+	AVX512F = os_avx512 && (regs[1] & (1 << 16)) != 0;
+	AVX512BW = AVX512F && (regs[1] & (1 << 30)) != 0;
+	AVX512VPOPCNTDQ = AVX512F && (regs[2] & (1 << 14)) != 0;
+	AVX512VNNI = AVX512F && (regs[2] & (1 << 11)) != 0;
+}
+
+const CpuFeatures& sphere::GetCpuFeatures()
+{
+	static CpuFeatures features;
+	return features;
+}
@@ -0,0 +1,979 @@
+
+#include <cctype>
+#include <cstring>
+#include <immintrin.h>
+
+#include "Common.h"
+#include "CpuFeatures.h"
+#include "DistanceKernels.h"
+
+using namespace std;
+using namespace sphere;
+
+// Distance contributed by a single dimension under each metric, indexed by the absolute
+// difference of the two values. They double as the lookup tables for the byte shuffles in the
+// vectorized kernels, which is all it takes for the circular metrics to fold the differences.
+alignas(16) static const uint8_t NibbleDistanceTables[NUM_DISTANCE_METRICS][16] =
+{
+	{ 0, 1, 4, 9, 16, 25, 36, 49, 64, 81, 100, 121, 144, 169, 196, 225 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 0, 1, 4, 9, 16, 25, 36, 49, 64, 49, 36, 25, 16, 9, 4, 1 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 7, 6, 5, 4, 3, 2, 1 }
+};
+
+#define NIBBLE_TABLE(Metric) NibbleDistanceTables[int(Metric::Kind)]
+
+template <class Metric>
+static inline uint32_t NibbleDistanceSubword(SUBWORD a, SUBWORD b)
+{
+	uint32_t sum = 0;
+
+	for (int shift = 0; shift < SUBWORD_NUM_BITS; shift += 4)
+	{
+		int diff = int((a >> shift) & 0xF) - int((b >> shift) & 0xF);
+		sum += NIBBLE_TABLE(Metric)[diff < 0 ? -diff : diff];
+	}
+
+	return sum;
+}
+
+// Bounded kernels only check the running sum once per block of this many subwords (128 bytes)
+// so the horizontal reductions stay out of the inner loops
+#define SUBWORDS_PER_CHECK 32
+
+template <class Metric, bool Bounded>
+static uint32_t NibbleDistanceScalar(const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound)
+{
+	uint32_t sum = 0;
+
+	for (int i = 0; i < NumSubwords; i++)
+	{
+		sum += NibbleDistanceSubword<Metric>(A[i], B[i]);
+
+		if (Bounded && sum > Bound)
+			return sum;
+	}
+
+	return sum;
+}
+
+// The vector kernels split every byte into its low and high nibble, take the absolute difference
+// with saturating subtractions, map it through the metric's distance table with a byte shuffle and
+// reduce the bytes into 64-bit lanes with SAD against zero. The linear Manhattan distance is what
+// SAD computes in the first place, so it goes straight from the nibbles to SAD. When Bounded is
+// set they return as soon as the partial sum exceeds Bound, so the result is only exact when it's
+// <= Bound.
+
+SPHERE_TARGET("ssse3,sse4.1")
+static inline uint32_t HorizontalSumSSE4(__m128i acc)
+{
+	return uint32_t(_mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1));
+}
+
+template <class Metric, bool Bounded>
+SPHERE_TARGET("ssse3,sse4.1")
+static uint32_t NibbleDistanceSSE4(const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound)
+{
+	const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+	const __m128i table = _mm_load_si128(reinterpret_cast<const __m128i*>(NIBBLE_TABLE(Metric)));
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+
+	const int sw_per_vec = sizeof(__m128i) / sizeof(SUBWORD);
+	int i = 0;
+
+	while (i + sw_per_vec <= NumSubwords)
+	{
+		int block_end = MIN(NumSubwords, i + SUBWORDS_PER_CHECK);
+
+		for (; i + sw_per_vec <= block_end; i += sw_per_vec)
+		{
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(A + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(B + i));
+
+			__m128i a_lo = _mm_and_si128(a, nibble_mask);
+			__m128i b_lo = _mm_and_si128(b, nibble_mask);
+			__m128i a_hi = _mm_and_si128(_mm_srli_epi16(a, 4), nibble_mask);
+			__m128i b_hi = _mm_and_si128(_mm_srli_epi16(b, 4), nibble_mask);
+
+			if constexpr (Metric::Kind == DistanceMetric::Manhattan)
+			{
+				acc = _mm_add_epi64(acc, _mm_sad_epu8(a_lo, b_lo));
+				acc = _mm_add_epi64(acc, _mm_sad_epu8(a_hi, b_hi));
+			}
+			else
+			{
+				__m128i d_lo = _mm_or_si128(_mm_subs_epu8(a_lo, b_lo), _mm_subs_epu8(b_lo, a_lo));
+				__m128i d_hi = _mm_or_si128(_mm_subs_epu8(a_hi, b_hi), _mm_subs_epu8(b_hi, a_hi));
+
+				acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_shuffle_epi8(table, d_lo), zero));
+				acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_shuffle_epi8(table, d_hi), zero));
+			}
+		}
+
+		if (Bounded && HorizontalSumSSE4(acc) > Bound)
+			return HorizontalSumSSE4(acc);
+	}
+
+	uint32_t sum = HorizontalSumSSE4(acc);
+
+	for (; i < NumSubwords; i++)
+		sum += NibbleDistanceSubword<Metric>(A[i], B[i]);
+
+	return sum;
+}
+
+SPHERE_TARGET("avx2")
+static inline uint32_t HorizontalSumAVX2(__m256i acc)
+{
+	__m128i acc128 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	return uint32_t(_mm_cvtsi128_si64(acc128) + _mm_extract_epi64(acc128, 1));
+}
+
+template <class Metric, bool Bounded>
+SPHERE_TARGET("avx2")
+static uint32_t NibbleDistanceAVX2(const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound)
+{
+	const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+	const __m256i table = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(NIBBLE_TABLE(Metric))));
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+
+	const int sw_per_vec = sizeof(__m256i) / sizeof(SUBWORD);
+	int i = 0;
+
+	while (i + sw_per_vec <= NumSubwords)
+	{
+		int block_end = MIN(NumSubwords, i + SUBWORDS_PER_CHECK);
+
+		for (; i + sw_per_vec <= block_end; i += sw_per_vec)
+		{
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(A + i));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(B + i));
+
+			__m256i a_lo = _mm256_and_si256(a, nibble_mask);
+			__m256i b_lo = _mm256_and_si256(b, nibble_mask);
+			__m256i a_hi = _mm256_and_si256(_mm256_srli_epi16(a, 4), nibble_mask);
+			__m256i b_hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble_mask);
+
+			if constexpr (Metric::Kind == DistanceMetric::Manhattan)
+			{
+				acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a_lo, b_lo));
+				acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a_hi, b_hi));
+			}
+			else
+			{
+				__m256i d_lo = _mm256_or_si256(_mm256_subs_epu8(a_lo, b_lo), _mm256_subs_epu8(b_lo, a_lo));
+				__m256i d_hi = _mm256_or_si256(_mm256_subs_epu8(a_hi, b_hi), _mm256_subs_epu8(b_hi, a_hi));
+
+				acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_shuffle_epi8(table, d_lo), zero));
+				acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_shuffle_epi8(table, d_hi), zero));
+			}
+		}
+
+		if (Bounded && HorizontalSumAVX2(acc) > Bound)
+			return HorizontalSumAVX2(acc);
+	}
+
+	uint32_t sum = HorizontalSumAVX2(acc);
+
+	for (; i < NumSubwords; i++)
+		sum += NibbleDistanceSubword<Metric>(A[i], B[i]);
+
+	return sum;
+}
+
+template <class Metric, bool Bounded>
+SPHERE_TARGET("avx512f,avx512bw")
+static uint32_t NibbleDistanceAVX512(const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound)
+{
+	const __m512i nibble_mask = _mm512_set1_epi8(0x0F);
+	const __m512i table = _mm512_broadcast_i32x4(_mm_load_si128(reinterpret_cast<const __m128i*>(NIBBLE_TABLE(Metric))));
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i acc = _mm512_setzero_si512();
+
+	const int sw_per_vec = sizeof(__m512i) / sizeof(SUBWORD);
+	int i = 0;
+
+	while (i < NumSubwords)
+	{
+		int block_end = MIN(NumSubwords, i + SUBWORDS_PER_CHECK);
+
+		for (; i < block_end; i += sw_per_vec)
+		{
+			// The tail is loaded with a byte mask so the zeroed lanes add nothing to the sum
+			int remaining = NumSubwords - i;
+			__mmask64 load_mask = remaining >= sw_per_vec ? ~__mmask64(0) : (__mmask64(1) << (remaining * sizeof(SUBWORD))) - 1;
+
+			__m512i a = _mm512_maskz_loadu_epi8(load_mask, A + i);
+			__m512i b = _mm512_maskz_loadu_epi8(load_mask, B + i);
+
+			__m512i a_lo = _mm512_and_si512(a, nibble_mask);
+			__m512i b_lo = _mm512_and_si512(b, nibble_mask);
+			__m512i a_hi = _mm512_and_si512(_mm512_srli_epi16(a, 4), nibble_mask);
+			__m512i b_hi = _mm512_and_si512(_mm512_srli_epi16(b, 4), nibble_mask);
+
+			if constexpr (Metric::Kind == DistanceMetric::Manhattan)
+			{
+				acc = _mm512_add_epi64(acc, _mm512_sad_epu8(a_lo, b_lo));
+				acc = _mm512_add_epi64(acc, _mm512_sad_epu8(a_hi, b_hi));
+			}
+			else
+			{
+				__m512i d_lo = _mm512_or_si512(_mm512_subs_epu8(a_lo, b_lo), _mm512_subs_epu8(b_lo, a_lo));
+				__m512i d_hi = _mm512_or_si512(_mm512_subs_epu8(a_hi, b_hi), _mm512_subs_epu8(b_hi, a_hi));
+
+				acc = _mm512_add_epi64(acc, _mm512_sad_epu8(_mm512_shuffle_epi8(table, d_lo), zero));
+				acc = _mm512_add_epi64(acc, _mm512_sad_epu8(_mm512_shuffle_epi8(table, d_hi), zero));
+			}
+		}
+
+		if (Bounded && uint32_t(_mm512_reduce_add_epi64(acc)) > Bound)
+			break;
+	}
+
+	return uint32_t(_mm512_reduce_add_epi64(acc));
+}
+
+// The dot product kernels multiply the nibbles of two words pairwise and sum the products, for
+// linear Euclidean distances computed as |a|^2 + |b|^2 - 2 a.b. Nibbles are split into bytes as
+// above and multiplied with the unsigned by signed byte multiply-add, whose 16-bit pair sums can't
+// saturate since a pair adds at most 2 * 15 * 15. With VNNI the products go straight into 32-bit
+// lanes. None of them stop early: the partial sums of a dot product don't bound the distance.
+
+static inline uint32_t NibbleDotSubword(SUBWORD a, SUBWORD b)
+{
+	uint32_t sum = 0;
+
+	for (int shift = 0; shift < SUBWORD_NUM_BITS; shift += 4)
+		sum += ((a >> shift) & 0xF) * ((b >> shift) & 0xF);
+
+	return sum;
+}
+
+static uint32_t NibbleDotScalar(const SUBWORD* A, const SUBWORD* B, int NumSubwords)
+{
+	uint32_t sum = 0;
+
+	for (int i = 0; i < NumSubwords; i++)
+		sum += NibbleDotSubword(A[i], B[i]);
+
+	return sum;
+}
+
+SPHERE_TARGET("ssse3,sse4.1")
+static uint32_t NibbleDotSSE4(const SUBWORD* A, const SUBWORD* B, int NumSubwords)
+{
+	const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+	const __m128i ones = _mm_set1_epi16(1);
+	__m128i acc = _mm_setzero_si128();
+
+	const int sw_per_vec = sizeof(__m128i) / sizeof(SUBWORD);
+	int i = 0;
+
+	for (; i + sw_per_vec <= NumSubwords; i += sw_per_vec)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(A + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(B + i));
+
+		__m128i lo = _mm_maddubs_epi16(_mm_and_si128(a, nibble_mask), _mm_and_si128(b, nibble_mask));
+		__m128i hi = _mm_maddubs_epi16(_mm_and_si128(_mm_srli_epi16(a, 4), nibble_mask), _mm_and_si128(_mm_srli_epi16(b, 4), nibble_mask));
+
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_add_epi16(lo, hi), ones));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	uint32_t sum = uint32_t(_mm_cvtsi128_si32(acc));
+
+	for (; i < NumSubwords; i++)
+		sum += NibbleDotSubword(A[i], B[i]);
+
+	return sum;
+}
+
+SPHERE_TARGET("avx2")
+static uint32_t NibbleDotAVX2(const SUBWORD* A, const SUBWORD* B, int NumSubwords)
+{
+	const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+	const __m256i ones = _mm256_set1_epi16(1);
+	__m256i acc = _mm256_setzero_si256();
+
+	const int sw_per_vec = sizeof(__m256i) / sizeof(SUBWORD);
+	int i = 0;
+
+	for (; i + sw_per_vec <= NumSubwords; i += sw_per_vec)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(A + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(B + i));
+
+		__m256i lo = _mm256_maddubs_epi16(_mm256_and_si256(a, nibble_mask), _mm256_and_si256(b, nibble_mask));
+		__m256i hi = _mm256_maddubs_epi16(_mm256_and_si256(_mm256_srli_epi16(a, 4), nibble_mask), _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble_mask));
+
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_add_epi16(lo, hi), ones));
+	}
+
+	__m128i acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, _MM_SHUFFLE(2, 3, 0, 1)));
+	uint32_t sum = uint32_t(_mm_cvtsi128_si32(acc128));
+
+	for (; i < NumSubwords; i++)
+		sum += NibbleDotSubword(A[i], B[i]);
+
+	return sum;
+}
+
+SPHERE_TARGET("avx512f,avx512bw")
+static uint32_t NibbleDotAVX512(const SUBWORD* A, const SUBWORD* B, int NumSubwords)
+{
+	const __m512i nibble_mask = _mm512_set1_epi8(0x0F);
+	const __m512i ones = _mm512_set1_epi16(1);
+	__m512i acc = _mm512_setzero_si512();
+
+	const int sw_per_vec = sizeof(__m512i) / sizeof(SUBWORD);
+
+	for (int i = 0; i < NumSubwords; i += sw_per_vec)
+	{
+		int remaining = NumSubwords - i;
+		__mmask64 load_mask = remaining >= sw_per_vec ? ~__mmask64(0) : (__mmask64(1) << (remaining * sizeof(SUBWORD))) - 1;
+
+		__m512i a = _mm512_maskz_loadu_epi8(load_mask, A + i);
+		__m512i b = _mm512_maskz_loadu_epi8(load_mask, B + i);
+
+		__m512i a_lo = _mm512_and_si512(a, nibble_mask);
+		__m512i b_lo = _mm512_and_si512(b, nibble_mask);
+		__m512i a_hi = _mm512_and_si512(_mm512_srli_epi16(a, 4), nibble_mask);
+		__m512i b_hi = _mm512_and_si512(_mm512_srli_epi16(b, 4), nibble_mask);
+
+		__m512i pairs = _mm512_add_epi16(_mm512_maddubs_epi16(a_lo, b_lo), _mm512_maddubs_epi16(a_hi, b_hi));
+		acc = _mm512_add_epi32(acc, _mm512_madd_epi16(pairs, ones));
+	}
+
+	return uint32_t(_mm512_reduce_add_epi32(acc));
+}
+
+SPHERE_TARGET("avx512f,avx512bw,avx512vnni")
+static uint32_t NibbleDotVNNI(const SUBWORD* A, const SUBWORD* B, int NumSubwords)
+{
+	const __m512i nibble_mask = _mm512_set1_epi8(0x0F);
+	__m512i acc = _mm512_setzero_si512();
+
+	const int sw_per_vec = sizeof(__m512i) / sizeof(SUBWORD);
+
+	for (int i = 0; i < NumSubwords; i += sw_per_vec)
+	{
+		int remaining = NumSubwords - i;
+		__mmask64 load_mask = remaining >= sw_per_vec ? ~__mmask64(0) : (__mmask64(1) << (remaining * sizeof(SUBWORD))) - 1;
+
+		__m512i a = _mm512_maskz_loadu_epi8(load_mask, A + i);
+		__m512i b = _mm512_maskz_loadu_epi8(load_mask, B + i);
+
+		__m512i a_lo = _mm512_and_si512(a, nibble_mask);
+		__m512i b_lo = _mm512_and_si512(b, nibble_mask);
+		__m512i a_hi = _mm512_and_si512(_mm512_srli_epi16(a, 4), nibble_mask);
+		__m512i b_hi = _mm512_and_si512(_mm512_srli_epi16(b, 4), nibble_mask);
+
+		acc = _mm512_dpbusd_epi32(acc, a_lo, b_lo);
+		acc = _mm512_dpbusd_epi32(acc, a_hi, b_hi);
+	}
+
+	return uint32_t(_mm512_reduce_add_epi32(acc));
+}
+
+static uint32_t NibbleDotAVX512Entry(const SUBWORD* A, const SUBWORD* B, int NumSubwords)
+{
+	if (GetCpuFeatures().AVX512VNNI)
+		return NibbleDotVNNI(A, B, NumSubwords);
+
+	return NibbleDotAVX512(A, B, NumSubwords);
+}
+
+// Saturating sums of counter rows. Rows are long (a counter per integer of the data word) and
+// only read once per activation, so the kernels are plain streams of saturating adds.
+
+static void AddCountersScalar(const uint16_t* Row, uint16_t* Sums, int Len)
+{
+	for (int i = 0; i < Len; i++)
+	{
+		uint32_t sum = uint32_t(Sums[i]) + Row[i];
+		Sums[i] = uint16_t(MIN(sum, uint32_t(UINT16_MAX)));
+	}
+}
+
+SPHERE_TARGET("ssse3,sse4.1")
+static void AddCountersSSE4(const uint16_t* Row, uint16_t* Sums, int Len)
+{
+	const int per_vec = sizeof(__m128i) / sizeof(uint16_t);
+	int i = 0;
+
+	for (; i + per_vec <= Len; i += per_vec)
+	{
+		__m128i row = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Row + i));
+		__m128i sums = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Sums + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(Sums + i), _mm_adds_epu16(sums, row));
+	}
+
+	AddCountersScalar(Row + i, Sums + i, Len - i);
+}
+
+SPHERE_TARGET("avx2")
+static void AddCountersAVX2(const uint16_t* Row, uint16_t* Sums, int Len)
+{
+	const int per_vec = sizeof(__m256i) / sizeof(uint16_t);
+	int i = 0;
+
+	for (; i + per_vec <= Len; i += per_vec)
+	{
+		__m256i row = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Row + i));
+		__m256i sums = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Sums + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(Sums + i), _mm256_adds_epu16(sums, row));
+	}
+
+	AddCountersScalar(Row + i, Sums + i, Len - i);
+}
+
+SPHERE_TARGET("avx512f,avx512bw")
+static void AddCountersAVX512(const uint16_t* Row, uint16_t* Sums, int Len)
+{
+	const int per_vec = sizeof(__m512i) / sizeof(uint16_t);
+
+	for (int i = 0; i < Len; i += per_vec)
+	{
+		int remaining = Len - i;
+		__mmask32 mask = remaining >= per_vec ? ~__mmask32(0) : (__mmask32(1) << remaining) - 1;
+
+		__m512i row = _mm512_maskz_loadu_epi16(mask, Row + i);
+		__m512i sums = _mm512_maskz_loadu_epi16(mask, Sums + i);
+		_mm512_mask_storeu_epi16(Sums + i, mask, _mm512_adds_epu16(sums, row));
+	}
+}
+
+static void AddNarrowCountersScalar(const uint8_t* Row, uint16_t* Sums, int Len)
+{
+	for (int i = 0; i < Len; i++)
+	{
+		uint32_t sum = uint32_t(Sums[i]) + Row[i];
+		Sums[i] = uint16_t(MIN(sum, uint32_t(UINT16_MAX)));
+	}
+}
+
+SPHERE_TARGET("ssse3,sse4.1")
+static void AddNarrowCountersSSE4(const uint8_t* Row, uint16_t* Sums, int Len)
+{
+	const int per_vec = sizeof(__m128i) / sizeof(uint16_t);
+	int i = 0;
+
+	for (; i + per_vec <= Len; i += per_vec)
+	{
+		__m128i row = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(Row + i)));
+		__m128i sums = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Sums + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(Sums + i), _mm_adds_epu16(sums, row));
+	}
+
+	AddNarrowCountersScalar(Row + i, Sums + i, Len - i);
+}
+
+SPHERE_TARGET("avx2")
+static void AddNarrowCountersAVX2(const uint8_t* Row, uint16_t* Sums, int Len)
+{
+	const int per_vec = sizeof(__m256i) / sizeof(uint16_t);
+	int i = 0;
+
+	for (; i + per_vec <= Len; i += per_vec)
+	{
+		__m256i row = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Row + i)));
+		__m256i sums = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Sums + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(Sums + i), _mm256_adds_epu16(sums, row));
+	}
+
+	AddNarrowCountersScalar(Row + i, Sums + i, Len - i);
+}
+
+SPHERE_TARGET("avx512f,avx512bw")
+static void AddNarrowCountersAVX512(const uint8_t* Row, uint16_t* Sums, int Len)
+{
+	const int per_vec = sizeof(__m512i) / sizeof(uint16_t);
+
+	for (int i = 0; i < Len; i += per_vec)
+	{
+		int remaining = Len - i;
+		__mmask32 mask = remaining >= per_vec ? ~__mmask32(0) : (__mmask32(1) << remaining) - 1;
+
+		__m512i row = _mm512_cvtepu8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(__mmask64(mask), Row + i)));
+		__m512i sums = _mm512_maskz_loadu_epi16(mask, Sums + i);
+		_mm512_mask_storeu_epi16(Sums + i, mask, _mm512_adds_epu16(sums, row));
+	}
+}
+
+// The hamming kernels read two subwords at a time as a 64-bit lane, or whole vectors of them.
+// The last subword always goes through its own masked step so that only the bits of LastMask
+// count, which keeps the main loops free of any special cases.
+
+static inline uint64_t Load64(const SUBWORD* Ptr)
+{
+	uint64_t value;
+	memcpy(&value, Ptr, sizeof(value));
+	return value;
+}
+
+static inline uint32_t PopcountScalar(uint64_t x)
+{
+	x = x - ((x >> 1) & 0x5555555555555555ull);
+	x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+	return uint32_t((x * 0x0101010101010101ull) >> 56);
+}
+
+static uint32_t HammingDistanceScalar(const SUBWORD* A, const SUBWORD* B, int NumSubwords, SUBWORD LastMask)
+{
+	int last = NumSubwords - 1;
+	uint32_t sum = 0;
+	int i = 0;
+
+	for (; i + 2 <= last; i += 2)
+		sum += PopcountScalar(Load64(A + i) ^ Load64(B + i));
+
+	if (i < last)
+		sum += PopcountScalar(A[i] ^ B[i]);
+
+	return sum + PopcountScalar((A[last] ^ B[last]) & LastMask);
+}
+
+static void HammingBlockScalar(const SUBWORD* Query, const SUBWORD* Rows, size_t Stride, int NumRows, int NumSubwords, SUBWORD LastMask, uint32_t* Out)
+{
+	for (int row = 0; row < NumRows; row++)
+		Out[row] = HammingDistanceScalar(Query, Rows + row * Stride, NumSubwords, LastMask);
+}
+
+// The byte-pair kernels look up the distance between a byte of each word in a table of every pair
+// of bytes, so each byte of 1-, 2- or 4-bit integers costs a single load under either metric and
+// no vector instructions are needed. Hamming distances are still faster with the scalar popcount,
+// so the byte-pair kernel set uses those for 1-bit words.
+
+struct BytePairTable
+{
+	uint16_t Distances[256 * 256];	// Indexed by (a << 8) | b
+};
+
+template <class Metric, int RangeBits>
+static constexpr BytePairTable MakeBytePairTable()
+{
+	BytePairTable table = {};
+	const int mask = (1 << RangeBits) - 1;
+
+	for (int a = 0; a < 256; a++)
+	{
+		for (int b = 0; b < 256; b++)
+		{
+			uint32_t sum = 0;
+
+			for (int shift = 0; shift < 8; shift += RangeBits)
+			{
+				int diff = ((a >> shift) & mask) - ((b >> shift) & mask);
+				sum += Metric::Term(Metric::Fold(diff < 0 ? -diff : diff, 1 << RangeBits));
+			}
+
+			table.Distances[(a << 8) | b] = uint16_t(sum);
+		}
+	}
+
+	return table;
+}
+
+// Tables for range sizes 2, 4 and 16, indexed by RangeBits / 2. The compiler generates them where
+// its constant evaluation limits allow it; otherwise they're filled in at startup.
+#define BYTE_PAIR_TABLES(Metric) { MakeBytePairTable<Metric, 1>(), MakeBytePairTable<Metric, 2>(), MakeBytePairTable<Metric, 4>() }
+
+static const BytePairTable BytePairTables[NUM_DISTANCE_METRICS][3] =
+{
+	BYTE_PAIR_TABLES(EuclideanMetric),
+	BYTE_PAIR_TABLES(ManhattanMetric),
+	BYTE_PAIR_TABLES(CircularEuclideanMetric),
+	BYTE_PAIR_TABLES(CircularManhattanMetric)
+};
+
+static inline uint32_t BytePairSubword(const uint16_t* Table, SUBWORD a, SUBWORD b)
+{
+	uint32_t sum = 0;
+
+	for (int shift = 0; shift < SUBWORD_NUM_BITS; shift += 8)
+		sum += Table[(((a >> shift) & 0xFF) << 8) | ((b >> shift) & 0xFF)];
+
+	return sum;
+}
+
+template <class Metric, int RangeBits, bool Bounded>
+static uint32_t BytePairDistanceSum(const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound)
+{
+	const uint16_t* table = BytePairTables[int(Metric::Kind)][RangeBits / 2].Distances;
+	uint32_t sum = 0;
+
+	for (int i = 0; i < NumSubwords; i++)
+	{
+		sum += BytePairSubword(table, A[i], B[i]);
+
+		if (Bounded && sum > Bound)
+			return sum;
+	}
+
+	return sum;
+}
+
+template <class Metric, bool Bounded>
+static uint32_t NibbleDistanceBytePair(const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound)
+{
+	return BytePairDistanceSum<Metric, 4, Bounded>(A, B, NumSubwords, Bound);
+}
+
+uint32_t sphere::BytePairDistance(const SUBWORD* A, const SUBWORD* B, int NumSubwords, int RangeBits, DistanceMetric Metric, uint32_t Bound)
+{
+	if (RangeBits != 1 && RangeBits != 2 && RangeBits != 4)
+		throw exception("Byte-pair tables only exist for 1, 2 and 4-bit integers");
+
+	DISPATCH_METRIC(Metric,
+		switch (RangeBits)
+		{
+			case 1: return BytePairDistanceSum<MetricPolicy, 1, true>(A, B, NumSubwords, Bound);
+			case 2: return BytePairDistanceSum<MetricPolicy, 2, true>(A, B, NumSubwords, Bound);
+			default: return BytePairDistanceSum<MetricPolicy, 4, true>(A, B, NumSubwords, Bound);
+		});
+}
+
+SPHERE_TARGET("popcnt")
+static inline uint32_t HammingDistancePOPCNT(const SUBWORD* A, const SUBWORD* B, int NumSubwords, SUBWORD LastMask)
+{
+	int last = NumSubwords - 1;
+	uint64_t sum = 0;
+	int i = 0;
+
+	for (; i + 2 <= last; i += 2)
+		sum += _mm_popcnt_u64(Load64(A + i) ^ Load64(B + i));
+
+	if (i < last)
+		sum += _mm_popcnt_u32(A[i] ^ B[i]);
+
+	return uint32_t(sum + _mm_popcnt_u32((A[last] ^ B[last]) & LastMask));
+}
+
+SPHERE_TARGET("popcnt")
+static void HammingBlockPOPCNT(const SUBWORD* Query, const SUBWORD* Rows, size_t Stride, int NumRows, int NumSubwords, SUBWORD LastMask, uint32_t* Out)
+{
+	for (int row = 0; row < NumRows; row++)
+		Out[row] = HammingDistancePOPCNT(Query, Rows + row * Stride, NumSubwords, LastMask);
+}
+
+// AVX2 has no population count so bytes are counted with a nibble lookup and summed into 64-bit
+// lanes with SAD, like the nibble kernels. Long words are first reduced with a Harley-Seal tree
+// of carry-save adders so that only one vector in 16 has to be counted that way.
+
+#define SUBWORDS_PER_AVX2 (sizeof(__m256i) / sizeof(SUBWORD))
+#define NIBBLE_POPCOUNTS 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+
+SPHERE_TARGET("avx2")
+static inline __m256i PopcountAVX2(__m256i v)
+{
+	const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+	const __m256i table = _mm256_setr_epi8(NIBBLE_POPCOUNTS, NIBBLE_POPCOUNTS);
+
+	__m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble_mask));
+	__m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble_mask));
+
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+SPHERE_TARGET("avx2")
+static inline void CarrySaveAVX2(__m256i& High, __m256i& Low, __m256i A, __m256i B, __m256i C)
+{
+	__m256i u = _mm256_xor_si256(A, B);
+	High = _mm256_or_si256(_mm256_and_si256(A, B), _mm256_and_si256(u, C));
+	Low = _mm256_xor_si256(u, C);
+}
+
+SPHERE_TARGET("avx2")
+static inline __m256i XorAtAVX2(const SUBWORD* A, const SUBWORD* B, int Vector)
+{
+	__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(A + Vector * SUBWORDS_PER_AVX2));
+	__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(B + Vector * SUBWORDS_PER_AVX2));
+	return _mm256_xor_si256(a, b);
+}
+
+/**
+ Splits a word into NumVectors whole vectors and a tail of 1 to 8 subwords ending with the last
+ one. TailLanes selects the subwords of the tail for a masked load, which can't read past the end
+ of the word, and TailBits holds the bits of them that count.
+*/
+SPHERE_TARGET("avx2")
+static inline void HammingTailAVX2(int NumSubwords, SUBWORD LastMask, int& NumVectors, __m256i& TailLanes, __m256i& TailBits)
+{
+	const __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	NumVectors = (NumSubwords - 1) / SUBWORDS_PER_AVX2;
+	int remaining = NumSubwords - NumVectors * SUBWORDS_PER_AVX2;
+
+	TailLanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining), lane_index);
+	__m256i last_lane = _mm256_cmpeq_epi32(_mm256_set1_epi32(remaining - 1), lane_index);
+	TailBits = _mm256_blendv_epi8(TailLanes, _mm256_set1_epi32(int(LastMask)), last_lane);
+}
+
+SPHERE_TARGET("avx2")
+static inline uint32_t HammingRowAVX2(const SUBWORD* A, const SUBWORD* B, int NumVectors, __m256i TailLanes, __m256i TailBits)
+{
+	__m256i total = _mm256_setzero_si256();
+	int v = 0;
+
+	if (NumVectors >= 16)
+	{
+		__m256i ones = _mm256_setzero_si256();
+		__m256i twos = _mm256_setzero_si256();
+		__m256i fours = _mm256_setzero_si256();
+		__m256i eights = _mm256_setzero_si256();
+		__m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b, sixteens;
+
+		for (; v + 16 <= NumVectors; v += 16)
+		{
+			CarrySaveAVX2(twos_a, ones, ones, XorAtAVX2(A, B, v), XorAtAVX2(A, B, v + 1));
+			CarrySaveAVX2(twos_b, ones, ones, XorAtAVX2(A, B, v + 2), XorAtAVX2(A, B, v + 3));
+			CarrySaveAVX2(fours_a, twos, twos, twos_a, twos_b);
+			CarrySaveAVX2(twos_a, ones, ones, XorAtAVX2(A, B, v + 4), XorAtAVX2(A, B, v + 5));
+			CarrySaveAVX2(twos_b, ones, ones, XorAtAVX2(A, B, v + 6), XorAtAVX2(A, B, v + 7));
+			CarrySaveAVX2(fours_b, twos, twos, twos_a, twos_b);
+			CarrySaveAVX2(eights_a, fours, fours, fours_a, fours_b);
+			CarrySaveAVX2(twos_a, ones, ones, XorAtAVX2(A, B, v + 8), XorAtAVX2(A, B, v + 9));
+			CarrySaveAVX2(twos_b, ones, ones, XorAtAVX2(A, B, v + 10), XorAtAVX2(A, B, v + 11));
+			CarrySaveAVX2(fours_a, twos, twos, twos_a, twos_b);
+			CarrySaveAVX2(twos_a, ones, ones, XorAtAVX2(A, B, v + 12), XorAtAVX2(A, B, v + 13));
+			CarrySaveAVX2(twos_b, ones, ones, XorAtAVX2(A, B, v + 14), XorAtAVX2(A, B, v + 15));
+			CarrySaveAVX2(fours_b, twos, twos, twos_a, twos_b);
+			CarrySaveAVX2(eights_b, fours, fours, fours_a, fours_b);
+			CarrySaveAVX2(sixteens, eights, eights, eights_a, eights_b);
+
+			total = _mm256_add_epi64(total, PopcountAVX2(sixteens));
+		}
+
+		total = _mm256_slli_epi64(total, 4);
+		total = _mm256_add_epi64(total, _mm256_slli_epi64(PopcountAVX2(eights), 3));
+		total = _mm256_add_epi64(total, _mm256_slli_epi64(PopcountAVX2(fours), 2));
+		total = _mm256_add_epi64(total, _mm256_slli_epi64(PopcountAVX2(twos), 1));
+		total = _mm256_add_epi64(total, PopcountAVX2(ones));
+	}
+
+	for (; v < NumVectors; v++)
+		total = _mm256_add_epi64(total, PopcountAVX2(XorAtAVX2(A, B, v)));
+
+	const int* a_tail = reinterpret_cast<const int*>(A + v * SUBWORDS_PER_AVX2);
+	const int* b_tail = reinterpret_cast<const int*>(B + v * SUBWORDS_PER_AVX2);
+	__m256i tail = _mm256_xor_si256(_mm256_maskload_epi32(a_tail, TailLanes), _mm256_maskload_epi32(b_tail, TailLanes));
+	total = _mm256_add_epi64(total, PopcountAVX2(_mm256_and_si256(tail, TailBits)));
+
+	return HorizontalSumAVX2(total);
+}
+
+SPHERE_TARGET("avx2")
+static uint32_t HammingDistanceAVX2(const SUBWORD* A, const SUBWORD* B, int NumSubwords, SUBWORD LastMask)
+{
+	int num_vectors;
+	__m256i tail_lanes, tail_bits;
+	HammingTailAVX2(NumSubwords, LastMask, num_vectors, tail_lanes, tail_bits);
+
+	return HammingRowAVX2(A, B, num_vectors, tail_lanes, tail_bits);
+}
+
+SPHERE_TARGET("avx2")
+static void HammingBlockAVX2(const SUBWORD* Query, const SUBWORD* Rows, size_t Stride, int NumRows, int NumSubwords, SUBWORD LastMask, uint32_t* Out)
+{
+	int num_vectors;
+	__m256i tail_lanes, tail_bits;
+	HammingTailAVX2(NumSubwords, LastMask, num_vectors, tail_lanes, tail_bits);
+
+	for (int row = 0; row < NumRows; row++)
+		Out[row] = HammingRowAVX2(Query, Rows + row * Stride, num_vectors, tail_lanes, tail_bits);
+}
+
+// With VPOPCNTDQ every 64-bit lane is counted by a single instruction, which is cheaper than any
+// carry-save tree. CPUs with AVX-512 but without it use the AVX2 kernels.
+
+#define SUBWORDS_PER_AVX512 (sizeof(__m512i) / sizeof(SUBWORD))
+
+SPHERE_TARGET("avx512f,avx512vpopcntdq")
+static inline uint32_t HammingRowVPOPCNTDQ(const SUBWORD* A, const SUBWORD* B, int NumVectors, __mmask16 TailLanes, __m512i TailBits)
+{
+	__m512i total = _mm512_setzero_si512();
+	int v = 0;
+
+	for (; v < NumVectors; v++)
+	{
+		__m512i a = _mm512_loadu_si512(A + v * SUBWORDS_PER_AVX512);
+		__m512i b = _mm512_loadu_si512(B + v * SUBWORDS_PER_AVX512);
+		total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_xor_si512(a, b)));
+	}
+
+	__m512i a = _mm512_maskz_loadu_epi32(TailLanes, A + v * SUBWORDS_PER_AVX512);
+	__m512i b = _mm512_maskz_loadu_epi32(TailLanes, B + v * SUBWORDS_PER_AVX512);
+	total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_and_si512(_mm512_xor_si512(a, b), TailBits)));
+
+	return uint32_t(_mm512_reduce_add_epi64(total));
+}
+
+// Same split as HammingTailAVX2 with tails of 1 to 16 subwords
+SPHERE_TARGET("avx512f,avx512vpopcntdq")
+static inline void HammingTailVPOPCNTDQ(int NumSubwords, SUBWORD LastMask, int& NumVectors, __mmask16& TailLanes, __m512i& TailBits)
+{
+	NumVectors = (NumSubwords - 1) / SUBWORDS_PER_AVX512;
+	int remaining = NumSubwords - NumVectors * SUBWORDS_PER_AVX512;
+
+	TailLanes = __mmask16((1u << remaining) - 1);
+	TailBits = _mm512_mask_blend_epi32(__mmask16(1u << (remaining - 1)), _mm512_set1_epi32(-1), _mm512_set1_epi32(int(LastMask)));
+}
+
+SPHERE_TARGET("avx512f,avx512vpopcntdq")
+static uint32_t HammingDistanceVPOPCNTDQ(const SUBWORD* A, const SUBWORD* B, int NumSubwords, SUBWORD LastMask)
+{
+	int num_vectors;
+	__mmask16 tail_lanes;
+	__m512i tail_bits;
+	HammingTailVPOPCNTDQ(NumSubwords, LastMask, num_vectors, tail_lanes, tail_bits);
+
+	return HammingRowVPOPCNTDQ(A, B, num_vectors, tail_lanes, tail_bits);
+}
+
+SPHERE_TARGET("avx512f,avx512vpopcntdq")
+static void HammingBlockVPOPCNTDQ(const SUBWORD* Query, const SUBWORD* Rows, size_t Stride, int NumRows, int NumSubwords, SUBWORD LastMask, uint32_t* Out)
+{
+	int num_vectors;
+	__mmask16 tail_lanes;
+	__m512i tail_bits;
+	HammingTailVPOPCNTDQ(NumSubwords, LastMask, num_vectors, tail_lanes, tail_bits);
+
+	for (int row = 0; row < NumRows; row++)
+		Out[row] = HammingRowVPOPCNTDQ(Query, Rows + row * Stride, num_vectors, tail_lanes, tail_bits);
+}
+
+static uint32_t HammingDistanceAVX512(const SUBWORD* A, const SUBWORD* B, int NumSubwords, SUBWORD LastMask)
+{
+	if (GetCpuFeatures().AVX512VPOPCNTDQ)
+		return HammingDistanceVPOPCNTDQ(A, B, NumSubwords, LastMask);
+
+	return HammingDistanceAVX2(A, B, NumSubwords, LastMask);
+}
+
+static void HammingBlockAVX512(const SUBWORD* Query, const SUBWORD* Rows, size_t Stride, int NumRows, int NumSubwords, SUBWORD LastMask, uint32_t* Out)
+{
+	if (GetCpuFeatures().AVX512VPOPCNTDQ)
+		HammingBlockVPOPCNTDQ(Query, Rows, Stride, NumRows, NumSubwords, LastMask, Out);
+	else
+		HammingBlockAVX2(Query, Rows, Stride, NumRows, NumSubwords, LastMask, Out);
+}
+
+// Adapts the templated kernels to the plain function pointers in DistanceKernels
+
+#define NIBBLE_KERNEL(impl, Metric) \
+	[](const SUBWORD* A, const SUBWORD* B, int NumSubwords) -> uint32_t { return impl<Metric, false>(A, B, NumSubwords, 0); }
+
+#define NIBBLE_BOUNDED_KERNEL(impl, Metric) \
+	[](const SUBWORD* A, const SUBWORD* B, int NumSubwords, uint32_t Bound) -> uint32_t { return impl<Metric, true>(A, B, NumSubwords, Bound); }
+
+// One kernel per DistanceMetric, in the order of the enum
+#define NIBBLE_KERNELS(impl) \
+	{ \
+		NIBBLE_KERNEL(impl, EuclideanMetric), NIBBLE_KERNEL(impl, ManhattanMetric), \
+		NIBBLE_KERNEL(impl, CircularEuclideanMetric), NIBBLE_KERNEL(impl, CircularManhattanMetric) \
+	}, \
+	{ \
+		NIBBLE_BOUNDED_KERNEL(impl, EuclideanMetric), NIBBLE_BOUNDED_KERNEL(impl, ManhattanMetric), \
+		NIBBLE_BOUNDED_KERNEL(impl, CircularEuclideanMetric), NIBBLE_BOUNDED_KERNEL(impl, CircularManhattanMetric) \
+	}
+
+static const DistanceKernels KernelTable[] =
+{
+	{ KernelISA::Scalar, "Scalar", NIBBLE_KERNELS(NibbleDistanceScalar), NibbleDotScalar, HammingDistanceScalar, HammingBlockScalar, AddCountersScalar, AddNarrowCountersScalar },
+	{ KernelISA::BytePair, "BytePair", NIBBLE_KERNELS(NibbleDistanceBytePair), NibbleDotScalar, HammingDistanceScalar, HammingBlockScalar, AddCountersScalar, AddNarrowCountersScalar },
+	{ KernelISA::SSE4, "SSE4", NIBBLE_KERNELS(NibbleDistanceSSE4), NibbleDotSSE4, HammingDistancePOPCNT, HammingBlockPOPCNT, AddCountersSSE4, AddNarrowCountersSSE4 },
+	{ KernelISA::AVX2, "AVX2", NIBBLE_KERNELS(NibbleDistanceAVX2), NibbleDotAVX2, HammingDistanceAVX2, HammingBlockAVX2, AddCountersAVX2, AddNarrowCountersAVX2 },
+	{ KernelISA::AVX512, "AVX512", NIBBLE_KERNELS(NibbleDistanceAVX512), NibbleDotAVX512Entry, HammingDistanceAVX512, HammingBlockAVX512, AddCountersAVX512, AddNarrowCountersAVX512 },
+};
+
+#define KERNEL_TABLE_LEN (sizeof(KernelTable) / sizeof(DistanceKernels))
+
+bool sphere::IsKernelSupported(KernelISA ISA)
+{
+	const CpuFeatures& cpu = GetCpuFeatures();
+
+	switch (ISA)
+	{
+		case KernelISA::Scalar:
+		case KernelISA::BytePair:
+			return true;
+		case KernelISA::SSE4:
+			return cpu.SSSE3 && cpu.SSE41 && cpu.POPCNT;
+		case KernelISA::AVX2:
+			return cpu.AVX2;
+		case KernelISA::AVX512:
+			return cpu.AVX512F && cpu.AVX512BW;
+	}
+
+	return false;
+}
+
+static const DistanceKernels* BestSupportedKernels()
+{
+	// Entries are ordered from slowest to fastest
+	for (int i = KERNEL_TABLE_LEN - 1; i > 0; i--)
+	{
+		if (IsKernelSupported(KernelTable[i].ISA))
+			return &KernelTable[i];
+	}
+
+	return &KernelTable[0];
+}
+
+static const DistanceKernels*& ActiveKernels()
+{
+	static const DistanceKernels* active = BestSupportedKernels();
+	return active;
+}
+
+const DistanceKernels& sphere::GetDistanceKernels()
+{
+	return *ActiveKernels();
+}
+
+const DistanceKernels& sphere::GetDistanceKernels(KernelISA ISA)
+{
+	if (!IsKernelSupported(ISA))
+		throw exception("Distance kernel is not supported by this CPU");
+
+	for (const DistanceKernels& kernels : KernelTable)
+	{
+		if (kernels.ISA == ISA)
+			return kernels;
+	}
+
+	throw exception("Unknown distance kernel");
+}
+
+void sphere::SelectDistanceKernels(KernelISA ISA)
+{
+	ActiveKernels() = &GetDistanceKernels(ISA);
+	LOG_INFO("Using %s distance kernels", ActiveKernels()->Name);
+}
+
+bool sphere::ParseKernelISA(const string& Name, KernelISA& ISA)
+{
+	for (const DistanceKernels& kernels : KernelTable)
+	{
+		string kernel_name(kernels.Name);
+
+		bool match = Name.length() == kernel_name.length();
+		for (int i = 0; match && i < Name.length(); i++)
+			match = tolower(Name[i]) == tolower(kernel_name[i]);
+
+		if (match)
+		{
+			ISA = kernels.ISA;
+			return true;
+		}
+	}
+
+	return false;
+}
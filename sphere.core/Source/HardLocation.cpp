@@ -2,31 +2,69 @@
 #include <cstring>
 #include <cmath>
 
+#include "BufferedStream.h"
+#include "Common.h"
 #include "HardLocation.h"
+#include "Memory.h"
 
 using namespace std;
 using namespace sphere;
 
-uint32_t HardLocation::NumInstances = 0;
-
-HardLocation::HardLocation(int AddrWordDims, int DataWordDims, int RangeBitLen)
-	: addr(AddrWordDims, RangeBitLen)
-	, writeCount(0)
-	, dataDims(DataWordDims)
-	, id(NumInstances)
+HardLocation::HardLocation(Memory& Owner, uint32_t Index)
+	: mem(&Owner)
+	, index(Index)
 {
-	int range_size = 1 << RangeBitLen;
-	counters = vector<COUNTER>(dataDims * range_size);
-	NumInstances++;
 }
 
 void HardLocation::Write(const Word& Data)
 {
-	if (counters.size() != (Data.NumDimensions() * addr.RangeSize()))
-		throw exception("Invalid number of counters");
+	(this->*mem->ops->Write)(Data);
+}
+
+void HardLocation::Read(int32_t* Sums) const
+{
+	(this->*mem->ops->Read)(Sums);
+}
+
+/**
+ Steps a counter by one within [Counters::Min, Counters::Max] and returns its new value. Concurrent
+ writers step it with a compare-exchange so no step is lost.
+*/
+template <class Counters, bool Concurrent, class T>
+static inline int32_t StepCounter(T& Counter, int Step)
+{
+	if constexpr (Concurrent)
+	{
+		atomic<T>& counter = AsAtomic(Counter);
+		T value = counter.load(memory_order_relaxed);
+
+		while (Step > 0 ? value < Counters::Max : value > Counters::Min)
+		{
+			if (counter.compare_exchange_weak(value, T(value + Step), memory_order_relaxed))
+				return int32_t(T(value + Step));
+		}
+
+		return value;
+	}
+	else
+	{
+		if (Step > 0 ? Counter < Counters::Max : Counter > Counters::Min)
+			Counter += Step;
 
+		return Counter;
+	}
+}
+
+/**
+ Applies a write to a row of counters stored as T and returns the largest counter it incremented.
+ With Concurrent set the row can be written by several threads at once.
+*/
+template <class Counters, bool Concurrent, class T>
+static int32_t WriteCounters(T* counters, const Word& Data)
+{
 	// TODO: optimize
 
+	int32_t peak = 0;
 	int sub_len = Data.NumSubwords();
 	int range_len = Data.RangeBits();
 
@@ -45,13 +83,12 @@ void HardLocation::Write(const Word& Data)
 
 				if (masked == 0)
 				{
-					if (counters[ctr_index] > COUNTER_MIN) 
-						counters[ctr_index]--;
+					StepCounter<Counters, Concurrent>(counters[ctr_index], -1);
 				}
 				else
 				{
-					if (counters[ctr_index] < COUNTER_MAX) 
-						counters[ctr_index]++;
+					int32_t counter = StepCounter<Counters, Concurrent>(counters[ctr_index], 1);
+					peak = MAX(peak, counter);
 				}
 			}
 		}
@@ -72,117 +109,436 @@ void HardLocation::Write(const Word& Data)
 				SUBWORD mask = base_mask << shift;
 				uint8_t value = (sw & mask) >> shift;
 
-#if DECREMENT_UNMATCHED
-				int val_offset = (i * ints_per_sw) + j;
-				int ctr_offset = val_offset * range_size;
-
-				for (int k = ctr_offset; k < ctr_offset + range_size; k++)
+				if constexpr (Counters::DecrementUnmatched)
 				{
-					if (k == ctr_offset + value)
-					{
-						if (counters[k] < COUNTER_MAX)
-							counters[k]++;
-					}
-					else
+					int val_offset = (i * ints_per_sw) + j;
+					int ctr_offset = val_offset * range_size;
+
+					for (int k = ctr_offset; k < ctr_offset + range_size; k++)
 					{
-						if (counters[k] > COUNTER_MIN)
-							counters[k]--;
+						if (k == ctr_offset + value)
+						{
+							int32_t counter = StepCounter<Counters, Concurrent>(counters[k], 1);
+							peak = MAX(peak, counter);
+						}
+						else
+						{
+							StepCounter<Counters, Concurrent>(counters[k], -1);
+						}
 					}
 				}
-#else
-				int val_index = (i * ints_per_sw) + j;
-				int ctr_index = val_index * range_size + value;
-				counters[ctr_index]++;
-#endif
+				else
+				{
+					int val_index = (i * ints_per_sw) + j;
+					int ctr_index = val_index * range_size + value;
+					int32_t counter = StepCounter<Counters, Concurrent>(counters[ctr_index], 1);
+					peak = MAX(peak, counter);
+				}
 			}
 		}
 	}
 
-	writeCount++;
-	dataWritten.push_back(Data.SubwordAt(0) & 0xF);
+	return peak;
 }
 
-void HardLocation::Read(vector<COUNTER>& OutCounters)
+template <class Counters>
+void HardLocation::WriteWith(const Word& Data)
 {
-	int len = counters.size();
+	if (mem->counterStride != (Data.NumDimensions() * Data.RangeSize()))
+		throw exception("Invalid number of counters");
 
-	if (len != OutCounters.size())
-		throw exception("Incompatible counters lengths");
+	if (!mem->HasCounters(index))
+		mem->AllocateCounterRow(index, false);
 
-	int range_len = addr.RangeBits();
+	// Every write increments a counter by at most one, so a row is only promoted once a counter
+	// has reached the narrow maximum and can't take another increment
+	if (Counters::Adaptive && !mem->HasWideCounters(index) && mem->counterPeaks[index] >= Counters::NarrowMax)
+		PromoteCounters<Counters>();
 
-	if (range_len == 1)
+	if (Counters::Adaptive && mem->HasWideCounters(index))
+	{
+		WriteCounters<Counters, false>(mem->CounterRow<typename Counters::Type>(index), Data);
+	}
+	else
+	{
+		int32_t peak = WriteCounters<Counters, false>(mem->CounterRow<typename Counters::NarrowType>(index), Data);
+		mem->counterPeaks[index] = uint8_t(MIN(MAX(peak, int32_t(mem->counterPeaks[index])), UINT8_MAX));
+	}
+
+	mem->RecordWrite(index, Data);
+}
+
+/**
+ Moves the counters of a narrow row to a new wide row
+*/
+template <class Counters>
+void HardLocation::PromoteCounters()
+{
+	uint32_t narrow_row = mem->counterRows[index];
+	const typename Counters::NarrowType* narrow = mem->CounterRow<typename Counters::NarrowType>(index);
+
+	mem->AllocateCounterRow(index, true);
+	typename Counters::Type* wide = mem->CounterRow<typename Counters::Type>(index);
+
+	for (int i = 0; i < mem->counterStride; i++)
+		wide[i] = narrow[i];
+
+	mem->FreeCounterRow(narrow_row);
+}
+
+/**
+ Gives the hard location a row that WriteConcurrentWith can write without allocating or
+ promoting it: a full width one, for adaptive policies
+*/
+template <class Counters>
+void HardLocation::PrepareConcurrentWritesWith()
+{
+	if (!mem->HasCounters(index))
+		mem->AllocateCounterRow(index, Counters::Adaptive);
+	else if (Counters::Adaptive && !mem->HasWideCounters(index))
+		PromoteCounters<Counters>();
+}
+
+template <class Counters>
+void HardLocation::WriteConcurrentWith(const Word& Data)
+{
+	if (mem->counterStride != (Data.NumDimensions() * Data.RangeSize()))
+		throw exception("Invalid number of counters");
+
+	WriteCounters<Counters, true>(mem->CounterRow<typename Counters::Type>(index), Data);
+	mem->RecordWrite(index, Data, true);
+}
+
+/**
+ Undoes PrepareConcurrentWritesWith: drops the row if every counter is still zero and narrows it if
+ no counter has reached the narrow maximum, which is where writing one word at a time would have
+ left it
+*/
+template <class Counters>
+void HardLocation::CompactCountersWith()
+{
+	uint32_t row = mem->counterRows[index];
+	const typename Counters::Type* counters = mem->CounterRow<typename Counters::Type>(index);
+	int32_t peak = 0;
+	bool written = false;
+
+	for (int i = 0; i < mem->counterStride; i++)
+	{
+		peak = MAX(peak, int32_t(counters[i]));
+		written |= counters[i] != 0;
+	}
+
+	if (!written)
+	{
+		mem->FreeCounterRow(row);
+		mem->counterRows[index] = NO_COUNTER_ROW;
+	}
+	else if (Counters::Adaptive && mem->HasWideCounters(index) && peak < Counters::NarrowMax)
+	{
+		mem->AllocateCounterRow(index, false);
+		typename Counters::NarrowType* narrow = mem->CounterRow<typename Counters::NarrowType>(index);
+
+		for (int i = 0; i < mem->counterStride; i++)
+			narrow[i] = typename Counters::NarrowType(counters[i]);
+
+		mem->counterPeaks[index] = uint8_t(peak);
+		mem->FreeCounterRow(row);
+	}
+}
+
+template <class Counters, class T>
+static void ReadCounters(const T* counters, int len, int rangeLen, int32_t* Sums)
+{
+	if (rangeLen == 1)
 	{
 		for (int i = 0; i < len; i++)
 		{
-			if (counters[i] > 0)
-			{
-				if (OutCounters[i] < COUNTER_MAX) 
-					OutCounters[i]++;
-			}
-			else if (counters[i] < 0)
-			{
-				if (OutCounters[i] > COUNTER_MIN) 
-					OutCounters[i]--;
-			}
-			else
-			{
-				if (Word::RandomBit())
-				{
-					if (OutCounters[i] < COUNTER_MAX) 
-						OutCounters[i]++;
-				}
-				else
-				{
-					if (OutCounters[i] > COUNTER_MIN) 
-						OutCounters[i]--;
-				}
-			}
+			int32_t vote = counters[i] > 0 ? 1 : counters[i] < 0 ? -1 : Word::RandomBit() ? 1 : -1;
+			Sums[i] = MIN(MAX(Sums[i] + vote, Counters::Min), Counters::Max);
 		}
 	}
 	else
 	{
-		int ctr_len = counters.size();
+		for (int i = 0; i < len; i++)
+		{
+			Sums[i] = MIN(MAX(Sums[i] + int32_t(counters[i]), Counters::Min), Counters::Max);
+		}
+	}
+}
+
+/**
+ Adds this hard location's counters to a read, saturating each sum to the counter range as it
+ goes, so reads depend on the order hard locations are added in; Memory adds them in index order.
+ For binary words each counter only votes with its sign, and zero counters vote at random.
+*/
+template <class Counters>
+void HardLocation::ReadWith(int32_t* Sums) const
+{
+	int len = mem->counterStride;
 
-		for (int i = 0; i < ctr_len; i++)
+	if (!mem->HasCounters(index))
+	{
+		if (mem->rangeLen == 1)
 		{
-			int sum = OutCounters[i] + counters[i];
-			if (sum > COUNTER_MAX)
-				OutCounters[i] = COUNTER_MAX;
-#if DECREMENT_UNMATCHED
-			else if (sum < COUNTER_MIN)
-				OutCounters[i] = COUNTER_MIN;
-#endif
-			else
-				OutCounters[i] = (COUNTER)sum;
+			for (int i = 0; i < len; i++)
+				Sums[i] = MIN(MAX(Sums[i] + (Word::RandomBit() ? 1 : -1), Counters::Min), Counters::Max);
 		}
+
+		return;
 	}
+
+	if (mem->HasWideCounters(index))
+		ReadCounters<Counters>(mem->CounterRow<typename Counters::Type>(index), len, mem->rangeLen, Sums);
+	else
+		ReadCounters<Counters>(mem->CounterRow<typename Counters::NarrowType>(index), len, mem->rangeLen, Sums);
+}
+
+int HardLocation::WriteCount() const
+{
+	return mem->writeCounts[index];
+}
+
+vector<uint8_t> HardLocation::WriteHistory() const
+{
+	vector<uint8_t> history;
+
+	if (mem->policy.History != WriteHistoryMode::Ring)
+		return history;
+
+	const uint8_t* ring = &mem->historyRing[size_t(index) * WRITE_HISTORY_RING_LEN];
+	uint32_t writes = mem->historyWrites[index];
+
+	for (uint32_t i = writes - MIN(writes, uint32_t(WRITE_HISTORY_RING_LEN)); i < writes; i++)
+		history.push_back(ring[i % WRITE_HISTORY_RING_LEN]);
+
+	return history;
+}
+
+bool HardLocation::WriteHistogram(uint32_t* Counts) const
+{
+	switch (mem->policy.History)
+	{
+		case WriteHistoryMode::Histogram:
+		{
+			const uint16_t* counts = &mem->historyCounts[size_t(index) * WRITE_HISTORY_VALUES];
+
+			for (int value = 0; value < WRITE_HISTORY_VALUES; value++)
+				Counts[value] = counts[value];
+
+			return true;
+		}
+		case WriteHistoryMode::Ring:
+		{
+			memset(Counts, 0, sizeof(uint32_t) * WRITE_HISTORY_VALUES);
+
+			for (uint8_t value : WriteHistory())
+				Counts[value]++;
+
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+Word HardLocation::Address() const
+{
+	return Word::FromSubwords(mem->addrDims, mem->rangeLen, AddressData());
+}
+
+void HardLocation::SetAddress(const Word& Addr)
+{
+	if (Addr.NumDimensions() != mem->addrDims || Addr.RangeBits() != mem->rangeLen)
+		throw exception("Incompatible address word");
+
+	mem->SetAddressRow(index, Addr.Data());
+}
+
+const SUBWORD* HardLocation::AddressData() const
+{
+	return mem->AddressRow(index);
 }
 
 void HardLocation::Serialize(std::ostream& stream)
 {
-	STREAM_WRITE_INT32(stream, writeCount);
-	STREAM_WRITE_INT16(stream, dataDims);
-	addr.Serialize(stream);
+	BufferedStreamWriter writer(stream, 0);
+	SerializeRecord(writer, false);
+	writer.Flush();
+}
+
+void HardLocation::Deserialize(std::istream& stream)
+{
+	BufferedStreamReader reader(stream, 0);
+	DeserializeRecord(reader, false);
+}
+
+/**
+ The sparse record is the dense one with the counters preceded by a flag, and left out for hard
+ locations that don't have any
+*/
+void HardLocation::SerializeRecord(BufferedStreamWriter& Writer, bool Sparse)
+{
+	bool has_counters = mem->HasCounters(index);
+
+	Writer.Put(uint32_t(mem->writeCounts[index]));
+	Writer.Put(uint16_t(mem->dataDims));
+	Word::SerializeSubwords(Writer, mem->addrDims, mem->rangeLen, AddressData());
+
+	if (Sparse)
+		Writer.Put(uint8_t(has_counters));
+
+	if (has_counters || !Sparse)
+		(this->*mem->ops->SerializeCounters)(Writer);
+}
+
+/**
+ The address goes straight into the address matrix unless the memory keeps indexes that have to
+ see the old address
+*/
+void HardLocation::DeserializeRecord(BufferedStreamReader& Reader, bool Sparse)
+{
+	uint32_t write_count = Reader.Get<uint32_t>();
+	uint16_t data_dims = Reader.Get<uint16_t>();
+
+	if (data_dims != mem->dataDims)
+		throw exception("Hard location data dimensions don't match the memory");
 
-	for (COUNTER ctr : counters)
+	if (mem->lsh || mem->sliced)
+	{
+		vector<SUBWORD> addr(mem->addrSubwords);
+		Word::DeserializeSubwords(Reader, mem->addrDims, mem->rangeLen, addr.data());
+		mem->SetAddressRow(index, addr.data());
+	}
+	else
 	{
-		STREAM_WRITE_INT16(stream, ctr);
+		Word::DeserializeSubwords(Reader, mem->addrDims, mem->rangeLen, mem->AddressRow(index));
+		mem->AddressRowChanged(index);
 	}
+
+	mem->writeCounts[index] = write_count;
+
+	if (!Sparse || Reader.Get<uint8_t>() != 0)
+		(this->*mem->ops->DeserializeCounters)(Reader);
 }
 
-HardLocation::HardLocation(std::istream& stream)
+/**
+ Counters are saved as 16 bits whatever their type, as in the files written before the counter
+ policies existed
+*/
+template <class Counters>
+void HardLocation::SerializeCounters(BufferedStreamWriter& Writer)
 {
-	STREAM_READ_INT32(stream, writeCount);
-	STREAM_READ_INT16(stream, dataDims);
-	
-	addr = Word(stream);
-	int ctr_len = dataDims * addr.RangeSize();
+	const typename Counters::Type* wide = mem->HasWideCounters(index) ? mem->CounterRow<typename Counters::Type>(index) : nullptr;
+	const typename Counters::NarrowType* narrow = mem->HasCounters(index) && !wide ? mem->CounterRow<typename Counters::NarrowType>(index) : nullptr;
+	int16_t* out = reinterpret_cast<int16_t*>(Writer.Reserve(sizeof(int16_t) * mem->counterStride));
 
-	COUNTER ctr = 0;
-	for (int i = 0; i < ctr_len; i++)
+	for (int i = 0; i < mem->counterStride; i++)
 	{
-		STREAM_READ_INT16(stream, ctr);
-		counters.push_back(ctr);
+		int16_t ctr = wide ? int16_t(wide[i]) : narrow ? int16_t(narrow[i]) : 0;
+		memcpy(out + i, &ctr, sizeof(int16_t));
 	}
-}
\ No newline at end of file
+}
+
+/**
+ Counters are decoded straight from the reader's buffer
+*/
+template <class Counters>
+void HardLocation::DeserializeCounters(BufferedStreamReader& Reader)
+{
+	const uint8_t* in = Reader.Take(sizeof(int16_t) * mem->counterStride);
+
+	StoreCounters<Counters>([in](int i)
+	{
+		int16_t ctr;
+		memcpy(&ctr, in + sizeof(int16_t) * i, sizeof(int16_t));
+		return int32_t(typename Counters::Type(ctr));
+	});
+}
+
+template <class Counters>
+void HardLocation::ExportCounters(int32_t* Values) const
+{
+	const typename Counters::Type* wide = mem->HasWideCounters(index) ? mem->CounterRow<typename Counters::Type>(index) : nullptr;
+	const typename Counters::NarrowType* narrow = mem->HasCounters(index) && !wide ? mem->CounterRow<typename Counters::NarrowType>(index) : nullptr;
+
+	for (int i = 0; i < mem->counterStride; i++)
+		Values[i] = wide ? int32_t(wide[i]) : narrow ? int32_t(narrow[i]) : 0;
+}
+
+template <class Counters>
+void HardLocation::ImportCounters(const int32_t* Values)
+{
+	StoreCounters<Counters>([Values](int i) { return int32_t(typename Counters::Type(Values[i])); });
+}
+
+/**
+ A counter row is only allocated when some counter isn't zero, so dense files written before
+ counters were allocated lazily load as sparse memories. Rows are narrow unless some counter
+ doesn't fit. Value(i) is called twice per counter, once to see what the row needs and once to
+ fill it in.
+*/
+template <class Counters, class ValueFunc>
+void HardLocation::StoreCounters(const ValueFunc& Value)
+{
+	int32_t peak = 0;
+	bool zero = true;
+	bool fits_narrow = true;
+
+	for (int i = 0; i < mem->counterStride; i++)
+	{
+		int32_t ctr = Value(i);
+		zero &= ctr == 0;
+		fits_narrow &= ctr == int32_t(typename Counters::NarrowType(ctr));
+		peak = MAX(peak, ctr);
+	}
+
+	if (!mem->HasCounters(index))
+	{
+		if (zero)
+			return;
+
+		mem->AllocateCounterRow(index, false);
+	}
+
+	if constexpr (Counters::Adaptive)
+	{
+		if (!mem->HasWideCounters(index) && !fits_narrow)
+			PromoteCounters<Counters>();
+
+		if (mem->HasWideCounters(index))
+		{
+			typename Counters::Type* counters = mem->CounterRow<typename Counters::Type>(index);
+
+			for (int i = 0; i < mem->counterStride; i++)
+				counters[i] = typename Counters::Type(Value(i));
+
+			return;
+		}
+	}
+
+	typename Counters::NarrowType* counters = mem->CounterRow<typename Counters::NarrowType>(index);
+
+	for (int i = 0; i < mem->counterStride; i++)
+		counters[i] = typename Counters::NarrowType(Value(i));
+
+	mem->counterPeaks[index] = uint8_t(MIN(peak, UINT8_MAX));
+}
+
+template void HardLocation::WriteWith<SaturatingCounters>(const Word& Data);
+template void HardLocation::WriteWith<DecrementUnmatchedCounters>(const Word& Data);
+template void HardLocation::ReadWith<SaturatingCounters>(int32_t* Sums) const;
+template void HardLocation::ReadWith<DecrementUnmatchedCounters>(int32_t* Sums) const;
+template void HardLocation::SerializeCounters<SaturatingCounters>(BufferedStreamWriter& Writer);
+template void HardLocation::SerializeCounters<DecrementUnmatchedCounters>(BufferedStreamWriter& Writer);
+template void HardLocation::DeserializeCounters<SaturatingCounters>(BufferedStreamReader& Reader);
+template void HardLocation::DeserializeCounters<DecrementUnmatchedCounters>(BufferedStreamReader& Reader);
+template void HardLocation::ExportCounters<SaturatingCounters>(int32_t* Values) const;
+template void HardLocation::ExportCounters<DecrementUnmatchedCounters>(int32_t* Values) const;
+template void HardLocation::ImportCounters<SaturatingCounters>(const int32_t* Values);
+template void HardLocation::ImportCounters<DecrementUnmatchedCounters>(const int32_t* Values);
+template void HardLocation::PrepareConcurrentWritesWith<SaturatingCounters>();
+template void HardLocation::PrepareConcurrentWritesWith<DecrementUnmatchedCounters>();
+template void HardLocation::WriteConcurrentWith<SaturatingCounters>(const Word& Data);
+template void HardLocation::WriteConcurrentWith<DecrementUnmatchedCounters>(const Word& Data);
+template void HardLocation::CompactCountersWith<SaturatingCounters>();
+template void HardLocation::CompactCountersWith<DecrementUnmatchedCounters>();
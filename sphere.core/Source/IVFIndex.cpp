@@ -0,0 +1,154 @@
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <utility>
+
+#include "CentroidAccumulator.h"
+#include "Common.h"
+#include "IVFIndex.h"
+#include "ThreadPool.h"
+
+using namespace std;
+using namespace sphere;
+
+// Number of rows assigned to centroids per thread pool chunk
+#define ASSIGN_CHUNK_SIZE 1024
+
+IVFIndex::IVFIndex()
+	: stride(0)
+	, rangeBits(0)
+	, metric(DistanceMetric::Euclidean)
+{
+}
+
+void IVFIndex::Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric, int NumLists, int Iterations, ThreadPool* Pool)
+{
+	if (Count <= 0)
+		throw exception("Nothing to index");
+
+	NumLists = MIN(MAX(NumLists, 1), Count);
+	int num_subwords = Word::SubwordsForLength(Dims, RangeBits);
+	rangeBits = RangeBits;
+	metric = Metric;
+	stride = Stride;
+
+	// Assigns every row in Rows to its nearest centroid, in parallel when there's a pool
+	auto assign = [&](const vector<uint32_t>& Rows, vector<int>& Lists)
+	{
+		ParallelFor(Pool, 0, int(Rows.size()), ASSIGN_CHUNK_SIZE, [&](int Begin, int End, int Thread)
+		{
+			for (int i = Begin; i < End; i++)
+				Lists[i] = NearestCentroid(Addrs + Rows[i] * Stride);
+		});
+	};
+
+	// Train on a random sample; the first NumLists rows of it seed the centroids
+	vector<uint32_t> all_rows(Count);
+	iota(all_rows.begin(), all_rows.end(), 0);
+
+	mt19937 rng(0x5EED);
+	vector<uint32_t> sample = all_rows;
+	shuffle(sample.begin(), sample.end(), rng);
+	sample.resize(MIN(size_t(Count), size_t(NumLists) * IVF_SAMPLES_PER_LIST));
+
+	centroids.clear();
+	for (int list = 0; list < NumLists; list++)
+		centroids.push_back(Word::FromSubwords(Dims, RangeBits, Addrs + sample[list] * Stride));
+
+	vector<int> sample_lists(sample.size());
+	vector<CentroidAccumulator> accumulators(NumLists, CentroidAccumulator(num_subwords, RangeBits));
+	vector<SUBWORD> mean(num_subwords);
+
+	for (int iter = 0; iter < Iterations; iter++)
+	{
+		assign(sample, sample_lists);
+
+		for (CentroidAccumulator& accumulator : accumulators)
+			accumulator.Clear();
+
+		for (size_t i = 0; i < sample.size(); i++)
+			accumulators[sample_lists[i]].Add(Addrs + sample[i] * Stride);
+
+		// Lists that ended up empty keep their previous centroid
+		for (int list = 0; list < NumLists; list++)
+		{
+			if (accumulators[list].Count() == 0)
+				continue;
+
+			accumulators[list].Mean(mean.data());
+			centroids[list] = Word::FromSubwords(Dims, RangeBits, mean.data());
+		}
+	}
+
+	// Group every row by its nearest centroid
+	vector<int> row_lists(Count);
+	assign(all_rows, row_lists);
+
+	listStart.assign(NumLists + 1, 0);
+	for (int list : row_lists)
+		listStart[list + 1]++;
+
+	for (int list = 0; list < NumLists; list++)
+		listStart[list + 1] += listStart[list];
+
+	vector<uint32_t> fill_pos(listStart.begin(), listStart.end() - 1);
+	order.resize(Count);
+	for (int i = 0; i < Count; i++)
+		order[fill_pos[row_lists[i]]++] = i;
+
+	rows.Allocate(size_t(Count) * stride);
+	for (int i = 0; i < Count; i++)
+		memcpy(rows.Ptr() + i * stride, Addrs + order[i] * Stride, sizeof(SUBWORD) * Stride);
+}
+
+int IVFIndex::Search(const Word& Query, int Radius, int NProbe, vector<uint32_t>& Out) const
+{
+	int num_lists = NumLists();
+	NProbe = MIN(MAX(NProbe, 1), num_lists);
+
+	vector<pair<uint32_t, int>> nearest(num_lists);
+	for (int list = 0; list < num_lists; list++)
+		nearest[list] = make_pair(Query.SquaredDistanceTo(centroids[list], metric), list);
+
+	partial_sort(nearest.begin(), nearest.begin() + NProbe, nearest.end());
+
+	uint32_t radius_sq = Word::SquaredRadius(Radius, rangeBits, metric);
+	int evaluations = num_lists;
+
+	for (int probe = 0; probe < NProbe; probe++)
+	{
+		int list = nearest[probe].second;
+
+		for (uint32_t i = listStart[list]; i < listStart[list + 1]; i++)
+		{
+			if (Query.WithinRadius(rows.Ptr() + i * stride, radius_sq, metric))
+				Out.push_back(order[i]);
+		}
+
+		evaluations += listStart[list + 1] - listStart[list];
+	}
+
+	return evaluations;
+}
+
+int IVFIndex::NearestCentroid(const SUBWORD* Row) const
+{
+	int nearest = 0;
+	uint32_t nearest_dist = UINT32_MAX;
+
+	for (int list = 0; list < NumLists(); list++)
+	{
+		uint32_t dist = centroids[list].SquaredDistanceTo(Row, metric);
+
+		if (dist < nearest_dist)
+		{
+			nearest_dist = dist;
+			nearest = list;
+		}
+	}
+
+	return nearest;
+}
@@ -0,0 +1,383 @@
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <utility>
+
+#include "Common.h"
+#include "LSHIndex.h"
+#include "ThreadPool.h"
+
+using namespace std;
+using namespace sphere;
+
+// Number of rows hashed per thread pool task
+#define HASH_CHUNK_SIZE 1024
+
+// Moved rows are merged into the sorted tables once more than 1 in LSH_MERGE_DIVISOR rows, or at
+// least LSH_MIN_MERGE_ROWS, have moved, so each merge is paid for by that many updates
+#define LSH_MERGE_DIVISOR 64
+#define LSH_MIN_MERGE_ROWS 1024
+
+LSHIndex::LSHIndex()
+	: checksum(0)
+	, count(0)
+	, dims(0)
+	, rangeBits(0)
+	, numTables(0)
+	, hashesPerTable(0)
+	, bucketWidth(0)
+	, numMoved(0)
+{
+}
+
+/**
+ The projection directions are drawn with a fixed seed so builds are repeatable. They're stored
+ pre-divided by the bucket width and the offsets are in slots, so a projection is already the
+ fractional slot number.
+*/
+void LSHIndex::Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric, int NumTables, int HashesPerTable, float BucketWidth, ThreadPool* Pool)
+{
+	if (Count <= 0)
+		throw exception("Nothing to index");
+
+	if (NumTables <= 0 || HashesPerTable <= 0 || BucketWidth <= 0)
+		throw exception("Invalid LSH parameters");
+
+	count = Count;
+	dims = Dims;
+	rangeBits = RangeBits;
+	numTables = NumTables;
+	hashesPerTable = HashesPerTable;
+	bucketWidth = BucketWidth;
+
+	int num_hashes = numTables * hashesPerTable;
+	mt19937 rng(0x5EED);
+	cauchy_distribution<float> cauchy_dist(0.0f, 1.0f);
+	normal_distribution<float> normal_dist(0.0f, 1.0f);
+	uniform_real_distribution<float> offset_dist(0.0f, 1.0f);
+
+	directions.resize(size_t(dims) * num_hashes);
+	for (float& weight : directions)
+		weight = (LinearMetric(Metric) == DistanceMetric::Manhattan ? cauchy_dist(rng) : normal_dist(rng)) / bucketWidth;
+
+	offsets.resize(num_hashes);
+	for (float& offset : offsets)
+		offset = offset_dist(rng);
+
+	entries.assign(numTables, vector<uint64_t>(Count));
+	moved.assign(numTables, unordered_multimap<uint32_t, uint32_t>());
+	movedRows.assign(Count, 0);
+	numMoved = 0;
+
+	vector<uint32_t> chunk_checksums((Count + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE, 0);
+
+	RunTasks(Pool, int(chunk_checksums.size()), [&](int Task, int Thread)
+	{
+		vector<uint32_t> keys(numTables);
+		int end = MIN(Count, (Task + 1) * HASH_CHUNK_SIZE);
+
+		for (int row = Task * HASH_CHUNK_SIZE; row < end; row++)
+		{
+			const SUBWORD* addr = Addrs + row * Stride;
+			RowKeys(addr, keys.data());
+
+			for (int table = 0; table < numTables; table++)
+				entries[table][row] = (uint64_t(keys[table]) << 32) | uint32_t(row);
+
+			chunk_checksums[Task] ^= RowChecksum(row, addr);
+		}
+	});
+
+	RunTasks(Pool, numTables, [&](int Task, int Thread)
+	{
+		sort(entries[Task].begin(), entries[Task].end());
+	});
+
+	checksum = 0;
+	for (uint32_t chunk_checksum : chunk_checksums)
+		checksum ^= chunk_checksum;
+}
+
+/**
+ Erasing and inserting into the sorted tables would move half of every table per update. Instead
+ the row's entries there are marked stale and its current keys are kept in the moved tables,
+ which MergeMoved folds back in once enough rows have moved.
+*/
+void LSHIndex::Update(int Row, const SUBWORD* OldAddr, const SUBWORD* NewAddr)
+{
+	vector<uint32_t> old_keys(numTables);
+	vector<uint32_t> new_keys(numTables);
+	RowKeys(OldAddr, old_keys.data());
+	RowKeys(NewAddr, new_keys.data());
+
+	for (int table = 0; table < numTables; table++)
+	{
+		unordered_multimap<uint32_t, uint32_t>& table_moved = moved[table];
+
+		if (movedRows[Row])
+		{
+			auto range = table_moved.equal_range(old_keys[table]);
+			auto pos = find_if(range.first, range.second, [Row](const pair<const uint32_t, uint32_t>& entry) { return entry.second == uint32_t(Row); });
+
+			if (pos == range.second)
+				throw exception("LSH tables are out of sync with the addresses");
+
+			table_moved.erase(pos);
+		}
+
+		table_moved.emplace(new_keys[table], uint32_t(Row));
+	}
+
+	if (!movedRows[Row])
+	{
+		movedRows[Row] = 1;
+		numMoved++;
+	}
+
+	checksum ^= RowChecksum(Row, OldAddr) ^ RowChecksum(Row, NewAddr);
+
+	if (numMoved > MAX(count / LSH_MERGE_DIVISOR, LSH_MIN_MERGE_ROWS))
+		MergeMoved();
+}
+
+void LSHIndex::MergeMoved()
+{
+	if (numMoved == 0)
+		return;
+
+	for (int table = 0; table < numTables; table++)
+	{
+		vector<uint64_t>& table_entries = entries[table];
+		size_t kept = remove_if(table_entries.begin(), table_entries.end(), [&](uint64_t entry) { return movedRows[uint32_t(entry)] != 0; }) - table_entries.begin();
+
+		table_entries.resize(kept);
+		for (const pair<const uint32_t, uint32_t>& entry : moved[table])
+			table_entries.push_back((uint64_t(entry.first) << 32) | entry.second);
+
+		sort(table_entries.begin() + kept, table_entries.end());
+		inplace_merge(table_entries.begin(), table_entries.begin() + kept, table_entries.end());
+		moved[table].clear();
+	}
+
+	fill(movedRows.begin(), movedRows.end(), 0);
+	numMoved = 0;
+}
+
+bool LSHIndex::Matches(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits) const
+{
+	if (Count != count || Dims != dims || RangeBits != rangeBits)
+		return false;
+
+	uint32_t addrs_checksum = 0;
+	for (int row = 0; row < Count; row++)
+		addrs_checksum ^= RowChecksum(row, Addrs + row * Stride);
+
+	return addrs_checksum == checksum;
+}
+
+/**
+ Besides the query's own bucket, every table probes the buckets one slot away along the
+ projections where the query lies closest to a slot boundary, nearest boundary first.
+*/
+int LSHIndex::Search(const Word& Query, int Radius, DistanceMetric Metric, int NumProbes, const SUBWORD* Addrs, size_t Stride, vector<uint32_t>& Out) const
+{
+	NumProbes = MIN(MAX(NumProbes, 0), 2 * hashesPerTable);
+
+	vector<float> projections(numTables * hashesPerTable);
+	Project(Query.Data(), projections.data());
+
+	vector<uint32_t> candidates;
+	vector<int32_t> slots(hashesPerTable);
+	vector<pair<float, int>> perturbations(2 * hashesPerTable);
+
+	auto collect = [&](int Table)
+	{
+		const vector<uint64_t>& table_entries = entries[Table];
+		uint32_t key = BucketKey(slots.data());
+
+		for (auto it = lower_bound(table_entries.begin(), table_entries.end(), uint64_t(key) << 32);
+			it != table_entries.end() && uint32_t(*it >> 32) == key; ++it)
+		{
+			if (!movedRows[uint32_t(*it)])
+				candidates.push_back(uint32_t(*it));
+		}
+
+		if (numMoved > 0)
+		{
+			auto range = moved[Table].equal_range(key);
+			for (auto it = range.first; it != range.second; ++it)
+				candidates.push_back(it->second);
+		}
+	};
+
+	for (int table = 0; table < numTables; table++)
+	{
+		const float* projection = projections.data() + table * hashesPerTable;
+
+		for (int hash = 0; hash < hashesPerTable; hash++)
+		{
+			float slot = floorf(projection[hash]);
+			slots[hash] = int32_t(slot);
+
+			// Even codes step down a slot, odd codes step up; the score is the distance to that boundary
+			perturbations[2 * hash] = make_pair(projection[hash] - slot, 2 * hash);
+			perturbations[2 * hash + 1] = make_pair(1.0f - (projection[hash] - slot), 2 * hash + 1);
+		}
+
+		collect(table);
+
+		if (NumProbes == 0)
+			continue;
+
+		partial_sort(perturbations.begin(), perturbations.begin() + NumProbes, perturbations.end());
+
+		for (int probe = 0; probe < NumProbes; probe++)
+		{
+			int hash = perturbations[probe].second / 2;
+			int step = perturbations[probe].second % 2 ? 1 : -1;
+
+			slots[hash] += step;
+			collect(table);
+			slots[hash] -= step;
+		}
+	}
+
+	// Visit the rows in memory order, once each
+	sort(candidates.begin(), candidates.end());
+	candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+	uint32_t radius_sq = Word::SquaredRadius(Radius, rangeBits, Metric);
+	for (uint32_t row : candidates)
+	{
+		if (Query.WithinRadius(Addrs + row * Stride, radius_sq, Metric))
+			Out.push_back(row);
+	}
+
+	return int(candidates.size());
+}
+
+/**
+ Writes every projection of Row, in slots. The weights of a dimension are contiguous so the inner
+ loop is a plain multiply-add across all the projections, and zero integers are skipped.
+*/
+void LSHIndex::Project(const SUBWORD* Row, float* Out) const
+{
+	int num_hashes = numTables * hashesPerTable;
+	int ints_per_sw = SUBWORD_NUM_BITS / rangeBits;
+	SUBWORD mask = (1 << rangeBits) - 1;
+
+	memcpy(Out, offsets.data(), sizeof(float) * num_hashes);
+
+	for (int dim = 0; dim < dims; dim++)
+	{
+		int shift = SUBWORD_NUM_BITS - rangeBits * (dim % ints_per_sw + 1);
+		SUBWORD value = (Row[dim / ints_per_sw] >> shift) & mask;
+
+		if (value == 0)
+			continue;
+
+		float x = float(value);
+		const float* weights = directions.data() + size_t(dim) * num_hashes;
+
+		for (int hash = 0; hash < num_hashes; hash++)
+			Out[hash] += x * weights[hash];
+	}
+}
+
+uint32_t LSHIndex::BucketKey(const int32_t* Slots) const
+{
+	// FNV-1a over the slots; colliding buckets only add candidates that the exact check drops
+	uint32_t key = 2166136261u;
+	for (int hash = 0; hash < hashesPerTable; hash++)
+		key = (key ^ uint32_t(Slots[hash])) * 16777619u;
+
+	return key;
+}
+
+void LSHIndex::RowKeys(const SUBWORD* Row, uint32_t* Keys) const
+{
+	vector<float> projections(numTables * hashesPerTable);
+	vector<int32_t> slots(hashesPerTable);
+	Project(Row, projections.data());
+
+	for (int table = 0; table < numTables; table++)
+	{
+		for (int hash = 0; hash < hashesPerTable; hash++)
+			slots[hash] = int32_t(floorf(projections[table * hashesPerTable + hash]));
+
+		Keys[table] = BucketKey(slots.data());
+	}
+}
+
+uint32_t LSHIndex::RowChecksum(int Row, const SUBWORD* Addr) const
+{
+	uint32_t sum = 2166136261u ^ uint32_t(Row);
+	int num_subwords = Word::SubwordsForLength(dims, rangeBits);
+
+	for (int i = 0; i < num_subwords; i++)
+		sum = (sum ^ Addr[i]) * 16777619u;
+
+	return sum;
+}
+
+void LSHIndex::Serialize(ostream& stream)
+{
+	MergeMoved();
+
+	stream.write(LSH_FILE_PREFIX, LSH_FILE_PREFIX_LEN);
+	STREAM_WRITE_INT32(stream, count);
+	STREAM_WRITE_INT32(stream, dims);
+	STREAM_WRITE_INT32(stream, rangeBits);
+	STREAM_WRITE_INT32(stream, numTables);
+	STREAM_WRITE_INT32(stream, hashesPerTable);
+	STREAM_WRITE_INT32(stream, bucketWidth);
+	STREAM_WRITE_INT32(stream, checksum);
+
+	stream.write(reinterpret_cast<const char*>(directions.data()), sizeof(float) * directions.size());
+	stream.write(reinterpret_cast<const char*>(offsets.data()), sizeof(float) * offsets.size());
+
+	for (const vector<uint64_t>& table_entries : entries)
+		stream.write(reinterpret_cast<const char*>(table_entries.data()), sizeof(uint64_t) * table_entries.size());
+}
+
+LSHIndex::LSHIndex(istream& stream)
+	: LSHIndex()
+{
+	char buffer[LSH_FILE_PREFIX_LEN];
+
+	stream.read(buffer, LSH_FILE_PREFIX_LEN);
+
+	if (strncmp(buffer, LSH_FILE_PREFIX, LSH_FILE_PREFIX_LEN) != 0)
+	{
+		throw exception("Invalid file; prefix not found.");
+	}
+
+	STREAM_READ_INT32(stream, count)
+	STREAM_READ_INT32(stream, dims)
+	STREAM_READ_INT32(stream, rangeBits)
+	STREAM_READ_INT32(stream, numTables)
+	STREAM_READ_INT32(stream, hashesPerTable)
+	STREAM_READ_INT32(stream, bucketWidth)
+	STREAM_READ_INT32(stream, checksum)
+
+	if (count <= 0 || dims <= 0 || rangeBits <= 0 || numTables <= 0 || hashesPerTable <= 0)
+		throw exception("Invalid LSH tables");
+
+	int num_hashes = numTables * hashesPerTable;
+	directions.resize(size_t(dims) * num_hashes);
+	offsets.resize(num_hashes);
+	entries.assign(numTables, vector<uint64_t>(count));
+	moved.assign(numTables, unordered_multimap<uint32_t, uint32_t>());
+	movedRows.assign(count, 0);
+
+	stream.read(reinterpret_cast<char*>(directions.data()), sizeof(float) * directions.size());
+	stream.read(reinterpret_cast<char*>(offsets.data()), sizeof(float) * offsets.size());
+
+	for (vector<uint64_t>& table_entries : entries)
+		stream.read(reinterpret_cast<char*>(table_entries.data()), sizeof(uint64_t) * table_entries.size());
+
+	if (stream.fail())
+		throw exception("Input stream ended too early");
+}
@@ -0,0 +1,84 @@
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Common.h"
+#include "MappedFile.h"
+
+using namespace std;
+using namespace sphere;
+
+MappedFile::MappedFile(const string& FilePath)
+	: path(FilePath)
+	, data(nullptr)
+	, size(0)
+	, mapping(nullptr)
+{
+#if defined(_MSC_VER)
+	HANDLE file = CreateFileA(FilePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE)
+		throw exception("Could not open input file for reading");
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		throw exception("Could not map an empty file");
+	}
+
+	// The view keeps the file open; the handles aren't needed once it exists
+	mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	CloseHandle(file);
+
+	if (mapping == nullptr)
+		throw exception("Could not map input file");
+
+	data = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+
+	if (data == nullptr)
+	{
+		CloseHandle(mapping);
+		throw exception("Could not map input file");
+	}
+
+	size = size_t(file_size.QuadPart);
+#else
+	int file = open(FilePath.c_str(), O_RDONLY);
+
+	if (file < 0)
+		throw exception("Could not open input file for reading");
+
+	struct stat file_stat;
+	if (fstat(file, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		close(file);
+		throw exception("Could not map an empty file");
+	}
+
+	size = size_t(file_stat.st_size);
+	void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	close(file);
+
+	if (view == MAP_FAILED)
+		throw exception("Could not map input file");
+
+	data = static_cast<uint8_t*>(view);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#if defined(_MSC_VER)
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+#else
+	munmap(data, size);
+#endif
+}
@@ -1,22 +1,90 @@
 
+#include <algorithm>
 #include <fstream>
+#include <utility>
 #include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <filesystem>
 
+#include "BufferedStream.h"
 #include "Common.h"
+#include "CentroidAccumulator.h"
+#include "DistanceKernels.h"
+#include "MappedFile.h"
 #include "Memory.h"
+#include "SnapshotCodec.h"
+#include "ThreadPool.h"
 
 using namespace std;
 using namespace sphere;
 
+// Number of hard locations whose deferred writes are applied per thread pool chunk
+#define DEFERRED_WRITE_GRAIN 64
+
 Memory::Memory()
 	: addrDims(0)
 	, dataDims(0)
 	, rangeLen(0)
 	, radius(0)
 	, writeCount(0)
-	, storage()
+	, numHardLocations(0)
+	, addrSubwords(0)
+	, addrStride(0)
+	, counterStride(0)
 	, initialized(false)
+	, exactStats(false)
+	, concurrentWrites(false)
+	, numThreads(1)
+	, pinThreads(false)
+	, lshEnabled(false)
+	, lshProbes(0)
+	, ops(SelectOps(policy))
+{
+}
+
+Memory::Memory(const MemoryPolicy& Policy)
+	: Memory()
 {
+	policy = Policy;
+	ops = SelectOps(Policy);
+}
+
+/**
+ Factory for the policy-specific entry points. Every combination of policies is instantiated here
+ so memories of all kinds can be used side by side in one process.
+*/
+/*static*/
+const Memory::PolicyOps* Memory::SelectOps(const MemoryPolicy& Policy)
+{
+#define POLICY_OPS(Metric, Counters) \
+	{ \
+		sizeof(Counters::Type), sizeof(Counters::NarrowType), Counters::Adaptive ? Counters::NarrowMax : INT32_MAX, \
+		&Memory::ScanWith<Metric, ActivatedFunc>, \
+		&Memory::ReadQueriesWith<Metric, Counters>, \
+		&HardLocation::WriteWith<Counters>, \
+		&HardLocation::ReadWith<Counters>, \
+		&HardLocation::SerializeCounters<Counters>, \
+		&HardLocation::DeserializeCounters<Counters>, \
+		&HardLocation::ExportCounters<Counters>, \
+		&HardLocation::ImportCounters<Counters>, \
+		&HardLocation::PrepareConcurrentWritesWith<Counters>, \
+		&HardLocation::WriteConcurrentWith<Counters>, \
+		&HardLocation::CompactCountersWith<Counters> \
+	}
+
+	// Indexed by DistanceMetric, then CounterMode
+	static const PolicyOps table[NUM_DISTANCE_METRICS][NUM_COUNTER_MODES] =
+	{
+		{ POLICY_OPS(EuclideanMetric, SaturatingCounters), POLICY_OPS(EuclideanMetric, DecrementUnmatchedCounters) },
+		{ POLICY_OPS(ManhattanMetric, SaturatingCounters), POLICY_OPS(ManhattanMetric, DecrementUnmatchedCounters) },
+		{ POLICY_OPS(CircularEuclideanMetric, SaturatingCounters), POLICY_OPS(CircularEuclideanMetric, DecrementUnmatchedCounters) },
+		{ POLICY_OPS(CircularManhattanMetric, SaturatingCounters), POLICY_OPS(CircularManhattanMetric, DecrementUnmatchedCounters) },
+	};
+
+#undef POLICY_OPS
+
+	return &table[int(Policy.Metric)][int(Policy.Counters)];
 }
 
 void Memory::Initialize(int AddrWordDims, int DataWordDims, int RangeBitLen, int NumHardLocations, int Radius)
@@ -29,9 +97,12 @@ void Memory::Initialize(int AddrWordDims, int DataWordDims, int RangeBitLen, int
 	rangeLen = RangeBitLen;
 	radius = Radius;
 
+	AllocateHardLocations(NumHardLocations);
+
 	for (int i = 0; i < NumHardLocations; i++)
 	{
-		storage.push_back(HardLocation(addrDims, dataDims, rangeLen));
+		Word::RandomizeSubwords(AddressRow(i), addrSubwords);
+		AddressRowChanged(i);
 	}
 
 	initialized = true;
@@ -49,175 +120,1757 @@ void Memory::InitializeFixedHardLocations(int AddrWordDims, int DataWordDims, in
 	dataDims = DataWordDims;
 	rangeLen = RangeBitLen;
 	radius = Radius;
+
+	AllocateHardLocations(NumHardLocations);
+
 	for (int i = 0; i < NumHardLocations; i++)
 	{
-		const Word& addr = Addrs[i];
-		storage.push_back(HardLocation(addrDims, dataDims, rangeLen));
+		HardLocationAt(i).SetAddress(Addrs[i]);
 	}
 
 	initialized = true;
 }
 
-bool Memory::Write(const Word& Addr, const Word& Data)
+/**
+ Sizes the hard location matrices for the current word dimensions; everything starts zeroed and
+ no hard location has counters yet
+*/
+void Memory::AllocateHardLocations(int NumHardLocations)
 {
-	if (!initialized)
-		throw exception("Memory has not been initialized");
+	numHardLocations = NumHardLocations;
+	addrSubwords = Word::SubwordsForLength(addrDims, rangeLen);
+	addrStride = AlignedBuffer<SUBWORD>::PaddedRowLength(addrSubwords);
+	counterStride = dataDims * (1 << rangeLen);
+
+	addrs.Allocate(size_t(numHardLocations) * addrStride);
+	counterPools[0] = CounterPool { {}, {}, 0, size_t(counterStride) * ops->NarrowCounterSize };
+	counterPools[1] = CounterPool { {}, {}, 0, size_t(counterStride) * ops->CounterSize };
+	counterRows.assign(numHardLocations, NO_COUNTER_ROW);
+	counterPeaks.assign(numHardLocations, 0);
+	writeCounts = vector<uint32_t>(numHardLocations, 0);
+
+	historyCounts.assign(policy.History == WriteHistoryMode::Histogram ? size_t(numHardLocations) * WRITE_HISTORY_VALUES : 0, 0);
+	historyRing.assign(policy.History == WriteHistoryMode::Ring ? size_t(numHardLocations) * WRITE_HISTORY_RING_LEN : 0, 0);
+	historyWrites.assign(policy.History == WriteHistoryMode::Ring ? numHardLocations : 0, 0);
+
+	// Full scans measure linear Euclidean distances between 4-bit words as |a|^2 + |b|^2 - 2 a.b
+	addrNorms.assign(policy.Metric == DistanceMetric::Euclidean && rangeLen == 4 ? numHardLocations : 0, 0);
+}
 
-	// TODO: optimize this search
-	float sum = 0.0f;
-	float min = FLT_MAX;
-	int activated = 0;
+void Memory::RecordWrite(int Index, const Word& Data, bool Concurrent)
+{
+	uint8_t value = Data.SubwordAt(0) & (WRITE_HISTORY_VALUES - 1);
 
-	int len = storage.size();
+	if (Concurrent)
+		AsAtomic(writeCounts[Index]).fetch_add(1, memory_order_relaxed);
+	else
+		writeCounts[Index]++;
 
-	for (int i = 0; i < len; i++)
+	switch (policy.History)
 	{
-		float dist = Addr.DistanceTo(storage[i].Address());
+		case WriteHistoryMode::Histogram:
+		{
+			uint16_t& count = historyCounts[size_t(Index) * WRITE_HISTORY_VALUES + value];
 
-		if (dist <= radius)
+			if (Concurrent)
+			{
+				uint16_t current = AsAtomic(count).load(memory_order_relaxed);
+				while (current < UINT16_MAX && !AsAtomic(count).compare_exchange_weak(current, uint16_t(current + 1), memory_order_relaxed));
+			}
+			else if (count < UINT16_MAX)
+			{
+				count++;
+			}
+			break;
+		}
+		case WriteHistoryMode::Ring:
 		{
-			storage[i].Write(Data);
-			activated++;
+			uint32_t slot = Concurrent ? AsAtomic(historyWrites[Index]).fetch_add(1, memory_order_relaxed) : historyWrites[Index]++;
+			uint8_t& entry = historyRing[size_t(Index) * WRITE_HISTORY_RING_LEN + slot % WRITE_HISTORY_RING_LEN];
+
+			if (Concurrent)
+				AsAtomic(entry).store(value, memory_order_relaxed);
+			else
+				entry = value;
+			break;
 		}
+		default:
+			break;
+	}
+}
+
+void Memory::AllocateCounterRow(int Index, bool Wide)
+{
+	CounterPool& pool = counterPools[Wide ? 1 : 0];
+	uint32_t row;
 
-		sum += dist;
+	if (!pool.FreeRows.empty())
+	{
+		row = pool.FreeRows.back();
+		pool.FreeRows.pop_back();
+	}
+	else
+	{
+		if (pool.NumRows % COUNTER_SLAB_ROWS == 0)
+			pool.Slabs.emplace_back(COUNTER_SLAB_ROWS * pool.RowSize);
 
-		if (dist < min) 
-			min = dist;
+		row = pool.NumRows++;
 	}
 
-	LastOPStats.Activations = activated;
-	LastOPStats.AverageDistance = sum / len;
-	LastOPStats.MinimumDistance = min;
-	
+	counterRows[Index] = Wide ? row | WIDE_COUNTER_ROW : row;
+	counterPeaks[Index] = 0;
+}
+
+void Memory::FreeCounterRow(uint32_t Row)
+{
+	CounterPool& pool = counterPools[(Row & WIDE_COUNTER_ROW) ? 1 : 0];
+	Row &= ~WIDE_COUNTER_ROW;
+
+	memset(pool.Slabs[Row / COUNTER_SLAB_ROWS].Ptr() + size_t(Row % COUNTER_SLAB_ROWS) * pool.RowSize, 0, pool.RowSize);
+	pool.FreeRows.push_back(Row);
+}
+
+int Memory::NumCounterRows() const
+{
+	return NumWideCounterRows() + int(counterPools[0].NumRows - counterPools[0].FreeRows.size());
+}
+
+int Memory::NumWideCounterRows() const
+{
+	return int(counterPools[1].NumRows - counterPools[1].FreeRows.size());
+}
+
+size_t Memory::CounterMemoryUsage() const
+{
+	size_t usage = 0;
+
+	for (const CounterPool& pool : counterPools)
+		usage += pool.Slabs.size() * COUNTER_SLAB_ROWS * pool.RowSize;
+
+	return usage;
+}
+
+bool Memory::Write(const Word& Addr, const Word& Data, int NProbe)
+{
+	WriteQueries(&Addr, &Data, 1, NProbe, &LastOPStats);
+
 	// TODO: return false when at capacity
-	writeCount++;
 	return true;
 }
 
-Word Memory::Read(const Word& Addr, bool& Conclusive)
+Word Memory::Read(const Word& Addr, bool& Conclusive, int NProbe)
 {
-	if (!initialized) 
-		throw exception("Memory has not been initialized");
+	ReadResult result;
+	ReadQueries(&Addr, 1, NProbe, &result);
 
-	int len = storage.size();
-	float sum = 0.0f;
-	float min = FLT_MAX;
-	int activated = 0;
+	LastOPStats = result.Stats;
+	Conclusive = result.Conclusive;
+	return result.Data;
+}
 
-	// TODO: impl iterative reading based on the SD of activated locations
+vector<RWStats> Memory::WriteBatch(const vector<Word>& Addrs, const vector<Word>& Data, int NProbe)
+{
+	if (Addrs.size() != Data.size())
+		throw exception("Every address in a batch needs a data word");
 
-	vector<COUNTER> counters(dataDims * (1 << rangeLen), 0);
+	vector<RWStats> stats(Addrs.size());
 
-	// Find each HL that's within the activation radius and accumulate its values to the counters array
-	for (int i = 0; i < len; i++)
+	if (!Addrs.empty())
 	{
-		float dist = Addr.DistanceTo(storage[i].Address());
-		
-		if (dist <= radius)
-		{
-			storage[i].Read(counters);
-			activated++;
-		}
+		WriteQueries(Addrs.data(), Data.data(), int(Addrs.size()), NProbe, stats.data());
+		LastOPStats = stats.back();
+	}
 
-		sum += dist;
+	return stats;
+}
+
+vector<ReadResult> Memory::ReadBatch(const vector<Word>& Addrs, int NProbe)
+{
+	vector<ReadResult> results(Addrs.size());
 
-		if (dist < min)
-			min = dist;
+	if (!Addrs.empty())
+	{
+		ReadQueries(Addrs.data(), int(Addrs.size()), NProbe, results.data());
+		LastOPStats = results.back().Stats;
 	}
 
-	LastOPStats.Activations = activated;
-	LastOPStats.AverageDistance = sum / len;
-	LastOPStats.MinimumDistance = min;
+	return results;
+}
+
+vector<uint32_t> Memory::FindActivated(const Word& Addr, int NProbe)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	if (Addr.NumDimensions() != addrDims)
+		throw exception("Incompatible word lengths");
+
+	vector<vector<uint32_t>> activated(numThreads);
+
+	Scan(&Addr, 1, NProbe, [&](int Query, int HLIndex, int Thread)
+	{
+		activated[Thread].push_back(HLIndex);
+	}, &LastOPStats);
+
+	vector<uint32_t> result;
+	for (const vector<uint32_t>& thread_activated : activated)
+		result.insert(result.end(), thread_activated.begin(), thread_activated.end());
 
-	return Word::FromCounters(counters, rangeLen, Conclusive);
+	sort(result.begin(), result.end());
+	return result;
 }
 
-void Memory::SaveToFile(const string& FilePath)
+void Memory::WriteQueries(const Word* Addrs, const Word* Data, int NumQueries, int NProbe, RWStats* Stats)
 {
-	ofstream fout(FilePath, ios_base::binary);
+	if (!initialized)
+		throw exception("Memory has not been initialized");
 
-	if (fout.fail())
+	for (int q = 0; q < NumQueries; q++)
 	{
-		throw exception("Could not open output file for writing");
+		if (Addrs[q].NumDimensions() != addrDims || Data[q].NumDimensions() != dataDims)
+			throw exception("Incompatible word lengths");
 	}
 
-	Serialize(fout);
-	float mbytes = float(fout.tellp()) / (1024 * 1024);
-	fout.close();
-	LOG_INFO("Saved memory to %s (size: %.2fMB)", FilePath.c_str(), mbytes);
+	// Activated hard locations are disjoint rows, so they can be written from any thread. Writes
+	// that allocate or promote a counter row are deferred to after the scan though. A hard location
+	// is only ever visited by one thread, so its deferred writes are still in query order. Writes
+	// can only make a row need promotion, so once one write is deferred the ones after it are too.
+	vector<vector<pair<int, int>>> deferred_writes(numThreads);
+
+	Scan(Addrs, NumQueries, NProbe, [&](int Query, int HLIndex, int Thread)
+	{
+		if (CanWriteConcurrently(HLIndex))
+			HardLocationAt(HLIndex).Write(Data[Query]);
+		else
+			deferred_writes[Thread].push_back(make_pair(HLIndex, Query));
+	}, Stats);
+
+	ApplyDeferredWrites(deferred_writes, Data);
+	writeCount += NumQueries;
 }
 
-Memory Memory::LoadFromFile(const string& FilePath)
+/**
+ Applies the writes WriteQueries deferred, given per scan thread as (hard location, query) pairs.
+ They're grouped by hard location, keeping the query order, and the hard locations that have no
+ counters yet are given a row one after the other in index order. The writes are then applied in
+ parallel, one hard location per thread at a time, up to the first one that has to promote its
+ row; those and the writes after them are applied on the calling thread at the end. Every hard
+ location sees its writes in query order, so the outcome doesn't depend on the thread count.
+*/
+void Memory::ApplyDeferredWrites(vector<vector<pair<int, int>>>& Writes, const Word* Data)
 {
-	ifstream fin(FilePath, ios_base::binary);
+	vector<pair<int, int>> writes;
+	for (vector<pair<int, int>>& thread_writes : Writes)
+	{
+		writes.insert(writes.end(), thread_writes.begin(), thread_writes.end());
+		thread_writes.clear();
+	}
 
-	if (fin.fail())
+	if (writes.empty())
+		return;
+
+	stable_sort(writes.begin(), writes.end(), [](const pair<int, int>& a, const pair<int, int>& b)
 	{
-		throw exception("Could not open input file for reading");
+		return a.first < b.first;
+	});
+
+	vector<int> runs;
+	for (int i = 0; i < int(writes.size()); i++)
+	{
+		if (i > 0 && writes[i].first == writes[i - 1].first)
+			continue;
+
+		runs.push_back(i);
+
+		if (!HasCounters(writes[i].first))
+			AllocateCounterRow(writes[i].first, false);
 	}
 
-	Memory mem(fin);
-	fin.close();
+	runs.push_back(int(writes.size()));
 
-	return mem;
+	// The per-thread lists collect the writes left for the calling thread
+	ParallelFor(pool.get(), 0, int(runs.size()) - 1, DEFERRED_WRITE_GRAIN, [&](int Begin, int End, int Thread)
+	{
+		for (int run = Begin; run < End; run++)
+		{
+			for (int i = runs[run]; i < runs[run + 1]; i++)
+			{
+				int hl_index = writes[i].first;
+
+				if (!CanWriteConcurrently(hl_index))
+				{
+					Writes[Thread].insert(Writes[Thread].end(), writes.begin() + i, writes.begin() + runs[run + 1]);
+					break;
+				}
+
+				HardLocationAt(hl_index).Write(Data[writes[i].second]);
+			}
+		}
+	});
+
+	for (const vector<pair<int, int>>& thread_writes : Writes)
+	{
+		for (const pair<int, int>& write : thread_writes)
+			HardLocationAt(write.first).Write(Data[write.second]);
+	}
 }
 
-void Memory::Serialize(ostream& stream)
+void Memory::BeginConcurrentWrites()
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	if (concurrentWrites)
+		return;
+
+	for (int i = 0; i < numHardLocations; i++)
+		(HardLocationAt(i).*ops->PrepareConcurrentWrites)();
+
+	concurrentWrites = true;
+}
+
+RWStats Memory::WriteConcurrent(const Word& Addr, const Word& Data, int NProbe)
+{
+	if (!concurrentWrites)
+		throw exception("Concurrent writes haven't begun");
+
+	if (Addr.NumDimensions() != addrDims || Data.NumDimensions() != dataDims)
+		throw exception("Incompatible word lengths");
+
+	RWStats stats;
+
+	(this->*ops->Scan)(&Addr, 1, NProbe, [&](int Query, int HLIndex, int Thread)
+	{
+		(HardLocationAt(HLIndex).*ops->WriteConcurrent)(Data);
+	}, &stats, nullptr);
+
+	AsAtomic(writeCount).fetch_add(1, memory_order_relaxed);
+	return stats;
+}
+
+void Memory::EndConcurrentWrites()
+{
+	if (!concurrentWrites)
+		return;
+
+	for (int i = 0; i < numHardLocations; i++)
+		(HardLocationAt(i).*ops->CompactCounters)();
+
+	concurrentWrites = false;
+}
+
+vector<uint32_t> Memory::ScanActivated(const Word& Addr, RWStats& Stats, int NProbe)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	if (Addr.NumDimensions() != addrDims)
+		throw exception("Incompatible word lengths");
+
+	// No pool; the scan runs on the calling thread
+	vector<uint32_t> activated;
+
+	(this->*ops->Scan)(&Addr, 1, NProbe, [&](int Query, int HLIndex, int Thread)
+	{
+		activated.push_back(HLIndex);
+	}, &Stats, nullptr);
+
+	return activated;
+}
+
+void Memory::WriteActivated(const vector<uint32_t>& Activated, const Word& Data)
 {
-	stream.write(FILE_PREFIX, FILE_PREFIX_LEN);
-	STREAM_WRITE_INT32(stream, addrDims);
-	STREAM_WRITE_INT32(stream, dataDims);
-	STREAM_WRITE_INT32(stream, rangeLen);
-	STREAM_WRITE_INT32(stream, radius);
-	STREAM_WRITE_INT32(stream, writeCount);
+	if (Data.NumDimensions() != dataDims)
+		throw exception("Incompatible word lengths");
+
+	for (uint32_t hl_index : Activated)
+		HardLocationAt(hl_index).Write(Data);
+
+	writeCount++;
+}
+
+void Memory::ReadQueries(const Word* Addrs, int NumQueries, int NProbe, ReadResult* Results)
+{
+	if (!initialized) 
+		throw exception("Memory has not been initialized");
 
-	int hl_count = storage.size();
-	STREAM_WRITE_INT32(stream, hl_count);
+	for (int q = 0; q < NumQueries; q++)
+	{
+		if (Addrs[q].NumDimensions() != addrDims)
+			throw exception("Incompatible word lengths");
+	}
+
+	// TODO: impl iterative reading based on the SD of activated locations
+
+	(this->*ops->ReadQueries)(Addrs, NumQueries, NProbe, Results);
+}
+
+/**
+ The scan and the accumulation of the activated counter rows are instantiated together so the
+ accumulation is inlined into the scan loops. Saturating counters of multi-bit words are never
+ negative, so each thread sums them with the saturating 16-bit AddCounters kernels and the thread
+ sums are combined at the end: saturating after every step gives the same result as clamping the
+ exact sum, in any order. Other counters go through HardLocation::ReadWith in index order.
+*/
+template <class Metric, class Counters>
+void Memory::ReadQueriesWith(const Word* Addrs, int NumQueries, int NProbe, ReadResult* Results)
+{
+	vector<RWStats> stats(NumQueries);
 
-	int hl_idx = 0;
-	for (HardLocation& hl : storage)
+	if (Counters::Mode == CounterMode::Saturating && rangeLen > 1)
 	{
-		hl.Serialize(stream);
+		// Thread sums are padded to whole cache lines so threads never write to the same line
+		size_t query_len = counterStride;
+		size_t thread_len = (query_len * NumQueries + 31) / 32 * 32;
+		vector<uint16_t> sums(thread_len * numThreads, 0);
+		vector<int32_t> totals(counterStride, 0);
+		const DistanceKernels& kernels = GetDistanceKernels();
 
-		if (++hl_idx % (storage.size() / 10) == 0)
+		ScanWith<Metric>(Addrs, NumQueries, NProbe, [&](int Query, int HLIndex, int Thread)
 		{
-			float progress = (float(hl_idx) / storage.size()) * 100;
-			LOG_INFO("Save progress: %.0f%%", progress);
+			uint16_t* query_sums = &sums[Thread * thread_len + Query * query_len];
+
+			if (HasWideCounters(HLIndex))
+				kernels.AddCounters(CounterRow<uint16_t>(HLIndex), query_sums, counterStride);
+			else if (HasCounters(HLIndex))
+				kernels.AddNarrowCounters(CounterRow<uint8_t>(HLIndex), query_sums, counterStride);
+		}, stats.data(), pool.get());
+
+		for (int q = 0; q < NumQueries; q++)
+		{
+			for (int i = 0; i < counterStride; i++)
+			{
+				int32_t sum = 0;
+
+				for (int t = 0; t < numThreads; t++)
+					sum += sums[t * thread_len + q * query_len + i];
+
+				totals[i] = MIN(sum, int32_t(UINT16_MAX));
+			}
+
+			Results[q].Stats = stats[q];
+			Results[q].Data = Word::FromCounters(totals, rangeLen, Results[q].Conclusive);
 		}
+
+		return;
 	}
+
+	// Sums saturate after every hard location, which makes them depend on the order the hard
+	// locations are added in. Each thread collects the ones it activates and every query adds them
+	// up in index order afterwards, as a single thread scanning them in order would.
+	vector<vector<uint32_t>> activated(size_t(numThreads) * NumQueries);
+
+	ScanWith<Metric>(Addrs, NumQueries, NProbe, [&](int Query, int HLIndex, int Thread)
+	{
+		activated[size_t(Thread) * NumQueries + Query].push_back(uint32_t(HLIndex));
+	}, stats.data(), pool.get());
+
+	auto read_query = [&](int Query, int Thread)
+	{
+		vector<uint32_t> hl_indices;
+		for (int t = 0; t < numThreads; t++)
+		{
+			const vector<uint32_t>& thread_activated = activated[size_t(t) * NumQueries + Query];
+			hl_indices.insert(hl_indices.end(), thread_activated.begin(), thread_activated.end());
+		}
+
+		sort(hl_indices.begin(), hl_indices.end());
+
+		vector<int32_t> query_sums(counterStride, 0);
+		for (uint32_t hl_index : hl_indices)
+			HardLocation(*this, hl_index).ReadWith<Counters>(query_sums.data());
+
+		Results[Query].Stats = stats[Query];
+		Results[Query].Data = Word::FromCounters(query_sums, rangeLen, Results[Query].Conclusive);
+	};
+
+	// Ties of 1-bit words are broken with Word::RandomBit, which has to be drawn from in query order
+	RunTasks(rangeLen == 1 ? nullptr : pool.get(), NumQueries, read_query);
 }
 
-Memory::Memory(istream& stream)
+void Memory::SetNumThreads(int NumThreads, bool PinThreads)
 {
-	char buffer[FILE_PREFIX_LEN];
+	if (NumThreads <= 0)
+		NumThreads = ThreadPool::HardwareThreads();
+
+	if (NumThreads == numThreads && PinThreads == pinThreads)
+		return;
+
+	numThreads = NumThreads;
+	pinThreads = PinThreads;
+	pool = numThreads > 1 ? make_shared<ThreadPool>(numThreads, pinThreads) : nullptr;
+}
+
+/**
+ Calls OnActivated for every query and hard location within the query's access radius. The hard
+ locations are split into blocks of SCAN_BLOCK_SIZE which are handed out to the thread pool. Each
+ block is compared against QUERY_TILE_SIZE queries at a time so its addresses are reused while
+ they're still in cache. A hard location always sees the queries in batch order, and the
+ per-block stats are combined in block order, so the results are identical to scanning the
+ queries one by one on a single thread.
 
-	stream.read(buffer, FILE_PREFIX_LEN);
+ Registered segments that are provably out of a query's reach are skipped for that query. With
+ NProbe > 0 the approximate IVF lists are searched instead.
+*/
+void Memory::Scan(const Word* Addrs, int NumQueries, int NProbe, const ActivatedFunc& OnActivated, RWStats* Stats)
+{
+	(this->*ops->Scan)(Addrs, NumQueries, NProbe, OnActivated, Stats, pool.get());
+}
 
-	if (strncmp(buffer, FILE_PREFIX, FILE_PREFIX_LEN) != 0)
+template <class Metric, class Callback>
+void Memory::ScanWith(const Word* Addrs, int NumQueries, int NProbe, const Callback& OnActivated, RWStats* Stats, ThreadPool* Pool)
+{
+	if (NProbe > 0)
 	{
-		throw exception("Invalid file; prefix not found.");
+		if (!ivf)
+			throw exception("Approximate reads and writes need an IVF index");
+
+		ListScan(Addrs, NumQueries, [&](const Word& Query, vector<uint32_t>& Out)
+		{
+			return ivf->Search(Query, radius, NProbe, Out);
+		}, OnActivated, Stats, Pool);
+		return;
 	}
 
-	STREAM_READ_INT32(stream, addrDims)
-	STREAM_READ_INT32(stream, dataDims)
-	STREAM_READ_INT32(stream, rangeLen)
-	STREAM_READ_INT32(stream, radius)
-	STREAM_READ_INT32(stream, writeCount)
+	if (lsh && lshEnabled && !exactStats)
+	{
+		ListScan(Addrs, NumQueries, [&](const Word& Query, vector<uint32_t>& Out)
+		{
+			return lsh->Search(Query, radius, Metric::Kind, lshProbes, addrs.Ptr(), addrStride, Out);
+		}, OnActivated, Stats, Pool);
+		return;
+	}
 
-	int hl_count;
-	STREAM_READ_INT32(stream, hl_count)
+	if (index && !exactStats)
+	{
+		ListScan(Addrs, NumQueries, [&](const Word& Query, vector<uint32_t>& Out)
+		{
+			return index->Search(Query, radius, Out);
+		}, OnActivated, Stats, Pool);
+		return;
+	}
 
-	for (int idx = 0; idx < hl_count; idx++)
+	struct BlockStats
 	{
-		storage.push_back(HardLocation(stream));
+		int Activations;
+		int Evaluations;
+		double DistSum;
+		float DistMin;
+	};
 
-		if (idx % (hl_count / 10) == 0)
+	uint32_t radius_sq = Metric::SquaredRadius(radius, rangeLen);
+	int num_blocks = (numHardLocations + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE;
+	vector<BlockStats> blocks(size_t(num_blocks) * NumQueries);
+
+	// pruned[s * NumQueries + q] is set when segment s can't contain any hard location within the
+	// radius of query q. Exact stats need every distance so nothing is pruned then.
+	int num_segments = exactStats ? 0 : int(segments.size());
+	vector<uint8_t> pruned(size_t(num_segments) * NumQueries, 0);
+	vector<int> centroid_evaluations(NumQueries, num_segments);
+	float reach = float(radius) + SEGMENT_PRUNE_SLACK;
+
+	for (int seg = 0; seg < num_segments; seg++)
+	{
+		for (int q = 0; q < NumQueries; q++)
 		{
-			float progress = (float(idx) / hl_count) * 100;
-			LOG_INFO("Load progress: %.0f%%", progress);
+			float dist = Addrs[q].DistanceTo(segments[seg].Centroid, Metric::Kind);
+			pruned[size_t(seg) * NumQueries + q] = (dist - segments[seg].Radius) > reach;
+		}
+	}
+
+	vector<BitSlicedAddresses::Query> sliced_queries;
+	if (sliced)
+	{
+		for (int q = 0; q < NumQueries; q++)
+			sliced_queries.push_back(sliced->Prepare(Addrs[q]));
+	}
+
+	// Measures whole groups of hard locations at a time but visits them in the same order as below
+	auto scan_sliced_range = [&](int Begin, int End, int Tile, int TileEnd, const uint8_t* Pruned, BlockStats* RangeStats, int Thread)
+	{
+		uint32_t dists[QUERY_TILE_SIZE][BITSLICE_GROUP_SIZE];
+
+		for (int group = Begin / BITSLICE_GROUP_SIZE; group * BITSLICE_GROUP_SIZE < End; group++)
+		{
+			int group_begin = group * BITSLICE_GROUP_SIZE;
+
+			for (int q = Tile; q < TileEnd; q++)
+			{
+				if (!(Pruned && Pruned[q]))
+					sliced->GroupDistances(sliced_queries[q], group, dists[q - Tile]);
+			}
+
+			int end = MIN(End, group_begin + BITSLICE_GROUP_SIZE);
+			for (int i = MAX(Begin, group_begin); i < end; i++)
+			{
+				for (int q = Tile; q < TileEnd; q++)
+				{
+					if (Pruned && Pruned[q])
+						continue;
+
+					BlockStats& stats = RangeStats[q];
+					stats.Evaluations++;
+
+					if (IsActivated<Metric>(dists[q - Tile][i - group_begin], radius_sq, stats.DistSum, stats.DistMin))
+					{
+						OnActivated(q, i, Thread);
+						stats.Activations++;
+					}
+				}
+			}
+		}
+	};
+
+	// Hamming distances come from the block kernels, one query against the whole range at a time.
+	// Ranges never span blocks so they fit the buffer.
+	const DistanceKernels& kernels = GetDistanceKernels();
+	vector<vector<uint32_t>> hamming_dists(rangeLen == 1 ? numThreads : 0, vector<uint32_t>(size_t(QUERY_TILE_SIZE) * SCAN_BLOCK_SIZE));
+
+	auto scan_hamming_range = [&](int Begin, int End, int Tile, int TileEnd, const uint8_t* Pruned, BlockStats* RangeStats, int Thread)
+	{
+		vector<uint32_t>& dists = hamming_dists[Thread];
+
+		for (int q = Tile; q < TileEnd; q++)
+		{
+			if (!(Pruned && Pruned[q]))
+				kernels.HammingBlock(Addrs[q].Data(), AddressRow(Begin), addrStride, End - Begin, Addrs[q].NumSubwords(), Addrs[q].LastSubwordMask(), &dists[size_t(q - Tile) * SCAN_BLOCK_SIZE]);
+		}
+
+		for (int i = Begin; i < End; i++)
+		{
+			for (int q = Tile; q < TileEnd; q++)
+			{
+				if (Pruned && Pruned[q])
+					continue;
+
+				BlockStats& stats = RangeStats[q];
+				stats.Evaluations++;
+
+				if (IsActivated<Metric>(dists[size_t(q - Tile) * SCAN_BLOCK_SIZE + i - Begin], radius_sq, stats.DistSum, stats.DistMin))
+				{
+					OnActivated(q, i, Thread);
+					stats.Activations++;
+				}
+			}
+		}
+	};
+
+	// Dot products do less work per byte than the distance kernels and need no early exit to keep up
+	vector<uint32_t> query_norms;
+	if (Metric::Kind == DistanceMetric::Euclidean && !addrNorms.empty())
+	{
+		for (int q = 0; q < NumQueries; q++)
+			query_norms.push_back(kernels.NibbleDot(Addrs[q].Data(), Addrs[q].Data(), addrSubwords));
+	}
+
+	auto scan_range = [&](int Begin, int End, const uint8_t* Pruned, BlockStats* RangeStats, int Thread)
+	{
+		for (int tile = 0; tile < NumQueries; tile += QUERY_TILE_SIZE)
+		{
+			int tile_end = MIN(NumQueries, tile + QUERY_TILE_SIZE);
+
+			if (Pruned && all_of(Pruned + tile, Pruned + tile_end, [](uint8_t p) { return p != 0; }))
+				continue;
+
+			if (sliced)
+			{
+				scan_sliced_range(Begin, End, tile, tile_end, Pruned, RangeStats, Thread);
+				continue;
+			}
+
+			if (rangeLen == 1)
+			{
+				scan_hamming_range(Begin, End, tile, tile_end, Pruned, RangeStats, Thread);
+				continue;
+			}
+
+			for (int i = Begin; i < End; i++)
+			{
+				const SUBWORD* hl_addr = AddressRow(i);
+
+				for (int q = tile; q < tile_end; q++)
+				{
+					if (Pruned && Pruned[q])
+						continue;
+
+					BlockStats& stats = RangeStats[q];
+					stats.Evaluations++;
+
+					bool activated;
+					if (query_norms.empty())
+					{
+						activated = IsActivated<Metric>(Addrs[q], hl_addr, radius_sq, stats.DistSum, stats.DistMin);
+					}
+					else
+					{
+						uint32_t dist_sq = query_norms[q] + addrNorms[i] - 2 * kernels.NibbleDot(Addrs[q].Data(), hl_addr, addrSubwords);
+						activated = IsActivated<Metric>(dist_sq, radius_sq, stats.DistSum, stats.DistMin);
+					}
+
+					if (activated)
+					{
+						OnActivated(q, i, Thread);
+						stats.Activations++;
+					}
+				}
+			}
+		}
+	};
+
+	auto scan_block = [&](int Block, int Thread)
+	{
+		BlockStats* block_stats = &blocks[size_t(Block) * NumQueries];
+
+		for (int q = 0; q < NumQueries; q++)
+		{
+			block_stats[q].Activations = 0;
+			block_stats[q].Evaluations = 0;
+			block_stats[q].DistSum = 0.0;
+			block_stats[q].DistMin = FLT_MAX;
+		}
+
+		int begin = Block * SCAN_BLOCK_SIZE;
+		int end = MIN(numHardLocations, begin + SCAN_BLOCK_SIZE);
+
+		// Split the block at segment boundaries; segments are sorted and don't overlap
+		for (int seg = 0; seg < num_segments && begin < end; seg++)
+		{
+			const Segment& segment = segments[seg];
+
+			if (segment.End <= begin)
+				continue;
+
+			if (segment.Begin >= end)
+				break;
+
+			if (segment.Begin > begin)
+			{
+				scan_range(begin, segment.Begin, nullptr, block_stats, Thread);
+				begin = segment.Begin;
+			}
+
+			int range_end = MIN(end, segment.End);
+			scan_range(begin, range_end, &pruned[size_t(seg) * NumQueries], block_stats, Thread);
+			begin = range_end;
+		}
+
+		if (begin < end)
+			scan_range(begin, end, nullptr, block_stats, Thread);
+	};
+
+	RunTasks(Pool, num_blocks, scan_block);
+
+	for (int q = 0; q < NumQueries; q++)
+	{
+		int activated = 0;
+		int evaluations = centroid_evaluations[q];
+		double sum = 0.0;
+		float min = FLT_MAX;
+
+		for (int block = 0; block < num_blocks; block++)
+		{
+			const BlockStats& stats = blocks[size_t(block) * NumQueries + q];
+			activated += stats.Activations;
+			evaluations += stats.Evaluations;
+			sum += stats.DistSum;
+			min = MIN(min, stats.DistMin);
 		}
+
+		Stats[q] = MakeStats(activated, sum, min, evaluations);
 	}
+}
+
+/**
+ Same as Scan but looks the activated hard locations up in an index with Search, which returns the
+ number of distance evaluations. The searches run in parallel, then the activations are applied
+ on the calling thread in query order. Distances aren't measured so there are no distance stats.
+*/
+template <class Callback>
+void Memory::ListScan(const Word* Addrs, int NumQueries, const function<int(const Word& Query, vector<uint32_t>& Out)>& Search, const Callback& OnActivated, RWStats* Stats, ThreadPool* Pool)
+{
+	vector<vector<uint32_t>> activated(NumQueries);
+	vector<int> evaluations(NumQueries);
+
+	auto search = [&](int Query, int Thread)
+	{
+		evaluations[Query] = Search(Addrs[Query], activated[Query]);
+
+		// Visit the counter rows in memory order rather than index order
+		sort(activated[Query].begin(), activated[Query].end());
+	};
+
+	RunTasks(Pool, NumQueries, search);
+
+	for (int q = 0; q < NumQueries; q++)
+	{
+		for (uint32_t hl_index : activated[q])
+			OnActivated(q, hl_index, 0);
+
+		Stats[q].Activations = int(activated[q].size());
+		Stats[q].AverageDistance = NAN;
+		Stats[q].MinimumDistance = NAN;
+		Stats[q].DistanceEvaluations = evaluations[q];
+	}
+}
+
+/**
+ Registers the hard locations in [Begin, End) as a segment. Its centroid is the rounded mean of
+ every address integer in the segment and its radius is the distance to the farthest address, so
+ any query further than Radius + radius from the centroid can't activate anything in the segment.
+*/
+void Memory::AddSegment(int Begin, int End)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	if (Begin < 0 || End > numHardLocations || Begin >= End)
+		throw exception("Invalid hard location segment");
+
+	for (const Segment& other : segments)
+	{
+		if (Begin < other.End && other.Begin < End)
+			throw exception("Hard location segments can't overlap");
+	}
+
+	CentroidAccumulator accumulator(addrSubwords, rangeLen);
+	for (int i = Begin; i < End; i++)
+		accumulator.Add(AddressRow(i));
+
+	vector<SUBWORD> centroid(addrSubwords);
+	accumulator.Mean(centroid.data());
+
+	Segment segment;
+	segment.Begin = Begin;
+	segment.End = End;
+	segment.Centroid = Word::FromSubwords(addrDims, rangeLen, centroid.data());
+
+	uint32_t max_dist_sq = 0;
+	for (int i = Begin; i < End; i++)
+		max_dist_sq = MAX(max_dist_sq, segment.Centroid.SquaredDistanceTo(AddressRow(i), policy.Metric));
+
+	segment.Radius = Word::DistanceFromSquared(max_dist_sq, rangeLen, policy.Metric);
+
+	auto pos = find_if(segments.begin(), segments.end(), [End](const Segment& other) { return other.Begin >= End; });
+	segments.insert(pos, segment);
+
+	LOG_INFO("Added segment [%d, %d) with radius %.2f", Begin, End, segment.Radius);
+}
+
+void Memory::SetAddressRow(int Index, const SUBWORD* Addr)
+{
+	// The hash tables and the bit-sliced copy are updated in place; the other indexes have to be rebuilt
+	if (lsh)
+	{
+		// Copies of this memory share them until one of the copies changes
+		if (lsh.use_count() > 1)
+			lsh = make_shared<LSHIndex>(*lsh);
+
+		lsh->Update(Index, AddressRow(Index), Addr);
+	}
+
+	if (sliced)
+	{
+		if (sliced.use_count() > 1)
+			sliced = make_shared<BitSlicedAddresses>(*sliced);
+
+		sliced->Set(Index, Addr);
+	}
+
+	memcpy(AddressRow(Index), Addr, sizeof(SUBWORD) * addrSubwords);
+	AddressRowChanged(Index);
+}
+
+// Called once a row of the address matrix has been overwritten in place. Unlike SetAddressRow it
+// leaves the LSH tables and the bit-sliced copy alone, so it's only for memories without them.
+void Memory::AddressRowChanged(int Index)
+{
+	if (!addrNorms.empty())
+	{
+		const SUBWORD* addr = AddressRow(Index);
+		addrNorms[Index] = GetDistanceKernels().NibbleDot(addr, addr, addrSubwords);
+	}
+
+	AddressesChanged();
+}
+
+void Memory::AddressesChanged()
+{
+	index = nullptr;
+	ivf = nullptr;
+	segments.clear();
+}
+
+void Memory::SetAddressLayout(AddressLayout Layout)
+{
+	if (Layout == AddressLayout::RowMajor)
+	{
+		sliced = nullptr;
+		return;
+	}
+
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	if (sliced)
+		return;
+
+	LOG_INFO("Transposing %d hard location addresses into bit planes", numHardLocations);
+
+	auto planes = make_shared<BitSlicedAddresses>();
+	planes->Build(addrs.Ptr(), addrStride, numHardLocations, addrDims, rangeLen, policy.Metric, pool.get());
+	sliced = planes;
+}
+
+void Memory::BuildIndex()
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	LOG_INFO("Building VP-tree index over %d hard locations", numHardLocations);
+
+	auto tree = make_shared<VPTree>();
+	tree->Build(addrs.Ptr(), addrStride, numHardLocations, addrDims, rangeLen, policy.Metric);
+	index = tree;
+
+	LOG_INFO("Finished building index");
+}
+
+void Memory::BuildIVF(int NumLists, int Iterations)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	LOG_INFO("Clustering %d hard locations into %d IVF lists", numHardLocations, NumLists);
+
+	auto lists = make_shared<IVFIndex>();
+	lists->Build(addrs.Ptr(), addrStride, numHardLocations, addrDims, rangeLen, policy.Metric, NumLists, Iterations, pool.get());
+	ivf = lists;
+
+	LOG_INFO("Finished building IVF lists");
+}
+
+void Memory::BuildLSH(int NumTables, int HashesPerTable, float BucketWidth)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	if (BucketWidth <= 0)
+		BucketWidth = LSH_DEFAULT_WIDTH_SCALE * radius;
+
+	LOG_INFO("Hashing %d hard locations into %d LSH tables (%d hashes per table, bucket width %.1f)", numHardLocations, NumTables, HashesPerTable, BucketWidth);
+
+	auto tables = make_shared<LSHIndex>();
+	tables->Build(addrs.Ptr(), addrStride, numHardLocations, addrDims, rangeLen, policy.Metric, NumTables, HashesPerTable, BucketWidth, pool.get());
+	lsh = tables;
+
+	LOG_INFO("Finished building LSH tables");
+}
+
+void Memory::SaveLSH(const string& FilePath)
+{
+	if (!lsh)
+		throw exception("Memory has no LSH tables to save");
+
+	ofstream fout(FilePath, ios_base::binary);
+
+	if (fout.fail())
+	{
+		throw exception("Could not open output file for writing");
+	}
+
+	lsh->Serialize(fout);
+	float mbytes = float(fout.tellp()) / (1024 * 1024);
+	fout.close();
+	LOG_INFO("Saved LSH tables to %s (size: %.2fMB)", FilePath.c_str(), mbytes);
+}
+
+void Memory::LoadLSH(const string& FilePath)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	ifstream fin(FilePath, ios_base::binary);
+
+	if (fin.fail())
+	{
+		throw exception("Could not open input file for reading");
+	}
+
+	auto tables = make_shared<LSHIndex>(fin);
+	fin.close();
+
+	if (!tables->Matches(addrs.Ptr(), addrStride, numHardLocations, addrDims, rangeLen))
+		throw exception("LSH tables were built over different hard locations");
+
+	lsh = tables;
+	LOG_INFO("Loaded %d LSH tables from %s", lsh->NumTables(), FilePath.c_str());
+}
+
+template <class Metric>
+bool Memory::IsActivated(const Word& Addr, const SUBWORD* HLAddr, uint32_t RadiusSquared, double& DistSum, float& DistMin) const
+{
+	if (!exactStats)
+		return Addr.WithinRadius<Metric>(HLAddr, RadiusSquared);
+
+	return IsActivated<Metric>(Addr.SquaredDistanceTo<Metric>(HLAddr), RadiusSquared, DistSum, DistMin);
+}
+
+template <class Metric>
+bool Memory::IsActivated(uint32_t DistSquared, uint32_t RadiusSquared, double& DistSum, float& DistMin) const
+{
+	if (exactStats)
+	{
+		float dist = Metric::FromSquared(DistSquared, rangeLen);
+
+		DistSum += dist;
+
+		if (dist < DistMin)
+			DistMin = dist;
+	}
+
+	return DistSquared <= RadiusSquared;
+}
+
+RWStats Memory::MakeStats(int Activations, double DistSum, float DistMin, int Evaluations) const
+{
+	RWStats stats;
+	stats.Activations = Activations;
+	stats.DistanceEvaluations = Evaluations;
+
+	if (exactStats)
+	{
+		stats.AverageDistance = float(DistSum / numHardLocations);
+		stats.MinimumDistance = DistMin;
+	}
+	else
+	{
+		stats.AverageDistance = NAN;
+		stats.MinimumDistance = NAN;
+	}
+
+	return stats;
+}
+
+// Sections of a mapped memory file, in file order
+enum MappedSection
+{
+	MAPPED_ADDRESSES,
+	MAPPED_NARROW_COUNTERS,
+	MAPPED_WIDE_COUNTERS,
+	MAPPED_NARROW_FREE_ROWS,
+	MAPPED_WIDE_FREE_ROWS,
+	MAPPED_COUNTER_ROWS,
+	MAPPED_COUNTER_PEAKS,
+	MAPPED_WRITE_COUNTS,
+	MAPPED_ADDRESS_NORMS,
+	MAPPED_HISTORY_COUNTS,
+	MAPPED_HISTORY_RING,
+	MAPPED_HISTORY_WRITES,
+	NUM_MAPPED_SECTIONS
+};
+
+struct MappedFileHeader
+{
+	char Prefix[16];				// MAPPED_FILE_PREFIX, zero padded
+	uint32_t Version;
+	int32_t AddrDims;
+	int32_t DataDims;
+	int32_t RangeBits;
+	int32_t Radius;
+	int32_t WriteCount;
+	int32_t NumHardLocations;
+	int32_t AddrStride;				// Subwords per address row
+	int32_t CounterStride;			// Counters per counter row
+	int32_t Metric;
+	int32_t Counters;
+	int32_t History;
+	uint32_t CounterSizes[2];		// Bytes per counter of the narrow and the wide pool
+	uint32_t PoolRows[2];
+	uint32_t PoolFreeRows[2];
+	uint64_t SectionOffsets[NUM_MAPPED_SECTIONS];
+	uint64_t SectionSizes[NUM_MAPPED_SECTIONS];
+};
+
+template <class T>
+static void AssignSection(vector<T>& Out, const uint8_t* Section, size_t Count)
+{
+	const T* items = reinterpret_cast<const T*>(Section);
+	Out.assign(items, items + Count);
+}
+
+struct CompressedFileHeader
+{
+	char Prefix[16];				// COMPRESSED_FILE_PREFIX, zero padded
+	uint32_t Version;
+	int32_t AddrDims;
+	int32_t DataDims;
+	int32_t RangeBits;
+	int32_t Radius;
+	int32_t WriteCount;
+	int32_t NumHardLocations;
+	int32_t Metric;
+	int32_t Counters;
+	int32_t History;
+	int32_t ChunkSize;				// Hard locations per chunk; the chunk sizes in bytes follow the header
+	int32_t NumChunks;
+};
+
+/**
+ The mapped, compressed and sparse files record the policy the memory was saved with, which takes over
+ from the one the caller expected
+*/
+static MemoryPolicy FilePolicy(const string& FilePath, int32_t Metric, int32_t Counters, int32_t History, const MemoryPolicy& Policy)
+{
+	if (Metric < 0 || Metric >= NUM_DISTANCE_METRICS ||
+		Counters < 0 || Counters >= NUM_COUNTER_MODES ||
+		History < 0 || History >= NUM_WRITE_HISTORY_MODES)
+	{
+		throw exception("Invalid memory file policy");
+	}
+
+	MemoryPolicy file_policy = MemoryPolicy(DistanceMetric(Metric), CounterMode(Counters), WriteHistoryMode(History));
+
+	if (file_policy.Metric != Policy.Metric || file_policy.Counters != Policy.Counters || file_policy.History != Policy.History)
+	{
+		LOG_WARN("%s was saved with the %s metric, %s counters and %s write history; using those",
+			FilePath.c_str(),
+			DistanceMetricName(file_policy.Metric),
+			CounterModeName(file_policy.Counters),
+			WriteHistoryModeName(file_policy.History));
+	}
+
+	return file_policy;
+}
+
+// Loading happens before the memory has any threads, so chunks are coded on a pool of their own
+static unique_ptr<ThreadPool> CreateChunkPool(int NumChunks)
+{
+	int num_threads = MIN(NumChunks, ThreadPool::HardwareThreads());
+	return num_threads > 1 ? make_unique<ThreadPool>(num_threads) : nullptr;
+}
+
+void Memory::SaveToFile(const string& FilePath, MemoryFileFormat Format)
+{
+	namespace fs = std::filesystem;
+
+	// Writing to the file the memory is mapped from would pull it out from under the mapping
+	if (mappedFile && fs::exists(FilePath) && fs::equivalent(FilePath, mappedFile->Path()))
+		DetachFromFile();
+
+	if (fs::path(FilePath).extension() == COMPRESSED_FILE_EXTENSION)
+		Format = MemoryFileFormat::Compressed;
+
+	ofstream fout(FilePath, ios_base::binary);
+
+	if (fout.fail())
+	{
+		throw exception("Could not open output file for writing");
+	}
+
+	if (Format == MemoryFileFormat::Mapped)
+		SerializeMapped(fout);
+	else if (Format == MemoryFileFormat::Compressed)
+		SerializeCompressed(fout);
+	else
+		Serialize(fout);
+	float mbytes = float(fout.tellp()) / (1024 * 1024);
+	fout.close();
+	LOG_INFO("Saved memory to %s (format: %s, size: %.2fMB)", FilePath.c_str(), MemoryFileFormatName(Format), mbytes);
+}
+
+Memory Memory::LoadFromFile(const string& FilePath, const MemoryPolicy& Policy)
+{
+	ifstream fin(FilePath, ios_base::binary);
+
+	if (fin.fail())
+	{
+		throw exception("Could not open input file for reading");
+	}
+
+	char buffer[FILE_PREFIX_LEN];
+	fin.read(buffer, FILE_PREFIX_LEN);
+
+	if (fin.gcount() == FILE_PREFIX_LEN && strncmp(buffer, MAPPED_FILE_PREFIX, FILE_PREFIX_LEN) == 0)
+	{
+		fin.close();
+		return MapFile(FilePath, Policy);
+	}
+
+	fin.clear();
+	fin.seekg(0);
+
+	if (strncmp(buffer, COMPRESSED_FILE_PREFIX, FILE_PREFIX_LEN) == 0)
+		return LoadCompressed(fin, FilePath, Policy);
+
+	Memory mem(fin, Policy);
+	fin.close();
+
+	return mem;
+}
+
+/**
+ Memories are saved in the sparse format, so only the hard locations that have been written take
+ up space for their counters. The records are put together in a buffer that goes to the stream
+ STREAM_BUFFER_SIZE bytes at a time.
+*/
+void Memory::Serialize(ostream& stream)
+{
+	BufferedStreamWriter writer(stream);
+
+	writer.Write(SPARSE_POLICY_FILE_PREFIX, FILE_PREFIX_LEN);
+	writer.Put(int32_t(policy.Metric));
+	writer.Put(int32_t(policy.Counters));
+	writer.Put(int32_t(policy.History));
+	writer.Put(int32_t(addrDims));
+	writer.Put(int32_t(dataDims));
+	writer.Put(int32_t(rangeLen));
+	writer.Put(int32_t(radius));
+	writer.Put(int32_t(writeCount));
+
+	int hl_count = numHardLocations;
+	writer.Put(int32_t(hl_count));
+
+	for (int hl_idx = 0; hl_idx < hl_count;)
+	{
+		HardLocationAt(hl_idx).SerializeRecord(writer, true);
+
+		if (++hl_idx % (hl_count / 10) == 0)
+		{
+			float progress = (float(hl_idx) / hl_count) * 100;
+			LOG_INFO("Save progress: %.0f%%", progress);
+		}
+	}
+
+	writer.Flush();
+}
+
+/**
+ Every section starts on a MAPPED_FILE_ALIGNMENT boundary. The counter sections hold whole slabs,
+ unused rows included, so a mapped slab can take new rows like any other.
+*/
+void Memory::SerializeMapped(ostream& stream)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	MappedFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.Prefix, MAPPED_FILE_PREFIX, FILE_PREFIX_LEN);
+	header.Version = MAPPED_FILE_VERSION;
+	header.AddrDims = addrDims;
+	header.DataDims = dataDims;
+	header.RangeBits = rangeLen;
+	header.Radius = radius;
+	header.WriteCount = writeCount;
+	header.NumHardLocations = numHardLocations;
+	header.AddrStride = addrStride;
+	header.CounterStride = counterStride;
+	header.Metric = int32_t(policy.Metric);
+	header.Counters = int32_t(policy.Counters);
+	header.History = int32_t(policy.History);
+	header.CounterSizes[0] = uint32_t(ops->NarrowCounterSize);
+	header.CounterSizes[1] = uint32_t(ops->CounterSize);
+
+	// The pieces each section is written from
+	vector<pair<const void*, size_t>> sections[NUM_MAPPED_SECTIONS];
+	sections[MAPPED_ADDRESSES].push_back(make_pair(addrs.Ptr(), addrs.Size()));
+
+	for (int p = 0; p < 2; p++)
+	{
+		const CounterPool& pool = counterPools[p];
+		header.PoolRows[p] = pool.NumRows;
+		header.PoolFreeRows[p] = uint32_t(pool.FreeRows.size());
+
+		for (const AlignedBuffer<uint8_t>& slab : pool.Slabs)
+			sections[MAPPED_NARROW_COUNTERS + p].push_back(make_pair(slab.Ptr(), slab.Size()));
+
+		sections[MAPPED_NARROW_FREE_ROWS + p].push_back(make_pair(pool.FreeRows.data(), pool.FreeRows.size() * sizeof(uint32_t)));
+	}
+
+	sections[MAPPED_COUNTER_ROWS].push_back(make_pair(counterRows.data(), counterRows.size() * sizeof(uint32_t)));
+	sections[MAPPED_COUNTER_PEAKS].push_back(make_pair(counterPeaks.data(), counterPeaks.size()));
+	sections[MAPPED_WRITE_COUNTS].push_back(make_pair(writeCounts.data(), writeCounts.size() * sizeof(uint32_t)));
+	sections[MAPPED_ADDRESS_NORMS].push_back(make_pair(addrNorms.data(), addrNorms.size() * sizeof(uint32_t)));
+	sections[MAPPED_HISTORY_COUNTS].push_back(make_pair(historyCounts.data(), historyCounts.size() * sizeof(uint16_t)));
+	sections[MAPPED_HISTORY_RING].push_back(make_pair(historyRing.data(), historyRing.size()));
+	sections[MAPPED_HISTORY_WRITES].push_back(make_pair(historyWrites.data(), historyWrites.size() * sizeof(uint32_t)));
+
+	uint64_t offset = sizeof(header);
+
+	for (int section = 0; section < NUM_MAPPED_SECTIONS; section++)
+	{
+		offset = (offset + MAPPED_FILE_ALIGNMENT - 1) / MAPPED_FILE_ALIGNMENT * MAPPED_FILE_ALIGNMENT;
+		header.SectionOffsets[section] = offset;
+
+		for (const pair<const void*, size_t>& piece : sections[section])
+			header.SectionSizes[section] += piece.second;
+
+		offset += header.SectionSizes[section];
+	}
+
+	static const char padding[MAPPED_FILE_ALIGNMENT] = {};
+	uint64_t written = sizeof(header);
+	stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	for (int section = 0; section < NUM_MAPPED_SECTIONS; section++)
+	{
+		stream.write(padding, header.SectionOffsets[section] - written);
+		written = header.SectionOffsets[section];
+
+		for (const pair<const void*, size_t>& piece : sections[section])
+			stream.write(static_cast<const char*>(piece.first), piece.second);
+
+		written += header.SectionSizes[section];
+	}
+
+	if (stream.fail())
+		throw exception("Could not write the memory file");
+}
+
+/**
+ The addresses and counter slabs are views of the mapping, which the memory keeps alive. The file
+ is mapped copy-on-write, so writes to the memory never reach it.
+*/
+/*static*/
+Memory Memory::MapFile(const string& FilePath, const MemoryPolicy& Policy)
+{
+	shared_ptr<MappedFile> file = make_shared<MappedFile>(FilePath);
+	MappedFileHeader header;
+
+	if (file->Size() < sizeof(header))
+		throw exception("Memory file is truncated");
+
+	memcpy(&header, file->Data(), sizeof(header));
+
+	if (header.Version != MAPPED_FILE_VERSION)
+		throw exception("Unsupported memory file version");
+
+	if (header.AddrDims <= 0 || header.DataDims <= 0 || header.RangeBits <= 0 || header.RangeBits > SUBWORD_NUM_BITS || header.NumHardLocations <= 0)
+		throw exception("Invalid memory file dimensions");
+
+	MemoryPolicy file_policy = FilePolicy(FilePath, header.Metric, header.Counters, header.History, Policy);
+
+	Memory mem(file_policy);
+	mem.addrDims = header.AddrDims;
+	mem.dataDims = header.DataDims;
+	mem.rangeLen = header.RangeBits;
+	mem.radius = header.Radius;
+	mem.writeCount = header.WriteCount;
+	mem.numHardLocations = header.NumHardLocations;
+	mem.addrSubwords = Word::SubwordsForLength(mem.addrDims, mem.rangeLen);
+	mem.addrStride = AlignedBuffer<SUBWORD>::PaddedRowLength(mem.addrSubwords);
+	mem.counterStride = mem.dataDims * (1 << mem.rangeLen);
+
+	if (header.AddrStride != mem.addrStride || header.CounterStride != mem.counterStride ||
+		header.CounterSizes[0] != mem.ops->NarrowCounterSize || header.CounterSizes[1] != mem.ops->CounterSize)
+	{
+		throw exception("Memory file layout doesn't match the memory");
+	}
+
+	auto section = [&](int Section, size_t Size)
+	{
+		uint64_t offset = header.SectionOffsets[Section];
+
+		if (header.SectionSizes[Section] != Size || offset % MAPPED_FILE_ALIGNMENT != 0 || offset > file->Size() || Size > file->Size() - offset)
+			throw exception("Memory file is truncated or corrupt");
+
+		return file->Data() + offset;
+	};
+
+	size_t hl_count = size_t(mem.numHardLocations);
+	size_t addr_count = hl_count * mem.addrStride;
+	mem.addrs.Adopt(reinterpret_cast<SUBWORD*>(section(MAPPED_ADDRESSES, addr_count * sizeof(SUBWORD))), addr_count, file);
+
+	for (int p = 0; p < 2; p++)
+	{
+		CounterPool& pool = mem.counterPools[p];
+		pool = CounterPool { {}, {}, header.PoolRows[p], size_t(mem.counterStride) * header.CounterSizes[p] };
+
+		size_t slab_size = COUNTER_SLAB_ROWS * pool.RowSize;
+		size_t num_slabs = (size_t(pool.NumRows) + COUNTER_SLAB_ROWS - 1) / COUNTER_SLAB_ROWS;
+		uint8_t* slabs = section(MAPPED_NARROW_COUNTERS + p, num_slabs * slab_size);
+
+		pool.Slabs.resize(num_slabs);
+		for (size_t slab = 0; slab < num_slabs; slab++)
+			pool.Slabs[slab].Adopt(slabs + slab * slab_size, slab_size, file);
+
+		AssignSection(pool.FreeRows, section(MAPPED_NARROW_FREE_ROWS + p, header.PoolFreeRows[p] * sizeof(uint32_t)), header.PoolFreeRows[p]);
+	}
+
+	bool histogram = file_policy.History == WriteHistoryMode::Histogram;
+	bool ring = file_policy.History == WriteHistoryMode::Ring;
+	size_t norm_count = file_policy.Metric == DistanceMetric::Euclidean && mem.rangeLen == 4 ? hl_count : 0;
+
+	AssignSection(mem.counterRows, section(MAPPED_COUNTER_ROWS, hl_count * sizeof(uint32_t)), hl_count);
+	AssignSection(mem.counterPeaks, section(MAPPED_COUNTER_PEAKS, hl_count), hl_count);
+	AssignSection(mem.writeCounts, section(MAPPED_WRITE_COUNTS, hl_count * sizeof(uint32_t)), hl_count);
+	AssignSection(mem.addrNorms, section(MAPPED_ADDRESS_NORMS, norm_count * sizeof(uint32_t)), norm_count);
+	AssignSection(mem.historyCounts, section(MAPPED_HISTORY_COUNTS, histogram ? hl_count * WRITE_HISTORY_VALUES * sizeof(uint16_t) : 0), histogram ? hl_count * WRITE_HISTORY_VALUES : 0);
+	AssignSection(mem.historyRing, section(MAPPED_HISTORY_RING, ring ? hl_count * WRITE_HISTORY_RING_LEN : 0), ring ? hl_count * WRITE_HISTORY_RING_LEN : 0);
+	AssignSection(mem.historyWrites, section(MAPPED_HISTORY_WRITES, ring ? hl_count * sizeof(uint32_t) : 0), ring ? hl_count : 0);
+
+	for (uint32_t row : mem.counterRows)
+	{
+		if (row != NO_COUNTER_ROW && (row & ~WIDE_COUNTER_ROW) >= mem.counterPools[(row & WIDE_COUNTER_ROW) ? 1 : 0].NumRows)
+			throw exception("Memory file is truncated or corrupt");
+	}
+
+	mem.mappedFile = file;
+	mem.initialized = true;
+
+	LOG_INFO("Mapped %s. Memory has %d hard locations and %d total writes", FilePath.c_str(), mem.numHardLocations, mem.writeCount);
+
+	return mem;
+}
+
+void Memory::DetachFromFile()
+{
+	if (addrs.IsView())
+		addrs = AlignedBuffer<SUBWORD>(addrs);
+
+	for (CounterPool& pool : counterPools)
+	{
+		for (AlignedBuffer<uint8_t>& slab : pool.Slabs)
+		{
+			if (slab.IsView())
+				slab = AlignedBuffer<uint8_t>(slab);
+		}
+	}
+
+	mappedFile.reset();
+}
+
+/**
+ Compressed files hold the header, the size of every chunk and then the chunks. A chunk holds the
+ addresses of its hard locations, entropy coded (see EncodeAddressRows), followed by the records of
+ the hard locations that aren't empty. Every record is preceded by the number of empty hard
+ locations skipped to get to it, and a last skip runs to the end of the chunk. A record holds the
+ write count, the counters and the write history:
+ - Counters are zigzag varints. Rows with mostly zeros list (gap, value) pairs of the others
+   instead; rows of zeros are left out entirely.
+ - Histograms are a mask of the values written followed by their counts. Rings are the number of
+   values written followed by the slots filled so far.
+*/
+void Memory::SerializeCompressed(ostream& stream)
+{
+	if (!initialized)
+		throw exception("Memory has not been initialized");
+
+	int num_chunks = (numHardLocations + COMPRESSED_CHUNK_SIZE - 1) / COMPRESSED_CHUNK_SIZE;
+	vector<vector<uint8_t>> chunks(num_chunks);
+
+	// Chunks are encoded on the memory's own threads
+	RunTasks(pool.get(), num_chunks, [&](int Chunk, int Thread)
+	{
+		EncodeChunk(Chunk * COMPRESSED_CHUNK_SIZE, MIN(numHardLocations, (Chunk + 1) * COMPRESSED_CHUNK_SIZE), chunks[Chunk]);
+	});
+
+	CompressedFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.Prefix, COMPRESSED_FILE_PREFIX, FILE_PREFIX_LEN);
+	header.Version = COMPRESSED_FILE_VERSION;
+	header.AddrDims = addrDims;
+	header.DataDims = dataDims;
+	header.RangeBits = rangeLen;
+	header.Radius = radius;
+	header.WriteCount = writeCount;
+	header.NumHardLocations = numHardLocations;
+	header.Metric = int32_t(policy.Metric);
+	header.Counters = int32_t(policy.Counters);
+	header.History = int32_t(policy.History);
+	header.ChunkSize = COMPRESSED_CHUNK_SIZE;
+	header.NumChunks = num_chunks;
+
+	vector<uint64_t> chunk_sizes;
+	for (const vector<uint8_t>& chunk : chunks)
+		chunk_sizes.push_back(chunk.size());
+
+	stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	stream.write(reinterpret_cast<const char*>(chunk_sizes.data()), sizeof(uint64_t) * chunk_sizes.size());
+
+	for (const vector<uint8_t>& chunk : chunks)
+		stream.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+
+	if (stream.fail())
+		throw exception("Could not write the memory file");
+}
+
+void Memory::EncodeChunk(int Begin, int End, vector<uint8_t>& Out)
+{
+	EncodeAddressRows(AddressRow(Begin), addrStride, End - Begin, addrSubwords, Out);
+
+	bool histogram = policy.History == WriteHistoryMode::Histogram;
+	bool ring = policy.History == WriteHistoryMode::Ring;
+	vector<int32_t> counters(counterStride);
+	uint32_t skipped = 0;
+
+	for (int i = Begin; i < End; i++)
+	{
+		const uint16_t* counts = histogram ? &historyCounts[size_t(i) * WRITE_HISTORY_VALUES] : nullptr;
+		uint32_t counts_mask = 0;
+
+		for (int value = 0; counts && value < WRITE_HISTORY_VALUES; value++)
+			counts_mask |= uint32_t(counts[value] != 0) << value;
+
+		if (writeCounts[i] == 0 && !HasCounters(i) && counts_mask == 0 && !(ring && historyWrites[i] > 0))
+		{
+			skipped++;
+			continue;
+		}
+
+		PutVarint(Out, skipped);
+		PutVarint(Out, writeCounts[i]);
+		skipped = 0;
+
+		(HardLocationAt(i).*ops->ExportCounters)(counters.data());
+		uint32_t nonzero = uint32_t(count_if(counters.begin(), counters.end(), [](int32_t ctr) { return ctr != 0; }));
+		bool dense = nonzero * 2 > uint32_t(counterStride);
+
+		PutVarint(Out, (nonzero << 1) | uint32_t(dense));
+
+		for (int c = 0, last = -1; c < counterStride && nonzero > 0; c++)
+		{
+			if (dense)
+			{
+				PutVarint(Out, ZigZag(counters[c]));
+			}
+			else if (counters[c] != 0)
+			{
+				PutVarint(Out, uint32_t(c - last - 1));
+				PutVarint(Out, ZigZag(counters[c]));
+				last = c;
+			}
+		}
+
+		if (histogram)
+		{
+			PutVarint(Out, counts_mask);
+
+			for (int value = 0; value < WRITE_HISTORY_VALUES; value++)
+			{
+				if (counts[value] != 0)
+					PutVarint(Out, counts[value]);
+			}
+		}
+		else if (ring)
+		{
+			uint32_t writes = historyWrites[i];
+			const uint8_t* slots = &historyRing[size_t(i) * WRITE_HISTORY_RING_LEN];
+
+			PutVarint(Out, writes);
+			Out.insert(Out.end(), slots, slots + MIN(writes, uint32_t(WRITE_HISTORY_RING_LEN)));
+		}
+	}
+
+	PutVarint(Out, skipped);
+}
+
+void Memory::DecodeChunk(int Begin, int End, const uint8_t* Data, size_t Size, vector<uint32_t>& CounterIndices, vector<int32_t>& CounterValues)
+{
+	const uint8_t* pos = Data;
+	const uint8_t* end = Data + Size;
+
+	DecodeAddressRows(pos, end, AddressRow(Begin), addrStride, End - Begin, addrSubwords);
+
+	// Not through AddressRowChanged, which isn't safe to call from several threads
+	if (!addrNorms.empty())
+	{
+		const DistanceKernels& kernels = GetDistanceKernels();
+
+		for (int i = Begin; i < End; i++)
+			addrNorms[i] = kernels.NibbleDot(AddressRow(i), AddressRow(i), addrSubwords);
+	}
+
+	bool histogram = policy.History == WriteHistoryMode::Histogram;
+	bool ring = policy.History == WriteHistoryMode::Ring;
+
+	for (int64_t i = Begin + int64_t(GetVarint(pos, end)); i < End; i += 1 + int64_t(GetVarint(pos, end)))
+	{
+		writeCounts[i] = GetVarint(pos, end);
+
+		uint32_t header = GetVarint(pos, end);
+		uint32_t nonzero = header >> 1;
+
+		if (nonzero > uint32_t(counterStride))
+			throw exception("Compressed counters are corrupt");
+
+		if (nonzero > 0)
+		{
+			CounterIndices.push_back(uint32_t(i));
+			CounterValues.resize(CounterValues.size() + counterStride, 0);
+			int32_t* counters = &CounterValues[CounterValues.size() - counterStride];
+
+			for (uint32_t k = 0, c = 0; k < ((header & 1) ? uint32_t(counterStride) : nonzero); k++, c++)
+			{
+				if ((header & 1) == 0)
+					c += GetVarint(pos, end);
+
+				if (c >= uint32_t(counterStride))
+					throw exception("Compressed counters are corrupt");
+
+				counters[c] = UnZigZag(GetVarint(pos, end));
+			}
+		}
+
+		if (histogram)
+		{
+			uint32_t counts_mask = GetVarint(pos, end);
+
+			for (int value = 0; value < WRITE_HISTORY_VALUES; value++)
+			{
+				if (counts_mask & (1u << value))
+					historyCounts[size_t(i) * WRITE_HISTORY_VALUES + value] = uint16_t(GetVarint(pos, end));
+			}
+		}
+		else if (ring)
+		{
+			uint32_t writes = GetVarint(pos, end);
+			size_t filled = MIN(writes, uint32_t(WRITE_HISTORY_RING_LEN));
+
+			if (size_t(end - pos) < filled)
+				throw exception("Compressed data ends too early");
+
+			historyWrites[i] = writes;
+			memcpy(&historyRing[size_t(i) * WRITE_HISTORY_RING_LEN], pos, filled);
+			pos += filled;
+		}
+	}
+
+	if (pos != end)
+		throw exception("Compressed chunk is corrupt");
+}
+
+/**
+ The chunks are read in one go and decoded in parallel; the counter rows are allocated afterwards
+ on this thread
+*/
+/*static*/
+Memory Memory::LoadCompressed(istream& stream, const string& FilePath, const MemoryPolicy& Policy)
+{
+	CompressedFileHeader header;
+	stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+	if (stream.gcount() != sizeof(header))
+		throw exception("Memory file is truncated");
+
+	if (header.Version != COMPRESSED_FILE_VERSION)
+		throw exception("Unsupported memory file version");
+
+	if (header.AddrDims <= 0 || header.DataDims <= 0 || header.RangeBits <= 0 || header.RangeBits > SUBWORD_NUM_BITS || header.NumHardLocations <= 0)
+		throw exception("Invalid memory file dimensions");
+
+	if (header.ChunkSize <= 0 || header.NumChunks != (int64_t(header.NumHardLocations) + header.ChunkSize - 1) / header.ChunkSize)
+		throw exception("Memory file is truncated or corrupt");
+
+	MemoryPolicy file_policy = FilePolicy(FilePath, header.Metric, header.Counters, header.History, Policy);
+
+	vector<uint64_t> chunk_offsets(header.NumChunks + 1, 0);
+	stream.read(reinterpret_cast<char*>(chunk_offsets.data() + 1), sizeof(uint64_t) * header.NumChunks);
+
+	if (stream.fail())
+		throw exception("Memory file is truncated");
+
+	// The chunks have to fit in what's left of the file, which keeps corrupt sizes from allocating
+	streampos data_begin = stream.tellg();
+	stream.seekg(0, ios_base::end);
+	uint64_t data_size = uint64_t(stream.tellg() - data_begin);
+	stream.seekg(data_begin);
+
+	for (int chunk = 0; chunk < header.NumChunks; chunk++)
+	{
+		if (chunk_offsets[chunk + 1] > data_size - chunk_offsets[chunk])
+			throw exception("Memory file is truncated or corrupt");
+
+		chunk_offsets[chunk + 1] += chunk_offsets[chunk];
+	}
+
+	vector<uint8_t> data(chunk_offsets.back());
+	stream.read(reinterpret_cast<char*>(data.data()), data.size());
+
+	if (stream.fail() || data.size() != chunk_offsets.back())
+		throw exception("Memory file is truncated");
+
+	Memory mem(file_policy);
+	mem.addrDims = header.AddrDims;
+	mem.dataDims = header.DataDims;
+	mem.rangeLen = header.RangeBits;
+	mem.radius = header.Radius;
+	mem.writeCount = header.WriteCount;
+	mem.AllocateHardLocations(header.NumHardLocations);
+
+	vector<vector<uint32_t>> counter_indices(header.NumChunks);
+	vector<vector<int32_t>> counter_values(header.NumChunks);
+	unique_ptr<ThreadPool> chunk_pool = CreateChunkPool(header.NumChunks);
+
+	RunTasks(chunk_pool.get(), header.NumChunks, [&](int Chunk, int Thread)
+	{
+		int begin = Chunk * header.ChunkSize;
+		int end = int(MIN(int64_t(header.NumHardLocations), int64_t(begin) + header.ChunkSize));
+
+		mem.DecodeChunk(begin, end, data.data() + chunk_offsets[Chunk], size_t(chunk_offsets[Chunk + 1] - chunk_offsets[Chunk]), counter_indices[Chunk], counter_values[Chunk]);
+	});
+
+	for (int chunk = 0; chunk < header.NumChunks; chunk++)
+	{
+		for (size_t k = 0; k < counter_indices[chunk].size(); k++)
+			(mem.HardLocationAt(counter_indices[chunk][k]).*mem.ops->ImportCounters)(&counter_values[chunk][k * mem.counterStride]);
+	}
+
+	mem.initialized = true;
+
+	LOG_INFO("Loaded %s. Memory has %d hard locations and %d total writes", FilePath.c_str(), mem.numHardLocations, mem.writeCount);
+
+	return mem;
+}
+
+Memory::Memory(istream& stream, const MemoryPolicy& Policy)
+	: Memory(Policy)
+{
+	// Reads ahead STREAM_BUFFER_SIZE bytes at a time; Finish leaves the stream after the memory
+	BufferedStreamReader reader(stream);
+
+	const char* prefix = reinterpret_cast<const char*>(reader.Take(FILE_PREFIX_LEN));
+
+	bool has_policy = strncmp(prefix, SPARSE_POLICY_FILE_PREFIX, FILE_PREFIX_LEN) == 0;
+	bool sparse = has_policy || strncmp(prefix, SPARSE_FILE_PREFIX, FILE_PREFIX_LEN) == 0;
+
+	if (!sparse && strncmp(prefix, FILE_PREFIX, FILE_PREFIX_LEN) != 0)
+	{
+		throw exception("Invalid file; prefix not found.");
+	}
+
+	if (has_policy)
+	{
+		int32_t metric = reader.Get<int32_t>();
+		int32_t counters = reader.Get<int32_t>();
+		int32_t history = reader.Get<int32_t>();
+
+		policy = FilePolicy("The memory file", metric, counters, history, Policy);
+		ops = SelectOps(policy);
+	}
+
+	addrDims = reader.Get<int32_t>();
+	dataDims = reader.Get<int32_t>();
+	rangeLen = reader.Get<int32_t>();
+	radius = reader.Get<int32_t>();
+	writeCount = reader.Get<int32_t>();
+
+	int hl_count = reader.Get<int32_t>();
+
+	AllocateHardLocations(hl_count);
+
+	for (int idx = 0; idx < hl_count; idx++)
+	{
+		HardLocationAt(idx).DeserializeRecord(reader, sparse);
+
+		if (idx % (hl_count / 10) == 0)
+		{
+			float progress = (float(idx) / hl_count) * 100;
+			LOG_INFO("Load progress: %.0f%%", progress);
+		}
+	}
+
+	reader.Finish();
 
 	LOG_INFO("Load completed. Memory has %d total writes", writeCount);
 
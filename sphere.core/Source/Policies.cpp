@@ -0,0 +1,99 @@
+
+#include <cctype>
+
+#include "Policies.h"
+
+using namespace std;
+using namespace sphere;
+
+static const char* MetricNames[NUM_DISTANCE_METRICS] = { "Euclidean", "Manhattan", "CircularEuclidean", "CircularManhattan" };
+static const char* CounterModeNames[NUM_COUNTER_MODES] = { "Saturating", "DecrementUnmatched" };
+static const char* WriteHistoryModeNames[NUM_WRITE_HISTORY_MODES] = { "Off", "Histogram", "Ring" };
+static const char* MemoryFileFormatNames[NUM_MEMORY_FILE_FORMATS] = { "Sparse", "Mapped", "Compressed" };
+
+bool sphere::NamesMatch(const string& Name, const char* Expected)
+{
+	string expected(Expected);
+
+	bool match = Name.length() == expected.length();
+	for (int i = 0; match && i < Name.length(); i++)
+		match = tolower(Name[i]) == tolower(expected[i]);
+
+	return match;
+}
+
+const char* sphere::DistanceMetricName(DistanceMetric Metric)
+{
+	return MetricNames[int(Metric)];
+}
+
+const char* sphere::CounterModeName(CounterMode Mode)
+{
+	return CounterModeNames[int(Mode)];
+}
+
+const char* sphere::WriteHistoryModeName(WriteHistoryMode Mode)
+{
+	return WriteHistoryModeNames[int(Mode)];
+}
+
+const char* sphere::MemoryFileFormatName(MemoryFileFormat Format)
+{
+	return MemoryFileFormatNames[int(Format)];
+}
+
+bool sphere::ParseDistanceMetric(const string& Name, DistanceMetric& Metric)
+{
+	for (int i = 0; i < NUM_DISTANCE_METRICS; i++)
+	{
+		if (NamesMatch(Name, MetricNames[i]))
+		{
+			Metric = DistanceMetric(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool sphere::ParseCounterMode(const string& Name, CounterMode& Mode)
+{
+	for (int i = 0; i < NUM_COUNTER_MODES; i++)
+	{
+		if (NamesMatch(Name, CounterModeNames[i]))
+		{
+			Mode = CounterMode(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool sphere::ParseWriteHistoryMode(const string& Name, WriteHistoryMode& Mode)
+{
+	for (int i = 0; i < NUM_WRITE_HISTORY_MODES; i++)
+	{
+		if (NamesMatch(Name, WriteHistoryModeNames[i]))
+		{
+			Mode = WriteHistoryMode(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool sphere::ParseMemoryFileFormat(const string& Name, MemoryFileFormat& Format)
+{
+	for (int i = 0; i < NUM_MEMORY_FILE_FORMATS; i++)
+	{
+		if (NamesMatch(Name, MemoryFileFormatNames[i]))
+		{
+			Format = MemoryFileFormat(i);
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,273 @@
+
+#include <cmath>
+#include <cstring>
+
+#include "Common.h"
+#include "SnapshotCodec.h"
+
+using namespace std;
+using namespace sphere;
+
+#define NIBBLES_PER_SUBWORD (SUBWORD_NUM_BITS / 4)
+#define NIBBLE_VALUES 16
+
+// The coder state stays within [RANS_LOWER_BOUND, RANS_LOWER_BOUND << 8) between symbols
+#define RANS_LOWER_BOUND (1u << 23)
+#define RANS_SCALE (1u << ADDRESS_CODER_SCALE_BITS)
+
+enum AddressCoding : uint8_t
+{
+	ADDRESSES_RAW,
+	ADDRESSES_RANS
+};
+
+void sphere::PutVarint(vector<uint8_t>& Out, uint32_t Value)
+{
+	while (Value >= 0x80)
+	{
+		Out.push_back(uint8_t(Value | 0x80));
+		Value >>= 7;
+	}
+
+	Out.push_back(uint8_t(Value));
+}
+
+uint32_t sphere::GetVarint(const uint8_t*& Pos, const uint8_t* End)
+{
+	uint32_t value = 0;
+
+	for (int shift = 0; shift < 35; shift += 7)
+	{
+		if (Pos == End)
+			throw exception("Compressed data ends too early");
+
+		uint8_t byte = *Pos++;
+		value |= uint32_t(byte & 0x7F) << shift;
+
+		if ((byte & 0x80) == 0)
+			return value;
+	}
+
+	throw exception("Invalid varint in compressed data");
+}
+
+static inline uint32_t NibbleAt(const SUBWORD* Row, int Nibble)
+{
+	return (Row[Nibble / NIBBLES_PER_SUBWORD] >> (SUBWORD_NUM_BITS - 4 * (Nibble % NIBBLES_PER_SUBWORD + 1))) & 0xF;
+}
+
+/**
+ Scales the counts of one nibble position to frequencies that sum to RANS_SCALE. Values that occur
+ keep a frequency of at least 1; the rounding error goes to the most frequent value, which is large
+ enough to absorb it.
+*/
+static void NormalizeFrequencies(const uint32_t* Counts, uint32_t Total, uint16_t* Freqs)
+{
+	uint32_t sum = 0;
+	int largest = 0;
+
+	for (int v = 0; v < NIBBLE_VALUES; v++)
+	{
+		Freqs[v] = Counts[v] == 0 ? 0 : uint16_t(MAX(1u, uint32_t(uint64_t(Counts[v]) * RANS_SCALE / Total)));
+		sum += Freqs[v];
+
+		if (Freqs[v] > Freqs[largest])
+			largest = v;
+	}
+
+	Freqs[largest] = uint16_t(int(Freqs[largest]) + int(RANS_SCALE) - int(sum));
+}
+
+/**
+ rANS codes the symbols last to first so the decoder can read them first to last. The renormalized
+ bytes are collected in reverse and flipped once at the end, after the final state.
+*/
+void sphere::EncodeAddressRows(const SUBWORD* Rows, size_t Stride, int Count, int NumSubwords, vector<uint8_t>& Out)
+{
+	int num_nibbles = NumSubwords * NIBBLES_PER_SUBWORD;
+	size_t raw_size = sizeof(SUBWORD) * NumSubwords * size_t(Count);
+
+	vector<uint32_t> counts(size_t(num_nibbles) * NIBBLE_VALUES, 0);
+	for (int row = 0; row < Count; row++)
+	{
+		const SUBWORD* addr = Rows + row * Stride;
+		uint32_t* row_counts = counts.data();
+
+		for (int sw = 0; sw < NumSubwords; sw++)
+		{
+			for (int shift = SUBWORD_NUM_BITS - 4; shift >= 0; shift -= 4, row_counts += NIBBLE_VALUES)
+				row_counts[(addr[sw] >> shift) & 0xF]++;
+		}
+	}
+
+	vector<uint16_t> freqs(counts.size());
+	vector<uint16_t> starts(counts.size());
+	vector<uint8_t> tables;
+	double estimated_bits = 0;
+
+	for (int n = 0; n < num_nibbles && Count > 0; n++)
+	{
+		NormalizeFrequencies(&counts[n * NIBBLE_VALUES], uint32_t(Count), &freqs[n * NIBBLE_VALUES]);
+
+		uint16_t start = 0;
+		for (int v = 0; v < NIBBLE_VALUES; v++)
+		{
+			uint16_t freq = freqs[n * NIBBLE_VALUES + v];
+
+			starts[n * NIBBLE_VALUES + v] = start;
+			start += freq;
+			PutVarint(tables, freq);
+
+			if (freq > 0)
+				estimated_bits += counts[n * NIBBLE_VALUES + v] * log2(double(RANS_SCALE) / freq);
+		}
+	}
+
+	// Addresses drawn at random don't shrink, and the estimate saves coding them to find out
+	bool worth_coding = Count > 0 && tables.size() + estimated_bits / 8 < raw_size;
+
+	vector<uint8_t> coded;
+	uint32_t state = RANS_LOWER_BOUND;
+
+	for (int row = Count - 1; row >= 0 && worth_coding; row--)
+	{
+		const SUBWORD* addr = Rows + row * Stride;
+
+		for (int n = num_nibbles - 1; n >= 0; n--)
+		{
+			int symbol = n * NIBBLE_VALUES + NibbleAt(addr, n);
+			uint32_t freq = freqs[symbol];
+			uint32_t state_max = ((RANS_LOWER_BOUND >> ADDRESS_CODER_SCALE_BITS) << 8) * freq;
+
+			while (state >= state_max)
+			{
+				coded.push_back(uint8_t(state));
+				state >>= 8;
+			}
+
+			state = ((state / freq) << ADDRESS_CODER_SCALE_BITS) + state % freq + starts[symbol];
+		}
+
+		// No point going on once the rows are sure not to shrink
+		if (tables.size() + coded.size() >= raw_size)
+			break;
+	}
+
+	for (int i = 0; i < 4; i++)
+		coded.push_back(uint8_t(state >> (8 * i)));
+
+	if (!worth_coding || tables.size() + coded.size() + 5 >= raw_size)
+	{
+		Out.push_back(ADDRESSES_RAW);
+
+		for (int row = 0; row < Count; row++)
+		{
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(Rows + row * Stride);
+			Out.insert(Out.end(), bytes, bytes + sizeof(SUBWORD) * NumSubwords);
+		}
+
+		return;
+	}
+
+	Out.push_back(ADDRESSES_RANS);
+	Out.insert(Out.end(), tables.begin(), tables.end());
+	PutVarint(Out, uint32_t(coded.size()));
+	Out.insert(Out.end(), coded.rbegin(), coded.rend());
+}
+
+void sphere::DecodeAddressRows(const uint8_t*& Pos, const uint8_t* End, SUBWORD* Rows, size_t Stride, int Count, int NumSubwords)
+{
+	if (Pos == End)
+		throw exception("Compressed data ends too early");
+
+	uint8_t coding = *Pos++;
+	size_t row_size = sizeof(SUBWORD) * NumSubwords;
+
+	if (coding == ADDRESSES_RAW)
+	{
+		if (size_t(End - Pos) < row_size * Count)
+			throw exception("Compressed data ends too early");
+
+		for (int row = 0; row < Count; row++, Pos += row_size)
+		{
+			memcpy(Rows + row * Stride, Pos, row_size);
+			memset(Rows + row * Stride + NumSubwords, 0, sizeof(SUBWORD) * (Stride - NumSubwords));
+		}
+
+		return;
+	}
+
+	if (coding != ADDRESSES_RANS)
+		throw exception("Unknown address coding in compressed data");
+
+	// Starts[v] .. Starts[v + 1] is the slot range of value v; the last entry of a position is the scale
+	int num_nibbles = NumSubwords * NIBBLES_PER_SUBWORD;
+	vector<uint16_t> freqs(size_t(num_nibbles) * NIBBLE_VALUES);
+	vector<uint32_t> starts(size_t(num_nibbles) * (NIBBLE_VALUES + 1));
+
+	for (int n = 0; n < num_nibbles; n++)
+	{
+		uint32_t start = 0;
+
+		for (int v = 0; v < NIBBLE_VALUES; v++)
+		{
+			uint32_t freq = GetVarint(Pos, End);
+			freqs[n * NIBBLE_VALUES + v] = uint16_t(freq);
+			starts[n * (NIBBLE_VALUES + 1) + v] = start;
+			start += freq;
+		}
+
+		if (start != RANS_SCALE)
+			throw exception("Invalid frequency table in compressed data");
+
+		starts[n * (NIBBLE_VALUES + 1) + NIBBLE_VALUES] = start;
+	}
+
+	uint32_t coded_size = GetVarint(Pos, End);
+	if (coded_size < 4 || size_t(End - Pos) < coded_size)
+		throw exception("Compressed data ends too early");
+
+	const uint8_t* coded_end = Pos + coded_size;
+	uint32_t state = (uint32_t(Pos[0]) << 24) | (uint32_t(Pos[1]) << 16) | (uint32_t(Pos[2]) << 8) | Pos[3];
+	Pos += 4;
+
+	for (int row = 0; row < Count; row++)
+	{
+		SUBWORD* addr = Rows + row * Stride;
+
+		for (int sw = 0; sw < NumSubwords; sw++)
+		{
+			SUBWORD value = 0;
+
+			for (int j = 0; j < NIBBLES_PER_SUBWORD; j++)
+			{
+				int n = sw * NIBBLES_PER_SUBWORD + j;
+				const uint32_t* bounds = &starts[n * (NIBBLE_VALUES + 1)];
+				uint32_t slot = state & (RANS_SCALE - 1);
+
+				int v = 0;
+				while (slot >= bounds[v + 1])
+					v++;
+
+				value |= SUBWORD(v) << (SUBWORD_NUM_BITS - 4 * (j + 1));
+				state = freqs[n * NIBBLE_VALUES + v] * (state >> ADDRESS_CODER_SCALE_BITS) + slot - bounds[v];
+
+				while (state < RANS_LOWER_BOUND)
+				{
+					if (Pos == coded_end)
+						throw exception("Compressed data ends too early");
+
+					state = (state << 8) | *Pos++;
+				}
+			}
+
+			addr[sw] = value;
+		}
+
+		memset(addr + NumSubwords, 0, sizeof(SUBWORD) * (Stride - NumSubwords));
+	}
+
+	// Decoding ends in the state encoding started from
+	if (Pos != coded_end || state != RANS_LOWER_BOUND)
+		throw exception("Compressed addresses are corrupt");
+}
@@ -0,0 +1,270 @@
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "Common.h"
+#include "ThreadPool.h"
+
+using namespace std;
+using namespace sphere;
+
+#define PACK_RANGE(begin, end) ((uint64_t(uint32_t(end)) << 32) | uint32_t(begin))
+#define RANGE_BEGIN(range) int(uint32_t(range))
+#define RANGE_END(range) int(uint32_t((range) >> 32))
+
+static void PinThread(thread& Thread, int Cpu)
+{
+	Cpu %= ThreadPool::HardwareThreads();
+
+#if defined(_MSC_VER)
+	// Only the first processor group; the pool never spans more than 64 CPUs
+	if (Cpu < 64)
+		SetThreadAffinityMask(Thread.native_handle(), DWORD_PTR(1) << Cpu);
+#else
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(Cpu, &cpus);
+	pthread_setaffinity_np(Thread.native_handle(), sizeof(cpus), &cpus);
+#endif
+}
+
+ThreadPool::ThreadPool(int NumThreads, bool PinThreads)
+	: ranges(new WorkRange[MAX(NumThreads, 1)])
+	, job(nullptr)
+	, jobBegin(0)
+	, grain(1)
+	, busyWorkers(0)
+	, generation(0)
+	, stopping(false)
+	, pinThreads(PinThreads)
+{
+	if (NumThreads < 1)
+		throw exception("Thread pool needs at least one thread");
+
+	for (int i = 0; i < NumThreads; i++)
+		ranges[i].Range = 0;
+
+	for (int i = 1; i < NumThreads; i++)
+	{
+		workers.push_back(thread(&ThreadPool::WorkerLoop, this, i));
+
+		if (pinThreads)
+			PinThread(workers.back(), i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+
+	wake.notify_all();
+
+	for (thread& worker : workers)
+		worker.join();
+}
+
+void ThreadPool::Run(int NumTasks, const PoolTaskFunc& Func)
+{
+	ParallelFor(0, NumTasks, 1, [&](int Begin, int End, int Thread)
+	{
+		for (int task = Begin; task < End; task++)
+			Func(task, Thread);
+	});
+}
+
+void ThreadPool::ParallelFor(int Begin, int End, int Grain, const PoolRangeFunc& Func)
+{
+	if (End <= Begin)
+		return;
+
+	// Only one job at a time; memories sharing a pool take turns
+	lock_guard<mutex> run_guard(runLock);
+
+	{
+		lock_guard<mutex> guard(lock);
+
+		// Ranges are kept relative to Begin so they always fit 32 bits
+		int count = End - Begin;
+		int num_threads = NumThreads();
+
+		for (int t = 0; t < num_threads; t++)
+		{
+			int64_t first = int64_t(count) * t / num_threads;
+			int64_t last = int64_t(count) * (t + 1) / num_threads;
+			ranges[t].Range.store(PACK_RANGE(first, last), memory_order_relaxed);
+		}
+
+		job = &Func;
+		jobBegin = Begin;
+		grain = MAX(Grain, 1);
+		busyWorkers = int(workers.size());
+		error = nullptr;
+		generation++;
+	}
+
+	if (!workers.empty())
+		wake.notify_all();
+
+	RunChunks(0);
+
+	unique_lock<mutex> guard(lock);
+	finished.wait(guard, [this] { return busyWorkers == 0; });
+	job = nullptr;
+
+	if (error)
+		rethrow_exception(error);
+}
+
+void ThreadPool::WorkerLoop(int Thread)
+{
+	uint64_t seen = 0;
+
+	while (true)
+	{
+		{
+			unique_lock<mutex> guard(lock);
+			wake.wait(guard, [&] { return stopping || generation != seen; });
+
+			if (stopping)
+				return;
+
+			seen = generation;
+		}
+
+		RunChunks(Thread);
+
+		{
+			lock_guard<mutex> guard(lock);
+			busyWorkers--;
+		}
+
+		finished.notify_one();
+	}
+}
+
+void ThreadPool::RunChunks(int Thread)
+{
+	int begin, end;
+
+	do
+	{
+		while (TakeChunk(Thread, begin, end))
+		{
+			try
+			{
+				(*job)(jobBegin + begin, jobBegin + end, Thread);
+			}
+			catch (...)
+			{
+				lock_guard<mutex> guard(lock);
+				if (!error)
+					error = current_exception();
+			}
+		}
+	} while (Steal(Thread));
+}
+
+bool ThreadPool::TakeChunk(int Thread, int& Begin, int& End)
+{
+	atomic<uint64_t>& own = ranges[Thread].Range;
+	uint64_t range = own.load(memory_order_acquire);
+
+	while (true)
+	{
+		Begin = RANGE_BEGIN(range);
+		End = RANGE_END(range);
+
+		if (Begin >= End)
+			return false;
+
+		int split = End - Begin > grain ? Begin + grain : End;
+
+		if (own.compare_exchange_weak(range, PACK_RANGE(split, End), memory_order_acq_rel))
+		{
+			End = split;
+			return true;
+		}
+	}
+}
+
+/**
+ Moves the back half of the largest remaining range of the other threads into the range of Thread,
+ which is empty by now. Returns false once there's nothing left to steal. A range that's in flight
+ between two threads can be missed, which only means its new owner runs it alone.
+*/
+bool ThreadPool::Steal(int Thread)
+{
+	int num_threads = NumThreads();
+
+	while (true)
+	{
+		int victim = -1;
+		int largest = 0;
+		uint64_t range = 0;
+
+		for (int i = 1; i < num_threads; i++)
+		{
+			int t = (Thread + i) % num_threads;
+			uint64_t r = ranges[t].Range.load(memory_order_acquire);
+			int remaining = RANGE_END(r) - RANGE_BEGIN(r);
+
+			if (remaining > largest)
+			{
+				victim = t;
+				largest = remaining;
+				range = r;
+			}
+		}
+
+		if (victim < 0)
+			return false;
+
+		int begin = RANGE_BEGIN(range);
+		int end = RANGE_END(range);
+		int split = largest > grain ? begin + largest / 2 : begin;
+
+		if (ranges[victim].Range.compare_exchange_strong(range, PACK_RANGE(begin, split), memory_order_acq_rel))
+		{
+			ranges[Thread].Range.store(PACK_RANGE(split, end), memory_order_release);
+			return true;
+		}
+	}
+}
+
+/*static*/ int ThreadPool::HardwareThreads()
+{
+	unsigned int count = thread::hardware_concurrency();
+	return count > 0 ? int(count) : 1;
+}
+
+void sphere::RunTasks(ThreadPool* Pool, int NumTasks, const PoolTaskFunc& Func)
+{
+	if (Pool)
+	{
+		Pool->Run(NumTasks, Func);
+	}
+	else
+	{
+		for (int task = 0; task < NumTasks; task++)
+			Func(task, 0);
+	}
+}
+
+void sphere::ParallelFor(ThreadPool* Pool, int Begin, int End, int Grain, const PoolRangeFunc& Func)
+{
+	if (Pool)
+	{
+		Pool->ParallelFor(Begin, End, Grain, Func);
+	}
+	else
+	{
+		for (int begin = Begin; begin < End; begin += MAX(Grain, 1))
+			Func(begin, MIN(End, begin + MAX(Grain, 1)), 0);
+	}
+}
@@ -0,0 +1,139 @@
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <utility>
+
+#include "VPTree.h"
+
+using namespace std;
+using namespace sphere;
+
+// Distances are compared as floats when pruning; the slack keeps rounding errors from ever
+// dropping a subtree that could still contain an activated hard location
+#define PRUNE_SLACK 1e-3f
+
+VPTree::VPTree()
+	: stride(0)
+	, rangeBits(0)
+	, metric(DistanceMetric::Euclidean)
+{
+}
+
+/**
+ Each node takes the first address of its range as the vantage point and splits the rest of the
+ range at the median distance to it: addresses at or below the median go to the inside subtree,
+ the others to the outside subtree. Vantage points are chosen with a fixed seed so builds are
+ repeatable.
+*/
+void VPTree::Build(const SUBWORD* Addrs, size_t Stride, int Count, int Dims, int RangeBits, DistanceMetric Metric)
+{
+	rangeBits = RangeBits;
+	metric = Metric;
+	order.resize(Count);
+	thresholds.assign(Count, 0.0f);
+	insideEnd.assign(Count, 0);
+
+	for (int i = 0; i < Count; i++)
+		order[i] = i;
+
+	mt19937 rng(0x5EED);
+	vector<pair<float, uint32_t>> items;
+	vector<pair<int, int>> pending;
+	pending.push_back(make_pair(0, Count));
+
+	while (!pending.empty())
+	{
+		int lo = pending.back().first;
+		int hi = pending.back().second;
+		pending.pop_back();
+
+		if (hi - lo <= VPTREE_LEAF_SIZE)
+			continue;
+
+		int pick = lo + int(rng() % uint32_t(hi - lo));
+		swap(order[lo], order[pick]);
+
+		Word vantage = Word::FromSubwords(Dims, RangeBits, Addrs + order[lo] * Stride);
+
+		items.clear();
+		for (int i = lo + 1; i < hi; i++)
+		{
+			uint32_t dist_sq = vantage.SquaredDistanceTo(Addrs + order[i] * Stride, metric);
+			items.push_back(make_pair(Word::DistanceFromSquared(dist_sq, RangeBits, metric), order[i]));
+		}
+
+		auto median = items.begin() + (items.size() - 1) / 2;
+		nth_element(items.begin(), median, items.end());
+		float mu = median->first;
+
+		auto inside_end = partition(items.begin(), items.end(), [mu](const pair<float, uint32_t>& item)
+		{
+			return item.first <= mu;
+		});
+
+		for (size_t i = 0; i < items.size(); i++)
+			order[lo + 1 + i] = items[i].second;
+
+		int mid = lo + 1 + int(inside_end - items.begin());
+		thresholds[lo] = mu;
+		insideEnd[lo] = mid;
+
+		pending.push_back(make_pair(lo + 1, mid));
+		pending.push_back(make_pair(mid, hi));
+	}
+
+	stride = Stride;
+	rows.Allocate(size_t(Count) * stride);
+
+	for (int i = 0; i < Count; i++)
+		memcpy(rows.Ptr() + i * stride, Addrs + order[i] * Stride, sizeof(SUBWORD) * Stride);
+}
+
+int VPTree::Search(const Word& Query, int Radius, vector<uint32_t>& Out) const
+{
+	uint32_t radius_sq = Word::SquaredRadius(Radius, rangeBits, metric);
+	float reach = float(Radius) + PRUNE_SLACK;
+	int evaluations = 0;
+
+	vector<pair<int, int>> pending;
+	pending.push_back(make_pair(0, Size()));
+
+	while (!pending.empty())
+	{
+		int lo = pending.back().first;
+		int hi = pending.back().second;
+		pending.pop_back();
+
+		if (hi - lo <= VPTREE_LEAF_SIZE)
+		{
+			for (int i = lo; i < hi; i++)
+			{
+				if (Query.WithinRadius(rows.Ptr() + i * stride, radius_sq, metric))
+					Out.push_back(order[i]);
+			}
+
+			evaluations += hi - lo;
+			continue;
+		}
+
+		uint32_t dist_sq = Query.SquaredDistanceTo(rows.Ptr() + lo * stride, metric);
+		evaluations++;
+
+		if (dist_sq <= radius_sq)
+			Out.push_back(order[lo]);
+
+		// Anything inside is at least d - mu away from the query, anything outside more than mu - d
+		float d = Word::DistanceFromSquared(dist_sq, rangeBits, metric);
+		float mu = thresholds[lo];
+		int mid = insideEnd[lo];
+
+		if (d - mu <= reach)
+			pending.push_back(make_pair(lo + 1, mid));
+
+		if (mu - d < reach)
+			pending.push_back(make_pair(mid, hi));
+	}
+
+	return evaluations;
+}
@@ -2,10 +2,11 @@
 #include <cassert>
 #include <chrono>
 #include <random>
-#include <intrin.h>
 
 #include "Word.h"
+#include "BufferedStream.h"
 #include "Common.h"
+#include "DistanceKernels.h"
 
 using namespace std;
 using namespace sphere;
@@ -36,7 +37,7 @@ Word::Word(int N, int RangeBits)
 		numSubWords++;
 
 	subwords = vector<SUBWORD>(numSubWords);
-	RandomizeSubwords(subwords);
+	RandomizeSubwords(subwords.data(), numSubWords);
 
 	assert(subwords.size() == numSubWords);
 }
@@ -159,85 +160,161 @@ Word::Word(int N, int RangeBits, vector<SUBWORD>& SubWords)
 	assert(subwords.size() == numSubWords);
 }
 
-const float Word::DistanceTo(const Word& Other) const
+const float Word::DistanceTo(const Word& Other, DistanceMetric Metric) const
+{
+	return DistanceFromSquared(SquaredDistanceTo(Other, Metric), rangeBitLen, Metric);
+}
+
+const uint32_t Word::SquaredDistanceTo(const Word& Other, DistanceMetric Metric) const
 {
 	if (Other.NumDimensions() != NumDimensions())
 	{
 		throw exception("Incompatible word lengths");
 	}
 
-	int sub_len = subwords.size();
-	float dist = 0.0f;
+	return SquaredDistanceTo(Other.Data(), Metric);
+}
 
-	if (rangeBitLen == 1)
+const bool Word::WithinRadius(const Word& Other, uint32_t RadiusSquared, DistanceMetric Metric) const
+{
+	if (Other.NumDimensions() != NumDimensions())
 	{
-		// When each dimension is 1 bit, use hamming distance
+		throw exception("Incompatible word lengths");
+	}
 
-		for (int i = 0; i < sub_len; i++)
-		{
-			SUBWORD xored = subwords[i] ^ Other.SubwordAt(i);
+	return WithinRadius(Other.Data(), RadiusSquared, Metric);
+}
 
-			if (lastSubwordLen > 0 && i == sub_len - 1)
-			{
-				// TODO: need this?
-				xored = xored & ((1 << lastSubwordLen) - 1);
-			}
+const uint32_t Word::SquaredDistanceTo(const SUBWORD* Other, DistanceMetric Metric) const
+{
+	DISPATCH_METRIC(Metric, return SquaredDistanceTo<MetricPolicy>(Other));
+}
 
-			dist += __popcnt(xored);
-		}
+const bool Word::WithinRadius(const SUBWORD* Other, uint32_t RadiusSquared, DistanceMetric Metric) const
+{
+	DISPATCH_METRIC(Metric, return WithinRadius<MetricPolicy>(Other, RadiusSquared));
+}
+
+template <class Metric>
+const uint32_t Word::SquaredDistanceTo(const SUBWORD* Other) const
+{
+	return BoundedSquaredDistanceTo<Metric>(Other, UINT32_MAX);
+}
+
+template <class Metric>
+const bool Word::WithinRadius(const SUBWORD* Other, uint32_t RadiusSquared) const
+{
+	return BoundedSquaredDistanceTo<Metric>(Other, RadiusSquared) <= RadiusSquared;
+}
+
+/**
+ Returns the exact squared distance if it's <= Bound, otherwise any partial sum that exceeds it
+*/
+template <class Metric>
+const uint32_t Word::BoundedSquaredDistanceTo(const SUBWORD* Other, uint32_t Bound) const
+{
+	int sub_len = subwords.size();
+	uint32_t running_sum = 0;
+
+	if (rangeBitLen == 1)
+	{
+		// When each dimension is 1 bit, use hamming distance. The kernels don't stop early; words
+		// are short enough that checking the bound would cost more than it saves.
+		running_sum = GetDistanceKernels().HammingDistance(subwords.data(), Other, sub_len, LastSubwordMask());
+	}
+	else if (rangeBitLen == 4)
+	{
+		// Packed nibbles go through the vectorized kernels picked for this CPU
+		const DistanceKernels& kernels = GetDistanceKernels();
+
+		if (Bound == UINT32_MAX)
+			running_sum = kernels.NibbleDistance[int(Metric::Kind)](subwords.data(), Other, sub_len);
+		else
+			running_sum = kernels.NibbleBoundedDistance[int(Metric::Kind)](subwords.data(), Other, sub_len, Bound);
+	}
+	else if (rangeBitLen == 2)
+	{
+		// Four integers per byte, so one table lookup replaces four rounds of the loop below
+		running_sum = BytePairDistance(subwords.data(), Other, sub_len, rangeBitLen, Metric::Kind, Bound);
 	}
 	else
 	{
 		int ints_per_sw = SUBWORD_NUM_BITS / rangeBitLen;
 		const uint8_t base_mask = (1 << rangeBitLen) - 1;
-		float running_sum = 0.0f;
-		int shift;
 
-		for (int i = 0; i < sub_len; i++)
+		for (int i = 0; i < sub_len && running_sum <= Bound; i++)
 		{
 			for (int j = 0; j < ints_per_sw; j++)
 			{
 				int shift = 32 - (j + 1) * rangeBitLen;
 				uint32_t mask = base_mask << shift;
 
-				uint8_t value_this = (subwords[i] & mask) >> shift;
-				uint8_t value_other = (Other.SubwordAt(i) & mask) >> shift;
-
-				uint8_t dist_1 = (value_this - value_other) % rangeSize;
-				uint8_t dist_2 = (value_other - value_this) % rangeSize;
-
-				if (dist_1 <= dist_2)
-				{
-#if MANHATTAN_DISTANCE
-					running_sum += dist_1;
-#else
-					running_sum += (dist_1 * dist_1);
-#endif
-				}
-				else
-				{
-#if MANHATTAN_DISTANCE
-					running_sum += dist_2;
-#else
-					running_sum += (dist_2 * dist_2);
+				int value_this = (subwords[i] & mask) >> shift;
+				int value_other = (Other[i] & mask) >> shift;
+				int diff = value_this - value_other;
 
-#endif
-				}
+				running_sum += Metric::Term(Metric::Fold(diff < 0 ? -diff : diff, rangeSize));
 			}
 		}
-
-#if MANHATTAN_DISTANCE
-		dist = running_sum;
-#else
-		dist = sqrtf(running_sum);
-#endif
 	}
 
-	return dist;
+	return running_sum;
+}
+
+template const uint32_t Word::SquaredDistanceTo<EuclideanMetric>(const SUBWORD* Other) const;
+template const uint32_t Word::SquaredDistanceTo<ManhattanMetric>(const SUBWORD* Other) const;
+template const uint32_t Word::SquaredDistanceTo<CircularEuclideanMetric>(const SUBWORD* Other) const;
+template const uint32_t Word::SquaredDistanceTo<CircularManhattanMetric>(const SUBWORD* Other) const;
+template const bool Word::WithinRadius<EuclideanMetric>(const SUBWORD* Other, uint32_t RadiusSquared) const;
+template const bool Word::WithinRadius<ManhattanMetric>(const SUBWORD* Other, uint32_t RadiusSquared) const;
+template const bool Word::WithinRadius<CircularEuclideanMetric>(const SUBWORD* Other, uint32_t RadiusSquared) const;
+template const bool Word::WithinRadius<CircularManhattanMetric>(const SUBWORD* Other, uint32_t RadiusSquared) const;
+
+/*static*/
+Word Word::FromSubwords(int N, int RangeBits, const SUBWORD* Subwords)
+{
+	Word word;
+	word.numDims = N;
+	word.rangeBitLen = RangeBits;
+	word.rangeSize = uint8_t(1 << RangeBits);
+
+	int total_len = N * RangeBits;
+	word.numSubWords = SubwordsForLength(N, RangeBits);
+	word.lastSubwordLen = total_len % SUBWORD_NUM_BITS;
+	word.subwords.assign(Subwords, Subwords + word.numSubWords);
+
+	return word;
+}
+
+/**
+ Number of subwords used by a word created with Word(N, RangeBits)
+*/
+/*static*/
+int Word::SubwordsForLength(int N, int RangeBits)
+{
+	int total_len = N * RangeBits;
+	int len = total_len / SUBWORD_NUM_BITS;
+
+	if (total_len % SUBWORD_NUM_BITS > 0)
+		len++;
+
+	return len;
+}
+
+/*static*/
+uint32_t Word::SquaredRadius(int Radius, int RangeBits, DistanceMetric Metric)
+{
+	DISPATCH_METRIC(Metric, return MetricPolicy::SquaredRadius(Radius, RangeBits));
 }
 
 /*static*/
-Word Word::FromCounters(const vector<COUNTER>& counters, int RangeLen, bool& Conclusive)
+float Word::DistanceFromSquared(uint32_t SquaredDistance, int RangeBits, DistanceMetric Metric)
+{
+	DISPATCH_METRIC(Metric, return MetricPolicy::FromSquared(SquaredDistance, RangeBits));
+}
+
+/*static*/
+Word Word::FromCounters(const vector<int32_t>& counters, int RangeLen, bool& Conclusive)
 {
 	Conclusive = false;
 	int word_num_dims = counters.size() / (1 << RangeLen);
@@ -351,10 +428,7 @@ void Word::Serialize(ostream& stream)
 	STREAM_WRITE_INT16(stream, numSubWords);
 	STREAM_WRITE_INT16(stream, lastSubwordLen);
 
-	for (int i = 0; i < numSubWords; i++)
-	{
-		STREAM_WRITE_SUBWORD(stream, subwords[i]);
-	}
+	stream.write(reinterpret_cast<const char*>(subwords.data()), sizeof(SUBWORD) * numSubWords);
 }
 
 /**
@@ -370,12 +444,37 @@ Word::Word(istream& stream)
 	STREAM_READ_INT16(stream, numSubWords);
 	STREAM_READ_INT16(stream, lastSubwordLen);
 
-	SUBWORD sw;
-	for (int i = 0; i < numSubWords; i++)
-	{
-		STREAM_READ_SUBWORD(stream, sw);
-		subwords.push_back(sw);
-	}
+	subwords.resize(numSubWords);
+	stream.read(reinterpret_cast<char*>(subwords.data()), sizeof(SUBWORD) * numSubWords);
+
+	if (stream.fail())
+		throw exception("Input stream ended too early");
+}
+
+/*static*/
+void Word::SerializeSubwords(BufferedStreamWriter& Writer, int N, int RangeBits, const SUBWORD* Subwords)
+{
+	int num_subwords = SubwordsForLength(N, RangeBits);
+
+	Writer.Put(uint16_t(N));
+	Writer.Put(uint8_t(RangeBits));
+	Writer.Put(uint16_t(num_subwords));
+	Writer.Put(uint16_t(N * RangeBits % SUBWORD_NUM_BITS));
+	Writer.Write(Subwords, sizeof(SUBWORD) * num_subwords);
+}
+
+/*static*/
+void Word::DeserializeSubwords(BufferedStreamReader& Reader, int N, int RangeBits, SUBWORD* Out)
+{
+	uint16_t num_dims = Reader.Get<uint16_t>();
+	uint8_t range_bits = Reader.Get<uint8_t>();
+	uint16_t num_subwords = Reader.Get<uint16_t>();
+	Reader.Get<uint16_t>();
+
+	if (num_dims != N || range_bits != RangeBits || num_subwords != SubwordsForLength(N, RangeBits))
+		throw exception("Incompatible address word");
+
+	Reader.Read(Out, sizeof(SUBWORD) * num_subwords);
 }
 
 /*static*/
@@ -388,12 +487,11 @@ bool Word::RandomBit()
 }
 
 /*static*/
-void Word::RandomizeSubwords(vector<SUBWORD>& subwords)
+void Word::RandomizeSubwords(SUBWORD* subwords, int len)
 {
 	static uniform_int_distribution<SUBWORD> dist;
 	static mt19937 rng = CreateRng();
 
-	int len = subwords.size();
 	for (int i = 0; i < len; i++)
 	{
 		subwords[i] = dist(rng);
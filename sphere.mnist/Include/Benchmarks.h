@@ -0,0 +1,34 @@
+
+#pragma once
+
+namespace sphere
+{
+	// Times full scans over memories of random hard locations with the row-major and bit-sliced
+	// address layouts and checks that both activate the same hard locations as measuring every
+	// distance with Word::SquaredDistanceTo. Covers 4-bit words with dense random queries, 4-bit
+	// words with queries that are mostly zeros like the MNIST digits, and 1-bit words.
+	void BenchmarkAddressLayouts(int NumHardLocations, int NumQueries, int NumThreads);
+
+	// Times the hamming block kernels of every supported instruction set over a matrix of random
+	// 1-bit addresses, for MNIST sized words and for long ones, and checks they agree
+	void BenchmarkHammingKernels(int NumHardLocations, int NumQueries);
+
+	// Times the 4-bit distance kernels of every supported instruction set, byte-pair tables
+	// included, under both metrics and checks they agree
+	void BenchmarkDistanceKernels(int NumHardLocations, int NumQueries);
+
+	// Times batched writes and reads of 4-bit words for every combination of distance metric and
+	// counter policy
+	void BenchmarkPolicies(int NumHardLocations, int NumQueries, int NumThreads);
+
+	// Times the scheduling overhead of the thread pool: jobs of tiny tasks at several chunk sizes,
+	// a job whose task costs grow with their index, and empty jobs against spawning threads. Checks
+	// that every index runs exactly once.
+	void BenchmarkThreadPool(int NumTasks, int NumThreads, bool PinThreads);
+
+	// Saves and loads a memory of random hard locations, NumWrites of which have been written, in
+	// every file format and reports the throughput in MB/s of the file size. Loading a mapped file
+	// only maps it; its pages are read as the check that the loaded memory matches touches them.
+	// The check covers the counters and, in the formats that keep it, the write histogram.
+	void BenchmarkSerialization(int NumHardLocations, int NumWrites);
+}
@@ -8,11 +8,30 @@
 #define RANGE_BIT_LEN			4
 #define QUANTIZATION_LEVELS		16
 
-#if MANHATTAN_DISTANCE
-#define RADIUS					2933
-#else
-#define RADIUS					185
-#endif
+// Access radius and default imprint weight for each distance metric. The circular metrics use
+// those of their linear counterpart.
+#define RADIUS_EUCLIDEAN			185
+#define RADIUS_MANHATTAN			2933
+#define RADIUS_FOR(metric)			(sphere::LinearMetric(metric) == sphere::DistanceMetric::Manhattan ? RADIUS_MANHATTAN : RADIUS_EUCLIDEAN)
+
+#define IMPRINT_WEIGHT_EUCLIDEAN	0.28f
+#define IMPRINT_WEIGHT_MANHATTAN	0.70f
+#define IMPRINT_WEIGHT_FOR(metric)	(sphere::LinearMetric(metric) == sphere::DistanceMetric::Manhattan ? IMPRINT_WEIGHT_MANHATTAN : IMPRINT_WEIGHT_EUCLIDEAN)
 
 #define NUM_HARD_LOC			1'000'000
 #define TRAINING_SET_LIMIT		60'000
+
+// Number of images per batched read/write
+#define RW_BATCH_SIZE			32
+
+// Number of images between progress lines when training concurrently
+#define TRAIN_PROGRESS_INTERVAL	1000
+
+// Capacity of the queues between the stages of pipelined training
+#define PIPELINE_QUEUE_LEN		64
+
+// Number of IVF lists for the ivf-recall routine when --ivf-lists isn't given
+#define IVF_DEFAULT_LISTS		256
+
+// Number of LSH tables for the lsh-recall routine when neither --lsh-tables nor a saved --lsh-file is given
+#define LSH_DEFAULT_TABLES		8
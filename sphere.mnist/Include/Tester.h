@@ -2,6 +2,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "Sphere.h"
 #include "MNISTDataSet.h"
@@ -28,11 +29,22 @@ namespace sphere
 	public:
 		Tester(const std::string& ImagesFile, const std::string& LabelsFile);
 
-		RecallStats TestImages(sphere::Memory& sdm, int num_images);
+		RecallStats TestImages(sphere::Memory& sdm, int num_images, int nprobe = 0);
+
+		// Compares the hard locations activated by approximate IVF reads against the exact ones for
+		// increasing numbers of probed lists and logs the recall and speed of each
+		void MeasureActivationRecall(sphere::Memory& sdm, int num_images);
+
+		// Same for reads through the memory's LSH tables with increasing numbers of probed buckets
+		void MeasureLSHRecall(sphere::Memory& sdm, int num_images);
 
 		static uint8_t CueMemory(QuantizedImage& image, Memory& memory);
+		static uint8_t RecalledLabel(const Word& data, bool found);
 
 	private:
+		double FindExactActivations(sphere::Memory& sdm, int num_images, std::vector<Word>& addresses, std::vector<std::vector<uint32_t>>& exact);
+		double ActivationRecall(sphere::Memory& sdm, const std::vector<Word>& addresses, const std::vector<std::vector<uint32_t>>& exact, int nprobe, double& ms, double& evaluations);
+
 		MNISTDataSet data;
 		sphere::Memory sdm;
 	};
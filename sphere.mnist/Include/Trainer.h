@@ -7,6 +7,8 @@
 #include "Sphere.h"
 #include "MNISTDataSet.h"
 
+#define NUM_TRAINING_MODES 3
+
 namespace sphere
 {
 	struct HLStats
@@ -16,19 +18,37 @@ namespace sphere
 		int LabelPresence[10];	// Counts how many HLs a label is present in
 		int LabelWrites[10];	// Counts how many times a label has been written among all HLs
 		long TotalWrites;		// Total writes among all HLs
+		long HistoryWrites;		// Writes the label stats are taken from, see WriteHistoryMode
+		int SaturatedCounts;	// Histogram counts that reached UINT16_MAX and stopped counting
+		WriteHistoryMode HistoryMode;
 
 		HLStats();
 		void Print();
 	};
 
+	// How TrainMemory spreads the writes over threads
+	enum class TrainingMode
+	{
+		Batched,	// Batches in data set order, each spread over the memory's threads
+		Concurrent,	// Hogwild; every thread writes whole images, see Memory::BeginConcurrentWrites
+		Pipelined	// Building words, scanning and writing run as stages on their own threads
+	};
+
+	const char* TrainingModeName(TrainingMode Mode);
+	bool ParseTrainingMode(const std::string& Name, TrainingMode& Mode);
+
 	class Trainer
 	{
 	public:
 		Trainer();
-		Trainer(const std::string& ImagesFile, const std::string& LabelsFile, int NumHardLocations);
+		Trainer(const std::string& ImagesFile, const std::string& LabelsFile, int NumHardLocations, const MemoryPolicy& Policy = MemoryPolicy());
 		
 		void InitializeHardLocationsAddrs(float imprint_weight, float* label_weights, bool segment_imprints);
-		void TrainMemory(const char* filename, int start_from = 0, int limit = 0, int sanity_check = 0, int save_bitmaps = 0);
+		// Threads is the number of concurrent writers, or of scan stages when pipelined; 0 picks one
+		// per hardware thread. Batched and pipelined training write the images in data set order, so
+		// the trained memory is the same whatever the thread count. The memory is saved to filename
+		// in file_format, if given.
+		void TrainMemory(const char* filename, int start_from = 0, int limit = 0, int sanity_check = 0, int save_bitmaps = 0, TrainingMode mode = TrainingMode::Batched, int threads = 0, MemoryFileFormat file_format = MemoryFileFormat::Mapped);
 		void StopTraining();
 		bool IsTraining();
 
@@ -41,6 +61,12 @@ namespace sphere
 		sphere::MNISTDataSet& DataSet() { return data; }
 
 	private:
+		int TrainBatched(int training_limit);
+		int TrainConcurrently(int training_limit, int threads);
+		int TrainPipelined(int training_limit, int threads);
+		void ImprintHardLocations(int begin, int end, const Word& target, float imprint_weight, ThreadPool* pool);
+		Word LabelWord(const QuantizedImage& image);
+
 		MNISTDataSet data;
 		sphere::Memory sdm;
 
@@ -0,0 +1,526 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "Benchmarks.h"
+#include "Constants.h"
+#include "Sphere.h"
+#include "ThreadPool.h"
+
+using namespace std;
+using namespace sphere;
+
+// About 1% of random 1-bit hard locations are this close to a random 784-bit query
+#define BENCHMARK_HAMMING_RADIUS 360
+
+// Written to the working directory and removed afterwards
+#define BENCHMARK_MEMORY_FILE "serialization-bench.sph"
+
+struct LayoutBenchmarkCase
+{
+	const char* Name;
+	int RangeBits;
+	int Radius;
+	float ZeroShare;	// Share of query integers that are zero
+};
+
+static Word RandomQuery(mt19937& rng, int RangeBits, float ZeroShare)
+{
+	uniform_real_distribution<float> zero_dist(0.0f, 1.0f);
+	uniform_int_distribution<int> value_dist(1, (1 << RangeBits) - 1);
+
+	int num_subwords = Word::SubwordsForLength(WORD_NUM_DIMENSIONS, RangeBits);
+	int ints_per_sw = SUBWORD_NUM_BITS / RangeBits;
+	vector<SUBWORD> subwords(num_subwords, 0);
+
+	for (int i = 0; i < WORD_NUM_DIMENSIONS; i++)
+	{
+		if (zero_dist(rng) < ZeroShare)
+			continue;
+
+		int shift = SUBWORD_NUM_BITS - RangeBits * (i % ints_per_sw + 1);
+		subwords[i / ints_per_sw] |= SUBWORD(value_dist(rng)) << shift;
+	}
+
+	return Word::FromSubwords(WORD_NUM_DIMENSIONS, RangeBits, subwords.data());
+}
+
+// Activated hard locations measured one by one with Word's own distances, none of the scan's kernels
+// or cached norms, for checking the scans against
+static vector<vector<uint32_t>> BruteForceActivated(Memory& Sdm, int Radius, const vector<Word>& Queries)
+{
+	DistanceMetric metric = Sdm.Policy().Metric;
+	uint32_t radius_sq = Word::SquaredRadius(Radius, Sdm.RangeBitLength(), metric);
+
+	vector<Word> hl_addrs;
+	for (int i = 0; i < Sdm.NumHardLocations(); i++)
+		hl_addrs.push_back(Sdm.HardLocationAt(i).Address());
+
+	vector<vector<uint32_t>> activated(Queries.size());
+
+	for (size_t q = 0; q < Queries.size(); q++)
+	{
+		for (int i = 0; i < Sdm.NumHardLocations(); i++)
+		{
+			if (Queries[q].SquaredDistanceTo(hl_addrs[i], metric) <= radius_sq)
+				activated[q].push_back(i);
+		}
+	}
+
+	return activated;
+}
+
+void sphere::BenchmarkAddressLayouts(int NumHardLocations, int NumQueries, int NumThreads)
+{
+	const LayoutBenchmarkCase cases[] =
+	{
+		{ "4-bit, dense queries", RANGE_BIT_LEN, RADIUS_EUCLIDEAN, 0.0f },
+		{ "4-bit, sparse queries", RANGE_BIT_LEN, RADIUS_EUCLIDEAN, 0.8f },
+		{ "1-bit", 1, BENCHMARK_HAMMING_RADIUS, 0.0f },
+	};
+
+	mt19937 rng(0x5EED);
+
+	for (const LayoutBenchmarkCase& test_case : cases)
+	{
+		LOG_INFO("Benchmarking address layouts: %s, %d hard locations, %d queries", test_case.Name, NumHardLocations, NumQueries);
+
+		Memory sdm;
+		sdm.Initialize(WORD_NUM_DIMENSIONS, DATA_NUM_DIMENSIONS, test_case.RangeBits, NumHardLocations, test_case.Radius);
+		sdm.SetNumThreads(NumThreads);
+
+		vector<Word> queries;
+		for (int q = 0; q < NumQueries; q++)
+			queries.push_back(RandomQuery(rng, test_case.RangeBits, test_case.ZeroShare));
+
+		vector<vector<uint32_t>> activated[2];
+		const char* layout_names[2] = { "Row-major", "Bit-sliced" };
+
+		for (int layout = 0; layout < 2; layout++)
+		{
+			sdm.SetAddressLayout(layout == 0 ? AddressLayout::RowMajor : AddressLayout::BitSliced);
+
+			auto start = chrono::steady_clock::now();
+			for (const Word& query : queries)
+				activated[layout].push_back(sdm.FindActivated(query));
+
+			double single_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / NumQueries;
+
+			// Binary words can't be read back yet (see Word::FromCounters) so only 4-bit memories are
+			// timed batched, which is where the queries of a tile share the hard locations they load
+			double batch_ms = NAN;
+			if (test_case.RangeBits > 1)
+			{
+				start = chrono::steady_clock::now();
+				sdm.ReadBatch(queries);
+				batch_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / NumQueries;
+			}
+
+			long long activations = 0;
+			for (const vector<uint32_t>& query_activated : activated[layout])
+				activations += query_activated.size();
+
+			LOG_INFO("\t%s: %.2f ms per query, %.2f ms per query batched | %.1f activations per query",
+				layout_names[layout],
+				single_ms,
+				batch_ms,
+				double(activations) / NumQueries);
+		}
+
+		if (activated[0] != activated[1])
+			throw exception("Address layouts activated different hard locations");
+
+		if (activated[0] != BruteForceActivated(sdm, test_case.Radius, queries))
+			throw exception("Scans activated different hard locations than measuring each distance");
+	}
+}
+
+void sphere::BenchmarkHammingKernels(int NumHardLocations, int NumQueries)
+{
+	const int word_dims[] = { WORD_NUM_DIMENSIONS, 8192 };
+	const KernelISA isas[] = { KernelISA::Scalar, KernelISA::SSE4, KernelISA::AVX2, KernelISA::AVX512 };
+
+	for (int dims : word_dims)
+	{
+		LOG_INFO("Benchmarking hamming kernels: %d dimensions, %d hard locations, %d queries", dims, NumHardLocations, NumQueries);
+
+		// Rows are padded to 64 bytes like the address matrix of a Memory
+		int num_subwords = Word::SubwordsForLength(dims, 1);
+		size_t stride = (num_subwords + 15) / 16 * 16;
+
+		vector<SUBWORD> rows(stride * NumHardLocations);
+		Word::RandomizeSubwords(rows.data(), int(rows.size()));
+
+		vector<Word> queries;
+		for (int q = 0; q < NumQueries; q++)
+			queries.push_back(Word(dims, 1));
+
+		vector<uint32_t> reference;
+		vector<uint32_t> dists(size_t(NumHardLocations) * NumQueries);
+
+		for (KernelISA isa : isas)
+		{
+			if (!IsKernelSupported(isa))
+				continue;
+
+			const DistanceKernels& kernels = GetDistanceKernels(isa);
+
+			auto start = chrono::steady_clock::now();
+			for (int q = 0; q < NumQueries; q++)
+				kernels.HammingBlock(queries[q].Data(), rows.data(), stride, NumHardLocations, num_subwords, queries[q].LastSubwordMask(), &dists[size_t(q) * NumHardLocations]);
+
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / NumQueries;
+			double gb_per_sec = double(NumHardLocations) * num_subwords * sizeof(SUBWORD) / (ms * 1e6);
+
+			LOG_INFO("\t%s: %.2f ms per query | %.1f GB/s", kernels.Name, ms, gb_per_sec);
+
+			if (reference.empty())
+				reference = dists;
+			else if (dists != reference)
+				throw exception("Hamming kernels disagree");
+		}
+	}
+}
+
+void sphere::BenchmarkDistanceKernels(int NumHardLocations, int NumQueries)
+{
+	const KernelISA isas[] = { KernelISA::Scalar, KernelISA::BytePair, KernelISA::SSE4, KernelISA::AVX2, KernelISA::AVX512 };
+	mt19937 rng(0x5EED);
+
+	// Rows are padded to 64 bytes like the address matrix of a Memory
+	int num_subwords = Word::SubwordsForLength(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN);
+	size_t stride = (num_subwords + 15) / 16 * 16;
+
+	vector<SUBWORD> rows(stride * NumHardLocations);
+	Word::RandomizeSubwords(rows.data(), int(rows.size()));
+
+	vector<Word> queries;
+	for (int q = 0; q < NumQueries; q++)
+		queries.push_back(RandomQuery(rng, RANGE_BIT_LEN, 0.8f));
+
+	for (int metric = 0; metric < NUM_DISTANCE_METRICS; metric++)
+	{
+		LOG_INFO("Benchmarking 4-bit distance kernels: %s distance, %d hard locations, %d queries", DistanceMetricName(DistanceMetric(metric)), NumHardLocations, NumQueries);
+
+		vector<uint32_t> reference;
+		vector<uint32_t> dists(size_t(NumHardLocations) * NumQueries);
+
+		for (KernelISA isa : isas)
+		{
+			if (!IsKernelSupported(isa))
+				continue;
+
+			const DistanceKernels& kernels = GetDistanceKernels(isa);
+			NibbleDistanceFunc distance = kernels.NibbleDistance[metric];
+
+			auto start = chrono::steady_clock::now();
+			for (int q = 0; q < NumQueries; q++)
+			{
+				for (int i = 0; i < NumHardLocations; i++)
+					dists[size_t(q) * NumHardLocations + i] = distance(queries[q].Data(), rows.data() + i * stride, num_subwords);
+			}
+
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / NumQueries;
+			double gb_per_sec = double(NumHardLocations) * num_subwords * sizeof(SUBWORD) / (ms * 1e6);
+
+			LOG_INFO("\t%s: %.2f ms per query | %.1f GB/s", kernels.Name, ms, gb_per_sec);
+
+			if (reference.empty())
+				reference = dists;
+			else if (dists != reference)
+				throw exception("Distance kernels disagree");
+		}
+	}
+}
+
+void sphere::BenchmarkPolicies(int NumHardLocations, int NumQueries, int NumThreads)
+{
+	mt19937 rng(0x5EED);
+
+	vector<Word> hl_addrs;
+	for (int i = 0; i < NumHardLocations; i++)
+		hl_addrs.push_back(Word(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN));
+
+	// Words are stored autoassociatively, at their own address
+	vector<Word> addrs;
+	for (int q = 0; q < NumQueries; q++)
+		addrs.push_back(RandomQuery(rng, RANGE_BIT_LEN, 0.8f));
+
+	for (int metric = 0; metric < NUM_DISTANCE_METRICS; metric++)
+	{
+		MemoryPolicy policy;
+		policy.Metric = DistanceMetric(metric);
+
+		// The radii of the MNIST routines are tuned for imprinted addresses; over random ones the
+		// radius is set so the first query activates about 1% of the hard locations
+		vector<float> dists(NumHardLocations);
+		for (int i = 0; i < NumHardLocations; i++)
+			dists[i] = addrs[0].DistanceTo(hl_addrs[i], policy.Metric);
+
+		nth_element(dists.begin(), dists.begin() + NumHardLocations / 100, dists.end());
+		int radius = int(ceilf(dists[NumHardLocations / 100]));
+
+		for (int mode = 0; mode < NUM_COUNTER_MODES; mode++)
+		{
+			policy.Counters = CounterMode(mode);
+
+			LOG_INFO("Benchmarking policies: %s distance, %s counters, %d hard locations, %d queries",
+				DistanceMetricName(policy.Metric),
+				CounterModeName(policy.Counters),
+				NumHardLocations,
+				NumQueries);
+
+			Memory sdm(policy);
+			sdm.InitializeFixedHardLocations(WORD_NUM_DIMENSIONS, WORD_NUM_DIMENSIONS, RANGE_BIT_LEN, NumHardLocations, radius, hl_addrs);
+			sdm.SetNumThreads(NumThreads);
+
+			auto start = chrono::steady_clock::now();
+			vector<RWStats> write_stats = sdm.WriteBatch(addrs, addrs);
+			double write_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / NumQueries;
+
+			start = chrono::steady_clock::now();
+			sdm.ReadBatch(addrs);
+			double read_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / NumQueries;
+
+			long long activations = 0;
+			for (const RWStats& stats : write_stats)
+				activations += stats.Activations;
+
+			LOG_INFO("\tRadius %d: %.2f ms per write, %.2f ms per read | %.1f activations per query",
+				radius,
+				write_ms,
+				read_ms,
+				double(activations) / NumQueries);
+		}
+	}
+}
+
+// Stands in for a task that does next to nothing
+static inline void TinyTask(vector<uint32_t>& Visits, int Index)
+{
+	Visits[Index] += uint32_t(Index) * 2654435761u | 1;
+}
+
+static void CheckVisits(vector<uint32_t>& Visits, int Times)
+{
+	for (size_t i = 0; i < Visits.size(); i++)
+	{
+		if (Visits[i] != (uint32_t(i) * 2654435761u | 1) * Times)
+			throw exception("Thread pool skipped or repeated a task");
+	}
+}
+
+void sphere::BenchmarkThreadPool(int NumTasks, int NumThreads, bool PinThreads)
+{
+	if (NumThreads <= 0)
+		NumThreads = ThreadPool::HardwareThreads();
+
+	LOG_INFO("Benchmarking thread pool: %d threads%s, %d tasks", NumThreads, PinThreads ? " (pinned)" : "", NumTasks);
+
+	ThreadPool pool(NumThreads, PinThreads);
+	vector<uint32_t> visits(NumTasks, 0);
+	int runs = 0;
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < NumTasks; i++)
+		TinyTask(visits, i);
+	double serial_ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / NumTasks;
+	runs++;
+
+	LOG_INFO("\tSerial loop: %.2f ns per task", serial_ns);
+
+	start = chrono::steady_clock::now();
+	pool.Run(NumTasks, [&](int Task, int Thread)
+	{
+		TinyTask(visits, Task);
+	});
+	double run_ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / NumTasks;
+	runs++;
+
+	LOG_INFO("\tRun: %.2f ns per task", run_ns);
+
+	for (int grain : { 1, 16, 256, 4096 })
+	{
+		start = chrono::steady_clock::now();
+		pool.ParallelFor(0, NumTasks, grain, [&](int Begin, int End, int Thread)
+		{
+			for (int i = Begin; i < End; i++)
+				TinyTask(visits, i);
+		});
+		double for_ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / NumTasks;
+		runs++;
+
+		LOG_INFO("\tParallelFor, grain %d: %.2f ns per task", grain, for_ns);
+	}
+
+	CheckVisits(visits, runs);
+
+	// Task i costs about i units, so the threads that were dealt the front of the range run dry
+	// early and have to steal to keep busy
+	int num_skewed = MIN(NumTasks, 4096);
+	vector<double> sums(num_skewed, 0.0);
+	auto skewed_task = [&](int Task, int Thread)
+	{
+		double sum = 0.0;
+		for (int i = 0; i <= Task * 16; i++)
+			sum += sqrt(double(i));
+		sums[Task] = sum;
+	};
+
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < num_skewed; i++)
+		skewed_task(i, 0);
+	double skewed_serial_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	start = chrono::steady_clock::now();
+	pool.Run(num_skewed, skewed_task);
+	double skewed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	LOG_INFO("\tSkewed tasks: %.2f ms serial, %.2f ms on the pool (%.2fx)", skewed_serial_ms, skewed_ms, skewed_serial_ms / skewed_ms);
+
+	// Per job cost with nothing to do, which is what every small read or write pays
+	const int num_jobs = 1000;
+
+	start = chrono::steady_clock::now();
+	for (int job = 0; job < num_jobs; job++)
+		pool.Run(NumThreads, [](int Task, int Thread) {});
+	double job_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / num_jobs;
+
+	start = chrono::steady_clock::now();
+	for (int job = 0; job < num_jobs / 10; job++)
+	{
+		vector<thread> threads;
+		for (int t = 1; t < NumThreads; t++)
+			threads.push_back(thread([] {}));
+
+		for (thread& t : threads)
+			t.join();
+	}
+	double spawn_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / (num_jobs / 10);
+
+	LOG_INFO("\tEmpty job: %.2f us on the pool, %.2f us spawning threads", job_us, spawn_us);
+}
+
+// Compares the policies, addresses, write counts and counters, and the write histories too when
+// CompareHistories is set; sparse files don't keep them
+static bool SameMemories(Memory& A, Memory& B, bool CompareHistories)
+{
+	const MemoryPolicy& policy = A.Policy();
+
+	if (policy.Metric != B.Policy().Metric || policy.Counters != B.Policy().Counters || policy.History != B.Policy().History)
+		return false;
+
+	if (A.NumHardLocations() != B.NumHardLocations() || A.NumCounterRows() != B.NumCounterRows())
+		return false;
+
+	size_t addr_bytes = sizeof(SUBWORD) * Word::SubwordsForLength(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN);
+
+	// A hard location reads its own counters back unchanged; ones without counters read as zeros
+	int num_counters = DATA_NUM_DIMENSIONS * (1 << RANGE_BIT_LEN);
+	vector<int32_t> counters_a(num_counters);
+	vector<int32_t> counters_b(num_counters);
+
+	uint32_t histogram_a[WRITE_HISTORY_VALUES];
+	uint32_t histogram_b[WRITE_HISTORY_VALUES];
+
+	for (int i = 0; i < A.NumHardLocations(); i++)
+	{
+		HardLocation a = A.HardLocationAt(i);
+		HardLocation b = B.HardLocationAt(i);
+
+		if (a.WriteCount() != b.WriteCount() || memcmp(a.AddressData(), b.AddressData(), addr_bytes) != 0)
+			return false;
+
+		fill(counters_a.begin(), counters_a.end(), 0);
+		fill(counters_b.begin(), counters_b.end(), 0);
+		a.Read(counters_a.data());
+		b.Read(counters_b.data());
+
+		if (counters_a != counters_b)
+			return false;
+
+		if (CompareHistories && a.WriteHistogram(histogram_a))
+		{
+			b.WriteHistogram(histogram_b);
+
+			if (memcmp(histogram_a, histogram_b, sizeof(histogram_a)) != 0 || a.WriteHistory() != b.WriteHistory())
+				return false;
+		}
+	}
+
+	return true;
+}
+
+void sphere::BenchmarkSerialization(int NumHardLocations, int NumWrites)
+{
+	namespace fs = std::filesystem;
+
+	mt19937 rng(0x5EED);
+
+	vector<Word> hl_addrs;
+	for (int i = 0; i < NumHardLocations; i++)
+		hl_addrs.push_back(Word(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN));
+
+	vector<Word> addrs;
+	vector<Word> data;
+	for (int i = 0; i < NumWrites; i++)
+	{
+		addrs.push_back(RandomQuery(rng, RANGE_BIT_LEN, 0.8f));
+		data.push_back(Word(DATA_NUM_DIMENSIONS, RANGE_BIT_LEN));
+	}
+
+	// As in BenchmarkPolicies, each write activates about 1% of the hard locations
+	vector<float> dists(NumHardLocations);
+	for (int i = 0; i < NumHardLocations; i++)
+		dists[i] = addrs[0].DistanceTo(hl_addrs[i]);
+
+	nth_element(dists.begin(), dists.begin() + NumHardLocations / 100, dists.end());
+	int radius = int(ceilf(dists[NumHardLocations / 100]));
+
+	// With a write history so the formats that keep one are checked for it
+	MemoryPolicy policy;
+	policy.History = WriteHistoryMode::Histogram;
+
+	Memory sdm(policy);
+	sdm.InitializeFixedHardLocations(WORD_NUM_DIMENSIONS, DATA_NUM_DIMENSIONS, RANGE_BIT_LEN, NumHardLocations, radius, hl_addrs);
+	sdm.WriteBatch(addrs, data);
+
+	LOG_INFO("Benchmarking serialization: %d hard locations, %d with counters", NumHardLocations, sdm.NumCounterRows());
+
+	for (int format = 0; format < NUM_MEMORY_FILE_FORMATS; format++)
+	{
+		auto start = chrono::steady_clock::now();
+		sdm.SaveToFile(BENCHMARK_MEMORY_FILE, MemoryFileFormat(format));
+		double save_sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		double file_mb = double(fs::file_size(BENCHMARK_MEMORY_FILE)) / (1024 * 1024);
+		bool same;
+
+		{
+			start = chrono::steady_clock::now();
+			Memory loaded = Memory::LoadFromFile(BENCHMARK_MEMORY_FILE, policy);
+			double load_sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			same = SameMemories(sdm, loaded, MemoryFileFormat(format) != MemoryFileFormat::Sparse);
+
+			LOG_INFO("\t%s: %.1f MB | save %.2f s, %.1f MB/s | load %.2f s, %.1f MB/s",
+				MemoryFileFormatName(MemoryFileFormat(format)),
+				file_mb,
+				save_sec,
+				file_mb / save_sec,
+				load_sec,
+				file_mb / load_sec);
+		}
+
+		fs::remove(BENCHMARK_MEMORY_FILE);
+
+		if (!same)
+			throw exception("Loaded memory doesn't match the saved one");
+	}
+}
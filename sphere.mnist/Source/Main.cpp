@@ -11,6 +11,7 @@
 
 #include <windows.h>
 
+#include "Benchmarks.h"
 #include "Trainer.h"
 #include "Tester.h"
 #include "Constants.h"
@@ -29,12 +30,18 @@ struct ProgramParams
 	int SaveVisuals = 0;
 	int AdjustWeights = 1;
 	int SegmentImprints = 1;
-
-#if MANHATTAN_DISTANCE
-	float ImprintWeight = 0.70f;
-#else
-	float ImprintWeight = 0.28f;
-#endif
+	int ExactStats = 0;
+	int Threads = 0;
+	int UseIndex = 0;
+	int IVFLists = 0;
+	int NProbe = 0;
+	int LSHTables = 0;
+	int LSHProbes = 0;
+	int BitSliced = 0;
+	int PinThreads = 0;
+	int TrainThreads = 0;
+
+	float ImprintWeight = 0.0f;		// Default of the metric when not given
 	string InputImages1 = string("train-images.idx3-ubyte");
 	string InputLabels1 = string("train-labels.idx1-ubyte");
 
@@ -42,8 +49,20 @@ struct ProgramParams
 	string InputLabels2 = string("t10k-labels.idx1-ubyte");
 
 	string MemFile = string("mnist.sph");
+	string OutFile = string("mnist-converted.sph");
+	string LSHFile;					// LSH tables to load, or to save once built
+	string FileFormat = string("Mapped");
+	string Kernel;
+	string Metric = string("Euclidean");
+	string Counters = string("Saturating");
+	string History = string("Histogram");
+	string TrainMode;				// Batched, or concurrent when --train-threads is given
 } params;
 
+MemoryPolicy policy;
+TrainingMode trainMode = TrainingMode::Batched;
+MemoryFileFormat fileFormat = MemoryFileFormat::Mapped;
+
 Trainer* trainer = nullptr;
 
 float weights[10] =
@@ -95,31 +114,74 @@ BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
 	return FALSE;
 }
 
+/**
+ Sets up approximate access through LSH tables for a read-only routine. The tables are loaded from
+ --lsh-file when it exists, otherwise built with --lsh-tables (or DefaultTables) and saved there if
+ a file was given. Does nothing unless one of the two is given or DefaultTables is set.
+*/
+void PrepareLSH(Memory& sdm, int DefaultTables)
+{
+	int num_tables = params.LSHTables > 0 ? params.LSHTables : DefaultTables;
+
+	if (!params.LSHFile.empty() && std::filesystem::exists(params.LSHFile))
+	{
+		sdm.LoadLSH(params.LSHFile);
+	}
+	else if (num_tables > 0)
+	{
+		sdm.BuildLSH(num_tables);
+
+		if (!params.LSHFile.empty())
+			sdm.SaveLSH(params.LSHFile);
+	}
+	else
+	{
+		return;
+	}
+
+	sdm.SetLSHProbes(params.LSHProbes);
+	sdm.EnableLSH(true);
+}
+
 void TrainAndRecall()
 {
 	LOG_INFO("Training with data set: %s + %s", params.InputImages1.c_str(), params.InputLabels1.c_str());
 
-	trainer = new Trainer(params.InputImages1, params.InputLabels1, params.NumHardLocations);
+	trainer = new Trainer(params.InputImages1, params.InputLabels1, params.NumHardLocations, policy);
+	trainer->Memory().SetExactStats(params.ExactStats);
+	trainer->Memory().SetNumThreads(params.Threads, params.PinThreads);
 
 	float* in_weights = params.AdjustWeights ? weights : nullptr;
 	trainer->InitializeHardLocationsAddrs(params.ImprintWeight, in_weights, params.SegmentImprints);
 
-	trainer->TrainMemory(nullptr, 0, params.TrainingCount, params.LogDistances, params.SaveVisuals);
+	if (params.UseIndex)
+		trainer->Memory().BuildIndex();
+
+	if (params.BitSliced)
+		trainer->Memory().SetAddressLayout(AddressLayout::BitSliced);
+
+	trainer->TrainMemory(nullptr, 0, params.TrainingCount, params.LogDistances, params.SaveVisuals, trainMode, params.TrainThreads, fileFormat);
+
+	if (params.IVFLists > 0)
+		trainer->Memory().BuildIVF(params.IVFLists);
+
+	// Only the recalls are approximate; training always writes every activated hard location
+	PrepareLSH(trainer->Memory(), 0);
 
 	LOG_INFO("Recalling with learned data");
 	Tester tester1(params.InputImages1, params.InputLabels1);
-	auto results1 = tester1.TestImages(trainer->Memory(), params.RecallCount);
+	auto results1 = tester1.TestImages(trainer->Memory(), params.RecallCount, params.NProbe);
 	results1.Print();
 
 	LOG_INFO("Recalling with unlearned data: %s + %s", params.InputImages2.c_str(), params.InputLabels2.c_str());
 	Tester tester2(params.InputImages2, params.InputLabels2);
-	auto results2 = tester2.TestImages(trainer->Memory(), params.RecallCount);
+	auto results2 = tester2.TestImages(trainer->Memory(), params.RecallCount, params.NProbe);
 
 	results2.Print();
 
 	if (!params.MemFile.empty())
 	{
-		trainer->Memory().SaveToFile(params.MemFile);
+		trainer->Memory().SaveToFile(params.MemFile, fileFormat);
 	}
 }
 
@@ -127,12 +189,20 @@ void TrainMemory()
 {
 	LOG_INFO("Training with data set 1: %s + %s", params.InputImages1.c_str(), params.InputLabels1.c_str());
 
-	trainer = new Trainer(params.InputImages1, params.InputLabels1, params.NumHardLocations);
+	trainer = new Trainer(params.InputImages1, params.InputLabels1, params.NumHardLocations, policy);
+	trainer->Memory().SetExactStats(params.ExactStats);
+	trainer->Memory().SetNumThreads(params.Threads, params.PinThreads);
 
 	float* in_weights = params.AdjustWeights ? weights : nullptr;
 	trainer->InitializeHardLocationsAddrs(params.ImprintWeight, in_weights, false);
 
-	trainer->TrainMemory(params.MemFile.c_str(), 0, params.TrainingCount, params.LogDistances, params.SaveVisuals);
+	if (params.UseIndex)
+		trainer->Memory().BuildIndex();
+
+	if (params.BitSliced)
+		trainer->Memory().SetAddressLayout(AddressLayout::BitSliced);
+
+	trainer->TrainMemory(params.MemFile.c_str(), 0, params.TrainingCount, params.LogDistances, params.SaveVisuals, trainMode, params.TrainThreads, fileFormat);
 }
 
 void Recall()
@@ -140,26 +210,104 @@ void Recall()
 	LOG_INFO("Testing trained memory with data set: %s + %s", params.InputImages2.c_str(), params.InputLabels2.c_str());
 
 	LOG_INFO("Loading memory: %s", params.MemFile.c_str());
-	auto sdm = Memory::LoadFromFile(params.MemFile);
+	auto sdm = Memory::LoadFromFile(params.MemFile, policy);
+	sdm.SetExactStats(params.ExactStats);
+	sdm.SetNumThreads(params.Threads, params.PinThreads);
+
+	if (params.UseIndex)
+		sdm.BuildIndex();
+
+	if (params.BitSliced)
+		sdm.SetAddressLayout(AddressLayout::BitSliced);
+
+	if (params.IVFLists > 0)
+		sdm.BuildIVF(params.IVFLists);
+
+	PrepareLSH(sdm, 0);
 
 	Tester tester(params.InputImages2, params.InputLabels2);
-	auto results = tester.TestImages(sdm, params.TrainingCount);
+	auto results = tester.TestImages(sdm, params.TrainingCount, params.NProbe);
 	results.Print();
 }
 
+void MeasureIVFRecall()
+{
+	LOG_INFO("Measuring IVF activation recall with data set: %s + %s", params.InputImages2.c_str(), params.InputLabels2.c_str());
+
+	LOG_INFO("Loading memory: %s", params.MemFile.c_str());
+	auto sdm = Memory::LoadFromFile(params.MemFile, policy);
+	sdm.SetNumThreads(params.Threads, params.PinThreads);
+	sdm.BuildIVF(params.IVFLists > 0 ? params.IVFLists : IVF_DEFAULT_LISTS);
+
+	Tester tester(params.InputImages2, params.InputLabels2);
+	tester.MeasureActivationRecall(sdm, params.RecallCount);
+}
+
+void MeasureLSHRecall()
+{
+	LOG_INFO("Measuring LSH activation recall with data set: %s + %s", params.InputImages2.c_str(), params.InputLabels2.c_str());
+
+	LOG_INFO("Loading memory: %s", params.MemFile.c_str());
+	auto sdm = Memory::LoadFromFile(params.MemFile, policy);
+	sdm.SetNumThreads(params.Threads, params.PinThreads);
+	PrepareLSH(sdm, LSH_DEFAULT_TABLES);
+
+	Tester tester(params.InputImages2, params.InputLabels2);
+	tester.MeasureLSHRecall(sdm, params.RecallCount);
+}
+
+void BenchmarkLayouts()
+{
+	BenchmarkAddressLayouts(params.NumHardLocations, params.RecallCount, params.Threads);
+}
+
+void BenchmarkHamming()
+{
+	BenchmarkHammingKernels(params.NumHardLocations, params.RecallCount);
+}
+
+void BenchmarkDistances()
+{
+	BenchmarkDistanceKernels(params.NumHardLocations, params.RecallCount);
+}
+
+void BenchmarkPolicyCombinations()
+{
+	BenchmarkPolicies(params.NumHardLocations, params.RecallCount, params.Threads);
+}
+
+void BenchmarkPool()
+{
+	BenchmarkThreadPool(params.NumHardLocations, params.Threads, params.PinThreads);
+}
+
+void BenchmarkFileFormats()
+{
+	BenchmarkSerialization(params.NumHardLocations, params.RecallCount);
+}
+
 void TestSerialization()
 {
 	TrainMemory();
 
 	LOG_INFO("Loading memory from file: %s", params.MemFile.c_str());
-	Memory mem = Memory::LoadFromFile(params.MemFile);
+	Memory mem = Memory::LoadFromFile(params.MemFile, policy);
 
 	LOG_INFO("Saving memory back to file: mnist2.sph");
-	mem.SaveToFile("mnist2.sph");
+	mem.SaveToFile("mnist2.sph", fileFormat);
 
 	// Compare the hash of the two files
 }
 
+void ConvertMemory()
+{
+	LOG_INFO("Loading memory: %s", params.MemFile.c_str());
+	Memory mem = Memory::LoadFromFile(params.MemFile, policy);
+
+	LOG_INFO("Saving memory as %s: %s", MemoryFileFormatName(fileFormat), params.OutFile.c_str());
+	mem.SaveToFile(params.OutFile, fileFormat);
+}
+
 
 int main(int argc, char** argv)
 {
@@ -174,6 +322,15 @@ int main(int argc, char** argv)
 	routines.push_back(Subroutine("recall", &Recall));
 	routines.push_back(Subroutine("train_recall", &TrainAndRecall));
 	routines.push_back(Subroutine("serialization-test", &TestSerialization));
+	routines.push_back(Subroutine("convert", &ConvertMemory));
+	routines.push_back(Subroutine("ivf-recall", &MeasureIVFRecall));
+	routines.push_back(Subroutine("lsh-recall", &MeasureLSHRecall));
+	routines.push_back(Subroutine("layout-bench", &BenchmarkLayouts));
+	routines.push_back(Subroutine("hamming-bench", &BenchmarkHamming));
+	routines.push_back(Subroutine("distance-bench", &BenchmarkDistances));
+	routines.push_back(Subroutine("policy-bench", &BenchmarkPolicyCombinations));
+	routines.push_back(Subroutine("pool-bench", &BenchmarkPool));
+	routines.push_back(Subroutine("serialization-bench", &BenchmarkFileFormats));
 
 	vector<string> args;
 	for (int i = 0; i < argc; i++)
@@ -206,9 +363,76 @@ int main(int argc, char** argv)
 		PARSE_FLT_ARG(args[i], string("--adjust-weights="), AdjustWeights);
 		PARSE_INT_ARG(args[i], string("--log-distances="), LogDistances);
 		PARSE_INT_ARG(args[i], string("--save-visuals="), SaveVisuals);
+		PARSE_INT_ARG(args[i], string("--exact-stats="), ExactStats);
+		PARSE_INT_ARG(args[i], string("--threads="), Threads);
+		PARSE_INT_ARG(args[i], string("--pin-threads="), PinThreads);
+		PARSE_INT_ARG(args[i], string("--train-threads="), TrainThreads);
+		PARSE_INT_ARG(args[i], string("--index="), UseIndex);
+		PARSE_INT_ARG(args[i], string("--ivf-lists="), IVFLists);
+		PARSE_INT_ARG(args[i], string("--nprobe="), NProbe);
+		PARSE_INT_ARG(args[i], string("--lsh-tables="), LSHTables);
+		PARSE_INT_ARG(args[i], string("--lsh-probes="), LSHProbes);
+		PARSE_INT_ARG(args[i], string("--bit-sliced="), BitSliced);
 		PARSE_STR_ARG(args[i], string("--images="), InputImages1);
 		PARSE_STR_ARG(args[i], string("--labels="), InputLabels1);
 		PARSE_STR_ARG(args[i], string("--file="), MemFile);
+		PARSE_STR_ARG(args[i], string("--out="), OutFile);
+		PARSE_STR_ARG(args[i], string("--lsh-file="), LSHFile);
+		PARSE_STR_ARG(args[i], string("--file-format="), FileFormat);
+		PARSE_STR_ARG(args[i], string("--kernel="), Kernel);
+		PARSE_STR_ARG(args[i], string("--metric="), Metric);
+		PARSE_STR_ARG(args[i], string("--counters="), Counters);
+		PARSE_STR_ARG(args[i], string("--history="), History);
+		PARSE_STR_ARG(args[i], string("--train-mode="), TrainMode);
+	}
+
+	if (!ParseDistanceMetric(params.Metric, policy.Metric))
+	{
+		cout << "Unknown distance metric: " << params.Metric << endl;
+		return 1;
+	}
+
+	if (!ParseCounterMode(params.Counters, policy.Counters))
+	{
+		cout << "Unknown counter mode: " << params.Counters << endl;
+		return 1;
+	}
+
+	if (!ParseWriteHistoryMode(params.History, policy.History))
+	{
+		cout << "Unknown write history mode: " << params.History << endl;
+		return 1;
+	}
+
+	if (!ParseMemoryFileFormat(params.FileFormat, fileFormat))
+	{
+		cout << "Unknown memory file format: " << params.FileFormat << endl;
+		return 1;
+	}
+
+	if (params.TrainMode.empty())
+	{
+		trainMode = params.TrainThreads > 0 ? TrainingMode::Concurrent : TrainingMode::Batched;
+	}
+	else if (!ParseTrainingMode(params.TrainMode, trainMode))
+	{
+		cout << "Unknown training mode: " << params.TrainMode << endl;
+		return 1;
+	}
+
+	if (params.ImprintWeight <= 0)
+		params.ImprintWeight = IMPRINT_WEIGHT_FOR(policy.Metric);
+
+	if (!params.Kernel.empty())
+	{
+		KernelISA isa;
+		if (!ParseKernelISA(params.Kernel, isa) || !IsKernelSupported(isa))
+		{
+			cout << "Unsupported distance kernel: " << params.Kernel << endl;
+			return 1;
+		}
+
+		SelectDistanceKernels(isa);
 	}
 
 	if (SetConsoleCtrlHandler(CtrlHandler, TRUE) == 0)
@@ -247,7 +471,12 @@ int main(int argc, char** argv)
 	LOG_INFO("\tData set 1: %s + %s", params.InputImages1.c_str(), params.InputLabels1.c_str());
 	LOG_INFO("\tData set 2: %s + %s", params.InputImages2.c_str(), params.InputLabels2.c_str());
 	LOG_INFO("\tFile: %s", params.MemFile.c_str());
-	LOG_INFO("\tAccess Sphere Radius: %d", RADIUS);
+	LOG_INFO("\tFile format: %s", MemoryFileFormatName(fileFormat));
+	LOG_INFO("\tAccess Sphere Radius: %d", RADIUS_FOR(policy.Metric));
+	LOG_INFO("\tDistance metric: %s", DistanceMetricName(policy.Metric));
+	LOG_INFO("\tCounters: %s", CounterModeName(policy.Counters));
+	LOG_INFO("\tWrite history: %s", WriteHistoryModeName(policy.History));
+	LOG_INFO("\tDistance kernels: %s", GetDistanceKernels().Name);
 	LOG_INFO("\tHard locations: %d", params.NumHardLocations);
 	LOG_INFO("\tImprint weight: %.3f", params.ImprintWeight);
 	LOG_INFO("\tSegment imprints: %d", params.SegmentImprints);
@@ -257,6 +486,15 @@ int main(int argc, char** argv)
 	LOG_INFO("\tStart from: %d", params.StartFrom);
 	LOG_INFO("\tImage distances to log: %d", params.LogDistances);
 	LOG_INFO("\tVisual bitmaps to save: %d", params.SaveVisuals);
+	LOG_INFO("\tExact distance stats: %d", params.ExactStats);
+	LOG_INFO("\tScan threads: %d (0 = all)", params.Threads);
+	LOG_INFO("\tPin threads: %d", params.PinThreads);
+	LOG_INFO("\tTraining mode: %s", TrainingModeName(trainMode));
+	LOG_INFO("\tTraining threads: %d (0 = all)", params.TrainThreads);
+	LOG_INFO("\tVP-tree index: %d", params.UseIndex);
+	LOG_INFO("\tIVF lists: %d (nprobe: %d)", params.IVFLists, params.NProbe);
+	LOG_INFO("\tLSH tables: %d (probes: %d, file: %s)", params.LSHTables, params.LSHProbes, params.LSHFile.empty() ? "none" : params.LSHFile.c_str());
+	LOG_INFO("\tBit-sliced addresses: %d", params.BitSliced);
 
 	try
 	{
@@ -1,5 +1,8 @@
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <iterator>
 
 #include "Constants.h"
 #include "Common.h"
@@ -15,7 +18,7 @@ Tester::Tester(const std::string& ImagesFile, const std::string& LabelsFile)
 {
 }
 
-RecallStats Tester::TestImages(sphere::Memory& sdm, int limit)
+RecallStats Tester::TestImages(sphere::Memory& sdm, int limit, int nprobe)
 {
 	RecallStats stats;
 	int freq_counter[10];
@@ -23,11 +26,30 @@ RecallStats Tester::TestImages(sphere::Memory& sdm, int limit)
 	limit = limit > 0 && limit <= data.Images.size() ? limit : data.Images.size();
 	LOG_INFO("Recalling %d images", limit);
 
+	// Images are recalled in batches so each block of hard locations is scanned once per batch
+	vector<ReadResult> results;
+	long long evaluations = 0;
+
 	for (int img_idx = 0; img_idx < limit; img_idx++)
 	{
+		int batch_idx = img_idx % RW_BATCH_SIZE;
+
+		if (batch_idx == 0)
+		{
+			vector<Word> addresses;
+			for (int i = img_idx; i < limit && i < img_idx + RW_BATCH_SIZE; i++)
+			{
+				QuantizedImage& batch_image = data.Images[i];
+				addresses.push_back(Word(batch_image.NumPixels, sdm.RangeBitLength(), batch_image.Data, batch_image.Length));
+			}
+
+			results = sdm.ReadBatch(addresses, nprobe);
+		}
+
 		QuantizedImage& image = data.Images[img_idx];
 
-		uint8_t recall = CueMemory(image, sdm);
+		uint8_t recall = RecalledLabel(results[batch_idx].Data, results[batch_idx].Conclusive);
+		evaluations += results[batch_idx].Stats.DistanceEvaluations;
 
 		if (recall != 0xFF)
 		{
@@ -51,18 +73,144 @@ RecallStats Tester::TestImages(sphere::Memory& sdm, int limit)
 		stats.Scores[image.Label].Total++;
 	}
 
+	if (limit > 0)
+		LOG_INFO("Average distance evaluations per read: %.1f of %d hard locations", double(evaluations) / limit, sdm.NumHardLocations());
+
 	return stats;
 }
 
-uint8_t Tester::CueMemory(QuantizedImage& image, Memory& memory)
+void Tester::MeasureActivationRecall(sphere::Memory& sdm, int limit)
 {
-	static int freq_counter[10];
+	if (sdm.NumIVFLists() == 0)
+		throw exception("Memory has no IVF lists to measure");
+
+	vector<Word> addresses;
+	vector<vector<uint32_t>> exact;
+	double exact_ms = FindExactActivations(sdm, limit, addresses, exact);
+
+	for (int nprobe = 1; ; nprobe = MIN(nprobe * 2, sdm.NumIVFLists()))
+	{
+		double ms, evaluations;
+		double recall = ActivationRecall(sdm, addresses, exact, nprobe, ms, evaluations);
+
+		LOG_INFO("nprobe %d of %d: activation recall %.4f | %.2f ms per query (%.1fx) | %.0f distance evaluations per query",
+			nprobe,
+			sdm.NumIVFLists(),
+			recall,
+			ms,
+			exact_ms / ms,
+			evaluations);
+
+		if (nprobe == sdm.NumIVFLists())
+			break;
+	}
+}
+
+void Tester::MeasureLSHRecall(sphere::Memory& sdm, int limit)
+{
+	if (sdm.NumLSHTables() == 0)
+		throw exception("Memory has no LSH tables to measure");
+
+	vector<Word> addresses;
+	vector<vector<uint32_t>> exact;
+	double exact_ms = FindExactActivations(sdm, limit, addresses, exact);
+	int initial_probes = sdm.LSHProbes();
+	bool lsh_enabled = sdm.LSHEnabled();
+	sdm.EnableLSH(true);
+
+	for (int probes : { 0, 1, 2, 4, 8 })
+	{
+		sdm.SetLSHProbes(probes);
+
+		double ms, evaluations;
+		double recall = ActivationRecall(sdm, addresses, exact, 0, ms, evaluations);
+
+		LOG_INFO("%d tables, %d probes: activation recall %.4f | %.2f ms per query (%.1fx) | %.0f distance evaluations per query",
+			sdm.NumLSHTables(),
+			probes,
+			recall,
+			ms,
+			exact_ms / ms,
+			evaluations);
+	}
+
+	sdm.SetLSHProbes(initial_probes);
+	sdm.EnableLSH(lsh_enabled);
+}
 
+/**
+ Reads the first images as addresses and finds the hard locations each one activates with a full
+ scan. Exact stats are switched on for it since they keep every index out of the way. Returns the
+ time per query in milliseconds.
+*/
+double Tester::FindExactActivations(sphere::Memory& sdm, int limit, vector<Word>& addresses, vector<vector<uint32_t>>& exact)
+{
+	limit = limit > 0 && limit <= data.Images.size() ? limit : data.Images.size();
+	LOG_INFO("Measuring activation recall over %d images", limit);
+
+	bool exact_stats = sdm.ExactStats();
+	sdm.SetExactStats(true);
+
+	auto start = chrono::steady_clock::now();
+	for (int img_idx = 0; img_idx < limit; img_idx++)
+	{
+		QuantizedImage& image = data.Images[img_idx];
+		addresses.push_back(Word(image.NumPixels, sdm.RangeBitLength(), image.Data, image.Length));
+		exact.push_back(sdm.FindActivated(addresses.back()));
+	}
+
+	double exact_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / limit;
+	LOG_INFO("Exact: %.2f ms per query", exact_ms);
+
+	sdm.SetExactStats(exact_stats);
+	return exact_ms;
+}
+
+/**
+ Returns the mean share of the exactly activated hard locations that the memory's current access
+ path finds, along with the time and distance evaluations per query
+*/
+double Tester::ActivationRecall(sphere::Memory& sdm, const vector<Word>& addresses, const vector<vector<uint32_t>>& exact, int nprobe, double& ms, double& evaluations)
+{
+	double recall_sum = 0;
+	long long evaluation_sum = 0;
+
+	auto start = chrono::steady_clock::now();
+	for (size_t img_idx = 0; img_idx < addresses.size(); img_idx++)
+	{
+		vector<uint32_t> found = sdm.FindActivated(addresses[img_idx], nprobe);
+		evaluation_sum += sdm.LastOPStats.DistanceEvaluations;
+
+		// Both lists are sorted so the overlap is a merge
+		vector<uint32_t> overlap;
+		set_intersection(found.begin(), found.end(), exact[img_idx].begin(), exact[img_idx].end(), back_inserter(overlap));
+		recall_sum += exact[img_idx].empty() ? 1.0 : double(overlap.size()) / exact[img_idx].size();
+	}
+
+	ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / addresses.size();
+	evaluations = double(evaluation_sum) / addresses.size();
+
+	return recall_sum / addresses.size();
+}
+
+uint8_t Tester::CueMemory(QuantizedImage& image, Memory& memory)
+{
 	Word address(image.NumPixels, memory.RangeBitLength(), image.Data, image.Length);
 
 	bool found = false;
 	Word data = memory.Read(address, found);
 
+	return RecalledLabel(data, found);
+}
+
+/**
+ Picks the most frequent label among the integers of a recalled data word; 0xFF if the read was
+ inconclusive
+*/
+uint8_t Tester::RecalledLabel(const Word& data, bool found)
+{
+	static int freq_counter[10];
+
 	if (found)
 	{
 		memset(freq_counter, 0, sizeof(int) * 10);
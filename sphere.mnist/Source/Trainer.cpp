@@ -1,17 +1,116 @@
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <filesystem>
 #include <cassert>
+#include <map>
+#include <mutex>
 
 #include "Sphere.h"
 #include "Trainer.h"
 #include "Visualizer.h"
 #include "Constants.h"
 #include "Common.h"
+#include "ThreadPool.h"
+#include "BoundedQueue.h"
 
 using namespace std;
 using namespace sphere;
 
+// Hard locations imprinted in parallel before their addresses are set, which has to happen one at a time
+#define IMPRINT_BLOCK_SIZE 4096
+
+static const char* TrainingModeNames[NUM_TRAINING_MODES] = { "Batched", "Concurrent", "Pipelined" };
+
+/**
+ Time a stage of pipelined training spent working and waiting on its queues, and the depth of its
+ input queue every time it took an item
+*/
+struct PipelineStage
+{
+	long long Items;
+	double Busy;
+	double Starved;		// Waiting for input
+	double Blocked;		// Waiting for room in the output queue
+	double DepthSum;
+	size_t MaxDepth;
+	chrono::steady_clock::time_point Mark;
+
+	PipelineStage()
+		: Items(0)
+		, Busy(0)
+		, Starved(0)
+		, Blocked(0)
+		, DepthSum(0)
+		, MaxDepth(0)
+		, Mark(chrono::steady_clock::now())
+	{
+	}
+
+	// Seconds since the previous lap
+	double Lap()
+	{
+		auto now = chrono::steady_clock::now();
+		double seconds = chrono::duration<double>(now - Mark).count();
+		Mark = now;
+		return seconds;
+	}
+
+	void SampleDepth(size_t Depth)
+	{
+		DepthSum += double(Depth);
+		MaxDepth = MAX(MaxDepth, Depth);
+	}
+
+	void Merge(const PipelineStage& Other)
+	{
+		Items += Other.Items;
+		Busy += Other.Busy;
+		Starved += Other.Starved;
+		Blocked += Other.Blocked;
+		DepthSum += Other.DepthSum;
+		MaxDepth = MAX(MaxDepth, Other.MaxDepth);
+	}
+};
+
+// Threads stages of pipelined training were merged into Stage; its times are per thread
+static void LogPipelineStage(const char* Name, const PipelineStage& Stage, int Threads, size_t QueueCapacity)
+{
+	double busy = Stage.Busy / Threads;
+	double starved = Stage.Starved / Threads;
+	double blocked = Stage.Blocked / Threads;
+	double total = MAX(busy + starved + blocked, 1e-9);
+
+	LOG_INFO("\t%s x%d: %lld images | Busy: %.2f s (%.1f%%) | Starved: %.2f s (%.1f%%) | Blocked: %.2f s (%.1f%%)",
+		Name, Threads, Stage.Items,
+		busy, busy / total * 100,
+		starved, starved / total * 100,
+		blocked, blocked / total * 100);
+
+	if (QueueCapacity > 0)
+		LOG_INFO("\t\tInput queue depth: %.1f average, %d max of %d", Stage.DepthSum / MAX(Stage.Items, 1LL), int(Stage.MaxDepth), int(QueueCapacity));
+}
+
+const char* sphere::TrainingModeName(TrainingMode Mode)
+{
+	return TrainingModeNames[int(Mode)];
+}
+
+bool sphere::ParseTrainingMode(const string& Name, TrainingMode& Mode)
+{
+	for (int i = 0; i < NUM_TRAINING_MODES; i++)
+	{
+		if (NamesMatch(Name, TrainingModeNames[i]))
+		{
+			Mode = TrainingMode(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 Trainer::Trainer()
 	: stopTraining(0)
 	, isTraining(0)
@@ -20,8 +119,9 @@ Trainer::Trainer()
 
 }
 
-Trainer::Trainer(const std::string& ImagesFile, const std::string& LabelsFile, int NumHardLocations)
+Trainer::Trainer(const std::string& ImagesFile, const std::string& LabelsFile, int NumHardLocations, const MemoryPolicy& Policy)
 	: data(ImagesFile.c_str() , LabelsFile.c_str())
+	, sdm(Policy)
 	, stopTraining(0)
 	, isTraining(0)
 	, numHardLocations(NumHardLocations)
@@ -31,11 +131,14 @@ Trainer::Trainer(const std::string& ImagesFile, const std::string& LabelsFile, i
 void Trainer::InitializeHardLocationsAddrs(float imprint_weight, float* label_weights, bool segment_imprints)
 {
 	LOG_INFO("Creating %d random hard locations", numHardLocations);
-	sdm.Initialize(WORD_NUM_DIMENSIONS, DATA_NUM_DIMENSIONS, RANGE_BIT_LEN, numHardLocations, RADIUS);
+	sdm.Initialize(WORD_NUM_DIMENSIONS, DATA_NUM_DIMENSIONS, RANGE_BIT_LEN, numHardLocations, RADIUS_FOR(sdm.Policy().Metric));
 
 
 	LOG_INFO("Imprinting hard locations with data-set average");
 
+	int threads = sdm.NumThreads() > 0 ? sdm.NumThreads() : ThreadPool::HardwareThreads();
+	unique_ptr<ThreadPool> pool = threads > 1 ? make_unique<ThreadPool>(threads, sdm.PinsThreads()) : nullptr;
+
 	if (!segment_imprints)
 	{
 		if (label_weights)
@@ -59,41 +162,73 @@ void Trainer::InitializeHardLocationsAddrs(float imprint_weight, float* label_we
 			average = data.CreateWeightedAverageImage(-1, nullptr);
 		}
 
-		int hl_idx = 0;
-		for (HardLocation& hl : sdm.HardLocations())
-		{
-			hl.Address().Imprint(average, imprint_weight, 1);
-
-			if (++hl_idx % (numHardLocations / 10) == 0)
-				LOG_INFO("Imprinting HL %d of %d", hl_idx, sdm.HardLocations().size());
-		}
+		ImprintHardLocations(0, sdm.NumHardLocations(), average, imprint_weight, pool.get());
 	}
 	else
 	{
-		int hl_per_label = sdm.HardLocations().size() / 10;
-		int hl_idx = 0;
+		// Labels get the same number of HLs give or take one, so every HL is imprinted even when the
+		// count isn't a multiple of 10
+		int label_begins[11];
+		for (int label = 0; label <= 10; label++)
+		{
+			label_begins[label] = int(int64_t(sdm.NumHardLocations()) * label / 10);
+		}
 
 		for (int label = 0; label < 10; label++)
 		{
-			LOG_INFO("Imprinting %d HLs with label '%d' average", hl_per_label, label);
+			LOG_INFO("Imprinting %d HLs with label '%d' average", label_begins[label + 1] - label_begins[label], label);
 
 			averages[label] = data.CreateWeightedAverageImage(label, nullptr);
+			ImprintHardLocations(label_begins[label], label_begins[label + 1], averages[label], imprint_weight, pool.get());
+		}
+
+		// Each label's block of HLs is now clustered around its average; let the memory skip
+		// blocks that are too far from a query. Memories with fewer than 10 HLs leave some empty.
+		for (int label = 0; label < 10; label++)
+		{
+			if (label_begins[label] < label_begins[label + 1])
+				sdm.AddSegment(label_begins[label], label_begins[label + 1]);
+		}
+	}
+
+	LOG_INFO("Finished initializing hard locations");
+}
 
-			for (int idx = 0; 
-					 idx < hl_per_label && idx < sdm.HardLocations().size();
-					 idx++)
+/**
+ Imprints the addresses of hard locations [begin, end) with target. The imprinting is spread over
+ pool a block at a time; the memory takes the new addresses one by one since setting one isn't safe
+ from several threads.
+*/
+void Trainer::ImprintHardLocations(int begin, int end, const Word& target, float imprint_weight, ThreadPool* pool)
+{
+	vector<Word> addrs(MIN(end - begin, IMPRINT_BLOCK_SIZE));
+	int progress_interval = MAX(numHardLocations / 10, 1);
+
+	for (int block_begin = begin; block_begin < end; block_begin += IMPRINT_BLOCK_SIZE)
+	{
+		int block_end = MIN(block_begin + IMPRINT_BLOCK_SIZE, end);
+
+		ParallelFor(pool, block_begin, block_end, 64, [&](int Begin, int End, int Thread)
+		{
+			for (int hl_idx = Begin; hl_idx < End; hl_idx++)
 			{
-				sdm.HardLocations()[idx + hl_idx].Address().Imprint(averages[label], imprint_weight, 1);
+				Word& addr = addrs[hl_idx - block_begin];
+				addr = sdm.HardLocationAt(hl_idx).Address();
+				addr.Imprint(target, imprint_weight, 1);
 			}
+		});
+
+		for (int hl_idx = block_begin; hl_idx < block_end;)
+		{
+			sdm.HardLocationAt(hl_idx).SetAddress(addrs[hl_idx - block_begin]);
 
-			hl_idx += hl_per_label;
+			if (++hl_idx % progress_interval == 0)
+				LOG_INFO("Imprinting HL %d of %d", hl_idx, sdm.NumHardLocations());
 		}
 	}
-
-	LOG_INFO("Finished initializing hard locations");
 }
 
-void Trainer::TrainMemory(const char* filename, int start_from, int limit, int log_distances, int save_bitmaps)
+void Trainer::TrainMemory(const char* filename, int start_from, int limit, int log_distances, int save_bitmaps, TrainingMode mode, int threads, MemoryFileFormat file_format)
 {
 	if (log_distances > 0)
 		LogDistances(log_distances);
@@ -101,19 +236,56 @@ void Trainer::TrainMemory(const char* filename, int start_from, int limit, int l
 	if (save_bitmaps > 0)
 		CreateVisualizations(save_bitmaps);
 
-	const int data_len = MAX(DATA_NUM_DIMENSIONS*RANGE_BIT_LEN, 8) / 8;
-	uint8_t* buff = new uint8_t[data_len];
-
 	int training_limit = limit > 0 && limit < data.Images.size() ? limit : data.Images.size();
 	LOG_INFO("Training started: %d images", training_limit);
 	isTraining.store(1);
 
+	auto start = chrono::steady_clock::now();
+	int count;
+
+	switch (mode)
+	{
+		case TrainingMode::Concurrent:
+			count = TrainConcurrently(training_limit, threads > 0 ? threads : ThreadPool::HardwareThreads());
+			break;
+		case TrainingMode::Pipelined:
+			// The word building and writing stages get a thread of their own
+			count = TrainPipelined(training_limit, threads > 0 ? threads : MAX(ThreadPool::HardwareThreads() - 2, 1));
+			break;
+		default:
+			count = TrainBatched(training_limit);
+			break;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	LOG_INFO("Trained %d images in %.2f s (%.1f images/sec)", count, seconds, count / MAX(seconds, 1e-9));
+
+	LOG_INFO("Analyzing hard locations");
+	HLStats stats = AnalyzeHardLocations();
+	stats.Print();
+
+	if (filename)
+	{
+		LOG_INFO("Saving memory to disk: %s", filename);
+		sdm.SaveToFile(filename, file_format);
+	}
+
+	isTraining.store(0);
+	stopTraining.store(0);
+}
+
+/**
+ Writes the images in batches so each block of hard locations is scanned once per batch, and
+ returns the number of images written
+*/
+int Trainer::TrainBatched(int training_limit)
+{
 	int count = 0;
-	for (QuantizedImage& image : data.Images)
+	while (count < data.Images.size())
 	{
 		if (count >= training_limit)
 		{
-			LOG_INFO("Training limit reached, stopping: %d", limit);
+			LOG_INFO("Training limit reached, stopping: %d", training_limit);
 			break;
 		}
 
@@ -123,42 +295,334 @@ void Trainer::TrainMemory(const char* filename, int start_from, int limit, int l
 			break;
 		}
 
-		auto& image = data.Images[count];
+		int batch_end = MIN(training_limit, count + RW_BATCH_SIZE);
+		vector<int> batch_images;
+		vector<Word> addresses;
+		vector<Word> image_datas;
 
-		if (image.Data == nullptr)
-			continue;
+		for (int img_idx = count; img_idx < batch_end; img_idx++)
+		{
+			QuantizedImage& image = data.Images[img_idx];
 
-		// Compose a data word for storing the label; a repeating 8 bit (the label) sequence
-		uint8_t pattern = (image.Label << 4) | image.Label;
-		memset(buff, pattern, data_len);
-		Word image_data(DATA_NUM_DIMENSIONS, RANGE_BIT_LEN, buff, data_len);
-		Word address(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN, image.Data, image.Length);
-		sdm.Write(address, image_data);
-
-		LOG_INFO("Stored image for '%d' (%d of %d) - Write Stats: Activated: %d (%.3f%%) | D_avg: %.2f | D_min: %.2f", 
-			int(image.Label), 
-			count, 
-			training_limit,
-			sdm.LastOPStats.Activations,
-			float(sdm.LastOPStats.Activations) / sdm.HardLocations().size() * 100,
-			sdm.LastOPStats.AverageDistance,
-			sdm.LastOPStats.MinimumDistance);
-
-		count++;
+			if (image.Data == nullptr)
+				continue;
+
+			image_datas.push_back(LabelWord(image));
+			addresses.push_back(Word(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN, image.Data, image.Length));
+			batch_images.push_back(img_idx);
+		}
+
+		vector<RWStats> write_stats = sdm.WriteBatch(addresses, image_datas);
+
+		for (int i = 0; i < batch_images.size(); i++)
+		{
+			QuantizedImage& image = data.Images[batch_images[i]];
+			const RWStats& stats = write_stats[i];
+
+			if (sdm.ExactStats())
+			{
+				LOG_INFO("Stored image for '%d' (%d of %d) - Write Stats: Activated: %d (%.3f%%) | D_avg: %.2f | D_min: %.2f | Evals: %d", 
+					int(image.Label), 
+					batch_images[i], 
+					training_limit,
+					stats.Activations,
+					float(stats.Activations) / sdm.NumHardLocations() * 100,
+					stats.AverageDistance,
+					stats.MinimumDistance,
+					stats.DistanceEvaluations);
+			}
+			else
+			{
+				LOG_INFO("Stored image for '%d' (%d of %d) - Write Stats: Activated: %d (%.3f%%) | Evals: %d", 
+					int(image.Label), 
+					batch_images[i], 
+					training_limit,
+					stats.Activations,
+					float(stats.Activations) / sdm.NumHardLocations() * 100,
+					stats.DistanceEvaluations);
+			}
+		}
+
+		count = batch_end;
 	}
 
-	LOG_INFO("Analyzing hard locations");
-	HLStats stats = AnalyzeHardLocations();
-	stats.Print();
+	return count;
+}
 
-	if (filename)
+/**
+ Hogwild training: every thread takes the next image off a shared cursor and writes it on its own,
+ scanning on that thread. Progress is logged every TRAIN_PROGRESS_INTERVAL images rather than per
+ image. Returns the number of images written.
+*/
+int Trainer::TrainConcurrently(int training_limit, int threads)
+{
+	if (!sdm.WritesCommute())
+		LOG_WARN("%s counters of %d-bit words depend on the order of the writes; concurrent training won't match sequential training", CounterModeName(sdm.Policy().Counters), RANGE_BIT_LEN);
+
+	LOG_INFO("Training with %d concurrent writers", threads);
+
+	atomic<int> cursor(0);
+	atomic<int> written(0);
+	atomic<long long> activations(0);
+
+	sdm.BeginConcurrentWrites();
+
+	ThreadPool writers(threads, sdm.PinsThreads());
+	auto write_images = [&](int Task, int Thread)
 	{
-		LOG_INFO("Saving memory to disk: %s", filename);
-		sdm.SaveToFile(filename);
+		int img_idx;
+
+		while (stopTraining.load() == 0 && (img_idx = cursor++) < training_limit)
+		{
+			QuantizedImage& image = data.Images[img_idx];
+
+			if (image.Data == nullptr)
+				continue;
+
+			Word address(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN, image.Data, image.Length);
+			RWStats stats = sdm.WriteConcurrent(address, LabelWord(image));
+			activations += stats.Activations;
+
+			int done = ++written;
+			if (done % TRAIN_PROGRESS_INTERVAL == 0)
+				LOG_INFO("Stored %d of %d images - Activated: %.1f per image", done, training_limit, double(activations.load()) / done);
+		}
+	};
+
+	try
+	{
+		writers.Run(threads, write_images);
+	}
+	catch (...)
+	{
+		sdm.EndConcurrentWrites();
+		throw;
 	}
 
-	isTraining.store(0);
-	stopTraining.store(0);
+	sdm.EndConcurrentWrites();
+
+	if (stopTraining.load() == 1)
+		LOG_INFO("Training interrupted at %d images", written.load());
+	else
+		LOG_INFO("Training limit reached, stopping: %d", training_limit);
+
+	return written.load();
+}
+
+/**
+ Pipelined training: one thread builds the address and data words, Threads threads scan for the
+ hard locations each address activates, and the calling thread writes them. Every stage is a task
+ of its own on a pool with a thread per task, pinned like the memory's threads. The stages are
+ connected by bounded queues; the writer puts the scans back in data set order, so the trained
+ memory is the same as with batched training. Returns the number of images written.
+*/
+int Trainer::TrainPipelined(int training_limit, int threads)
+{
+	struct BuiltImage
+	{
+		int Sequence;
+		Word Address;
+		Word Data;
+	};
+
+	struct ScannedImage
+	{
+		int Sequence;
+		Word Data;
+		vector<uint32_t> Activated;
+		RWStats Stats;
+	};
+
+	LOG_INFO("Training pipelined with %d scan threads", threads);
+
+	BoundedQueue<BuiltImage> built(PIPELINE_QUEUE_LEN);
+	BoundedQueue<ScannedImage> scanned(PIPELINE_QUEUE_LEN);
+	PipelineStage build_stage;
+	vector<PipelineStage> scan_stages(threads);
+	PipelineStage write_stage;
+	atomic<int> scanners_left(threads);
+
+	mutex error_lock;
+	exception_ptr error;
+
+	// Closing both queues unblocks every stage
+	auto fail = [&]()
+	{
+		{
+			lock_guard<mutex> guard(error_lock);
+			if (!error)
+				error = current_exception();
+		}
+
+		built.Close();
+		scanned.Close();
+	};
+
+	auto build_words = [&]()
+	{
+		PipelineStage& stage = build_stage;
+
+		try
+		{
+			int sequence = 0;
+
+			for (int img_idx = 0; img_idx < training_limit && stopTraining.load() == 0; img_idx++)
+			{
+				QuantizedImage& image = data.Images[img_idx];
+
+				if (image.Data == nullptr)
+					continue;
+
+				stage.Lap();
+				BuiltImage item = { sequence++, Word(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN, image.Data, image.Length), LabelWord(image) };
+				stage.Busy += stage.Lap();
+
+				bool pushed = built.Push(move(item));
+				stage.Blocked += stage.Lap();
+
+				if (!pushed)
+					break;
+
+				stage.Items++;
+			}
+		}
+		catch (...)
+		{
+			fail();
+		}
+
+		built.Close();
+	};
+
+	auto scan_words = [&](int Thread)
+	{
+		PipelineStage& stage = scan_stages[Thread];
+
+		try
+		{
+			BuiltImage item;
+			stage.Lap();
+
+			while (built.Pop(item))
+			{
+				stage.SampleDepth(built.Depth());
+				stage.Starved += stage.Lap();
+
+				ScannedImage result;
+				result.Sequence = item.Sequence;
+				result.Activated = sdm.ScanActivated(item.Address, result.Stats);
+				result.Data = move(item.Data);
+				stage.Busy += stage.Lap();
+
+				bool pushed = scanned.Push(move(result));
+				stage.Blocked += stage.Lap();
+
+				if (!pushed)
+					break;
+
+				stage.Items++;
+			}
+
+			stage.Starved += stage.Lap();
+		}
+		catch (...)
+		{
+			fail();
+		}
+
+		if (--scanners_left == 0)
+			scanned.Close();
+	};
+
+	// Scans finish out of order; they're held here until it's their turn
+	map<int, ScannedImage> pending;
+	int written = 0;
+	long long activations = 0;
+
+	auto write_words = [&]()
+	{
+		PipelineStage& stage = write_stage;
+
+		try
+		{
+			ScannedImage item;
+			stage.Lap();
+
+			while (scanned.Pop(item))
+			{
+				stage.SampleDepth(scanned.Depth());
+				pending.emplace(item.Sequence, move(item));
+
+				while (!pending.empty() && pending.begin()->first == written)
+				{
+					stage.Starved += stage.Lap();
+
+					ScannedImage& next = pending.begin()->second;
+					sdm.WriteActivated(next.Activated, next.Data);
+					activations += next.Stats.Activations;
+					pending.erase(pending.begin());
+					stage.Items++;
+
+					if (++written % TRAIN_PROGRESS_INTERVAL == 0)
+						LOG_INFO("Stored %d of %d images - Activated: %.1f per image", written, training_limit, double(activations) / written);
+
+					stage.Busy += stage.Lap();
+				}
+			}
+
+			stage.Starved += stage.Lap();
+		}
+		catch (...)
+		{
+			fail();
+		}
+	};
+
+	// A pool deals one task to each of its threads, and the calling thread takes the first; each
+	// stage catches its own errors, so none are left for Run to rethrow
+	ThreadPool stages(threads + 2, sdm.PinsThreads());
+	stages.Run(threads + 2, [&](int Task, int Thread)
+	{
+		if (Task == 0)
+			write_words();
+		else if (Task == 1)
+			build_words();
+		else
+			scan_words(Task - 2);
+	});
+
+	if (error)
+		rethrow_exception(error);
+
+	if (stopTraining.load() == 1)
+		LOG_INFO("Training interrupted at %d images", written);
+	else
+		LOG_INFO("Training limit reached, stopping: %d", training_limit);
+
+	PipelineStage scan_stage;
+	for (const PipelineStage& stage : scan_stages)
+		scan_stage.Merge(stage);
+
+	// The stage that is busy the largest share of the time limits the images/sec
+	LOG_INFO("Pipeline stages:");
+	LogPipelineStage("Build words", build_stage, 1, 0);
+	LogPipelineStage("Scan", scan_stage, threads, built.Capacity());
+	LogPipelineStage("Write", write_stage, 1, scanned.Capacity());
+	LOG_INFO("\tStalls: %llu full and %llu empty on the word queue, %llu full and %llu empty on the scan queue",
+		built.PushStalls(), built.PopStalls(), scanned.PushStalls(), scanned.PopStalls());
+
+	return written;
+}
+
+// Data word for storing the label; a repeating 8 bit (the label) sequence
+Word Trainer::LabelWord(const QuantizedImage& image)
+{
+	const int data_len = MAX(DATA_NUM_DIMENSIONS*RANGE_BIT_LEN, 8) / 8;
+	uint8_t buff[MAX(DATA_NUM_DIMENSIONS*RANGE_BIT_LEN, 8) / 8];
+
+	uint8_t pattern = (image.Label << 4) | image.Label;
+	memset(buff, pattern, data_len);
+	return Word(DATA_NUM_DIMENSIONS, RANGE_BIT_LEN, buff, data_len);
 }
 
 void Trainer::StopTraining()
@@ -192,7 +656,7 @@ void Trainer::LogDistances(uint8_t marker)
 		else if (marker_word != nullptr)
 		{
 			Word w1(WORD_NUM_DIMENSIONS, RANGE_BIT_LEN, image.Data, image.Length);
-			float dist = w1.DistanceTo(*marker_word);
+			float dist = w1.DistanceTo(*marker_word, sdm.Policy().Metric);
 
 			if (image.Label == marker)
 				LOG_INFO("**** Distance to self (%d) : %.2f ****", int(image.Label), dist);
@@ -217,14 +681,14 @@ void Trainer::CreateVisualizations(int count)
 	if (averages[0].NumDimensions())
 	{
 		// Save a visualization for each kind of HL if imprints were segmented
-		int hls_per_label = sdm.HardLocations().size() / 10;
+		int hls_per_label = sdm.NumHardLocations() / 10;
 		for (int label = 0; label < 10; label++)
 		{
 			for (int i = 0; i < count; i++)
 			{
 				int idx = hls_per_label * label + i;
 				sprintf_s(filename, "visuals\\HL-%d.bmp", idx);
-				const Word& addr = sdm.HardLocations()[idx].Address();
+				Word addr = sdm.HardLocationAt(idx).Address();
 				CreateBitmap(addr, filename, 28, 28, 6);
 			}
 		}
@@ -234,7 +698,7 @@ void Trainer::CreateVisualizations(int count)
 		for (int i = 0; i < count; i++)
 		{
 			sprintf_s(filename, "visuals\\HL-%d.bmp", i);
-			const Word& addr = sdm.HardLocations()[i].Address();
+			Word addr = sdm.HardLocationAt(i).Address();
 			CreateBitmap(addr, filename, 28, 28, 6);
 		}
 	}
@@ -261,36 +725,44 @@ void Trainer::CreateVisualizations(int count)
 	}
 }
 
+/**
+ Label stats come from the memory's write history: exact with a histogram unless one of its 16-bit
+ counts saturated, only covering the most recent writes of every hard location with a ring, and left
+ out when the history is off
+*/
 HLStats Trainer::AnalyzeHardLocations()
 {
 	HLStats stats;
-	stats.HLCount = sdm.HardLocations().size();
+	stats.HLCount = sdm.NumHardLocations();
+	stats.HistoryMode = sdm.Policy().History;
 
-	bool labelCounted[10];
+	uint32_t label_writes[WRITE_HISTORY_VALUES];
 
-	for (HardLocation& hl : sdm.HardLocations())
+	for (int i = 0; i < sdm.NumHardLocations(); i++)
 	{
-		if (hl.WriteCount() > 0)
+		HardLocation hl = sdm.HardLocationAt(i);
+
+		if (hl.WriteCount() == 0)
 		{
-			stats.TotalWrites += hl.WriteCount();
+			stats.EmptyCount++;
+			continue;
+		}
 
-			memset(labelCounted, 0, sizeof(bool) * 10);
+		stats.TotalWrites += hl.WriteCount();
 
-			for (uint8_t data : hl.WriteHistory())
-			{
-				labelCounted[data] = true;
-				stats.LabelWrites[data]++;
-			}
+		if (!hl.WriteHistogram(label_writes))
+			continue;
 
-			for (int label = 0; label < 10; label++)
-			{
-				if (labelCounted[label])
-					stats.LabelPresence[label]++;
-			}
-		}
-		else
+		for (int label = 0; label < 10; label++)
 		{
-			stats.EmptyCount++;
+			stats.LabelWrites[label] += label_writes[label];
+			stats.HistoryWrites += label_writes[label];
+
+			if (label_writes[label] > 0)
+				stats.LabelPresence[label]++;
+
+			if (stats.HistoryMode == WriteHistoryMode::Histogram && label_writes[label] == UINT16_MAX)
+				stats.SaturatedCounts++;
 		}
 	}
 
@@ -301,6 +773,9 @@ HLStats::HLStats()
 	: HLCount(0)
 	, EmptyCount(0)
 	, TotalWrites(0)
+	, HistoryWrites(0)
+	, SaturatedCounts(0)
+	, HistoryMode(WriteHistoryMode::Off)
 {
 	memset(LabelPresence, 0, sizeof(int) * 10);
 	memset(LabelWrites, 0, sizeof(int) * 10);
@@ -310,17 +785,29 @@ void HLStats::Print()
 {
 	LOG_INFO("HARD LOCATION STATS");
 	LOG_INFO("\tEmpty: %d of %d (%.2f)", EmptyCount, HLCount, float(EmptyCount) / HLCount);
-	LOG_INFO("\tTotal Writes: %d", TotalWrites);
+	LOG_INFO("\tTotal Writes: %ld", TotalWrites);
+
+	if (HistoryMode == WriteHistoryMode::Off)
+	{
+		LOG_INFO("\tNo label stats; they need a write history (--history=histogram or --history=ring)");
+		return;
+	}
+
+	if (HistoryMode == WriteHistoryMode::Ring)
+		LOG_INFO("\tLabel stats cover the last %d writes of each hard location (%ld writes)", WRITE_HISTORY_RING_LEN, HistoryWrites);
+
+	if (SaturatedCounts > 0)
+		LOG_WARN("\t%d label counts saturated at %d writes; label stats are a lower bound", SaturatedCounts, UINT16_MAX);
 
 	for (int label = 0; label < 10; label++)
 	{
-		LOG_INFO("\tLabel '%d': Presence: %d of %d (%.2f) - Representation: %d of %d (%.2f)",
+		LOG_INFO("\tLabel '%d': Presence: %d of %d (%.2f) - Representation: %d of %ld (%.2f)",
 			label,
 			LabelPresence[label],
 			HLCount,
 			float(LabelPresence[label]) / HLCount,
 			LabelWrites[label],
-			TotalWrites,
-			float(LabelWrites[label]) / TotalWrites);
+			HistoryWrites,
+			float(LabelWrites[label]) / HistoryWrites);
 	}
 }